@@ -0,0 +1,76 @@
+// Times bignum arithmetic through the arithmetic builtins, the way a Lispy
+// program would drive it: (fact 10000) as a running product and fib(100000)
+// as a running pair of sums, then the base-10 conversion of each result and
+// one large Karatsuba-sized product.
+
+#include <time.h>
+
+#include "../lispy.h"
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static lval* call2(lenv* e, lbuiltin f, lval* x, lval* y) {
+  return f(e, lval_add(lval_add(lval_sexpr(), x), y));
+}
+
+static lval* fact(lenv* e, int n) {
+  lval* x = lval_int(1);
+  for (int i = 2; i <= n; ++i)
+    x = call2(e, builtin_mul, x, lval_int(i));
+  return x;
+}
+
+static lval* fib(lenv* e, int n) {
+  lval* a = lval_int(0);
+  lval* b = lval_int(1);
+  for (int i = 0; i < n; ++i) {
+    lval* c = call2(e, builtin_add, lval_copy(a), lval_copy(b));
+    lval_del(a);
+    a = b;
+    b = c;
+  }
+  lval_del(b);
+  return a;
+}
+
+// times converting x to decimal and prints its size and leading digits
+static void report(char* name, lval* x, double t) {
+  double t0 = now();
+  char* s = lval_big_str(x);
+  double t_str = now() - t0;
+
+  printf("%-12s %10.3f %10.3f %8zu  %.12s...\n", name, t * 1e3, t_str * 1e3,
+         strlen(s), s);
+  free(s);
+}
+
+int main(void) {
+  lenv* e = lenv_new();
+  lenv_add_builtins(e);
+
+  printf("%-12s %10s %10s %8s  %s\n", "", "calc (ms)", "str (ms)", "digits",
+         "leading");
+
+  double t0 = now();
+  lval* f = fact(e, 10000);
+  report("fact 10000", f, now() - t0);
+
+  t0 = now();
+  lval* g = fib(e, 100000);
+  report("fib 100000", g, now() - t0);
+
+  // (fact 10000)^2, well above the Karatsuba threshold
+  t0 = now();
+  lval* sq = call2(e, builtin_mul, lval_copy(f), lval_copy(f));
+  report("fact^2", sq, now() - t0);
+
+  lval_del(f);
+  lval_del(g);
+  lval_del(sq);
+  lenv_del(e);
+  return 0;
+}
@@ -0,0 +1,65 @@
+// Streams values through a 3-stage pipeline: a process producing numbers,
+// a process doubling them and the interpreter's thread summing them, joined
+// by channels of growing capacity, and reports values per second. Set
+// LISPY_THREADS to compare pool sizes.
+
+#include <time.h>
+
+#include "../lispy.h"
+
+#define VALUES 200000
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static lval* eval(lispy_vm_t* vm, const char* s) {
+  return lispy_vm_eval(vm, "<bench>", s);
+}
+
+static const char* setup[] = {
+    // evaluates both, in order, for the second
+    "def {then} (\\ {a b} {b})",
+    "def {produce} (\\ {out} {then (fold (\\ {_ i} {put! out i}) () (range "
+    "0 n)) (close! out)})",
+    "def {double} (\\ {in out} {then (fold (\\ {_ i} {put! out (* 2 (take! "
+    "in))}) () (range 0 n)) (close! out)})",
+    "def {consume} (\\ {in} {fold (\\ {acc _} {+ acc (take! in)}) 0 (range "
+    "0 n)})",
+};
+
+int main(void) {
+  lispy_vm_t* vm = lispy_vm_new();
+  for (size_t i = 0; i < sizeof(setup) / sizeof(setup[0]); ++i)
+    lval_del(eval(vm, setup[i]));
+  char def[64];
+  snprintf(def, sizeof(def), "def {n} %i", VALUES);
+  lval_del(eval(vm, def));
+
+  printf("threads: %i\n", lpool_size(lpool_global()));
+  printf("%10s %12s %14s\n", "capacity", "time (ms)", "values/s");
+
+  int caps[] = {1, 16, 256, 4096};
+  for (size_t k = 0; k < sizeof(caps) / sizeof(caps[0]); ++k) {
+    snprintf(def, sizeof(def), "def {a b} (chan %i) (chan %i)", caps[k],
+             caps[k]);
+    lval_del(eval(vm, def));
+
+    double t0 = now();
+    lval_del(eval(vm, "spawn-proc {produce a}"));
+    lval_del(eval(vm, "spawn-proc {double a b}"));
+    lval* r = eval(vm, "consume b");
+    double t = now() - t0;
+
+    int64_t expect = (int64_t)VALUES * (VALUES - 1);
+    int ok = r->type == LVAL_NUM && r->inum == expect;
+    printf("%10i %12.3f %14.0f%s\n", caps[k], t * 1e3, VALUES / t,
+           ok ? "" : "  MISMATCH");
+    lval_del(r);
+  }
+
+  lispy_vm_del(vm);
+  return 0;
+}
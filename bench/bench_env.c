@@ -0,0 +1,111 @@
+// Looks symbols up in the global environment from 1 to 8 threads at once,
+// as is and behind a reader-writer lock for comparison, both quiet and
+// while another thread keeps redefining one of them, and reports lookups
+// per second.
+
+#include <pthread.h>
+#include <time.h>
+
+#include "../lispy.h"
+
+#define LOOKUPS 1000000
+
+static const char* syms[] = {"+", "head", "fold", "x", "pmap", "y", "eval"};
+#define NSYMS (sizeof(syms) / sizeof(syms[0]))
+
+static lenv* env;
+static pthread_rwlock_t rw = PTHREAD_RWLOCK_INITIALIZER;
+static int locked;
+static atomic_int writing;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void* reader(void* arg) {
+  UNUSED(arg);
+  lval* ks[NSYMS];
+  for (size_t i = 0; i < NSYMS; ++i)
+    ks[i] = lval_sym((char*)syms[i]);
+
+  long unbound = 0;
+  for (int i = 0; i < LOOKUPS; ++i) {
+    if (locked)
+      pthread_rwlock_rdlock(&rw);
+    lval* v = lenv_get(env, ks[i % NSYMS]);
+    if (locked)
+      pthread_rwlock_unlock(&rw);
+    unbound += v->type == LVAL_ERR;
+    lval_del(v);
+  }
+
+  for (size_t i = 0; i < NSYMS; ++i)
+    lval_del(ks[i]);
+  return (void*)unbound;
+}
+
+static void* writer(void* arg) {
+  UNUSED(arg);
+  lval* k = lval_sym("x");
+  for (int i = 0; atomic_load(&writing); ++i) {
+    lval* v = lval_int(i);
+    if (locked)
+      pthread_rwlock_wrlock(&rw);
+    lenv_def(env, k, v);
+    if (locked)
+      pthread_rwlock_unlock(&rw);
+    lval_del(v);
+  }
+  lval_del(k);
+  return NULL;
+}
+
+// lookups per second over n reader threads
+static double run(int n, int write) {
+  pthread_t w;
+  atomic_store(&writing, write);
+  if (write)
+    pthread_create(&w, NULL, writer, NULL);
+
+  pthread_t* ts = malloc(sizeof(pthread_t) * n);
+  double t0 = now();
+  for (int i = 0; i < n; ++i)
+    pthread_create(&ts[i], NULL, reader, NULL);
+  long unbound = 0;
+  for (int i = 0; i < n; ++i) {
+    void* r;
+    pthread_join(ts[i], &r);
+    unbound += (long)r;
+  }
+  double t = now() - t0;
+  free(ts);
+
+  atomic_store(&writing, 0);
+  if (write)
+    pthread_join(w, NULL);
+  if (unbound)
+    printf("  %li lookups failed\n", unbound);
+  return (double)n * LOOKUPS / t;
+}
+
+int main(void) {
+  lispy_vm_t* vm = lispy_vm_new();
+  env = lispy_vm_env(vm);
+  lval_del(lispy_vm_eval(vm, "<bench>", "def {x y} 1 {a b c}"));
+
+  printf("%8s %14s %14s %14s %14s\n", "threads", "rcu", "rwlock",
+         "rcu+def", "rwlock+def");
+  for (int n = 1; n <= 8; n *= 2) {
+    double r[4];
+    for (int i = 0; i < 4; ++i) {
+      locked = i % 2;
+      r[i] = run(n, i / 2);
+    }
+    printf("%8i %14.0f %14.0f %14.0f %14.0f\n", n, r[0], r[1], r[2], r[3]);
+  }
+
+  lispy_vm_del(vm);
+  return 0;
+}
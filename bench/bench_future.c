@@ -0,0 +1,60 @@
+// Times independent recursive workloads, naive fibs, evaluated one after
+// the other against spawning each as a future and awaiting them all, and a
+// recursive fib that spawns its two halves down to a cutoff. Set
+// LISPY_THREADS to compare pool sizes.
+
+#include <time.h>
+
+#include "../lispy.h"
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double timed(lispy_vm_t* vm, const char* s, lval** r) {
+  double t0 = now();
+  *r = lispy_vm_eval(vm, "<bench>", s);
+  return now() - t0;
+}
+
+static const char* setup[] = {
+    "def {fib} (\\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}})",
+    "def {pfib} (\\ {n} {if (< n 16) {fib n} {+ (await (spawn {pfib (- n "
+    "1)})) (await (spawn {pfib (- n 2)}))}})",
+    "def {ns} {18 18 18 18 18 18 18 18}",
+    "def {serial} (\\ {xs} {if (== xs {}) {{}} {join (list (fib (eval (head "
+    "xs)))) (serial (tail xs))}})",
+    "def {spawned} (\\ {xs} {if (== xs {}) {{}} {join (list (spawn {fib "
+    "(eval (head xs))})) (spawned (tail xs))}})",
+};
+
+int main(void) {
+  lispy_vm_t* vm = lispy_vm_new();
+  for (size_t i = 0; i < sizeof(setup) / sizeof(setup[0]); ++i)
+    lval_del(lispy_vm_eval(vm, "<bench>", setup[i]));
+
+  printf("threads: %i\n", lpool_size(lpool_global()));
+  printf("%18s %12s %12s %10s\n", "workload", "serial (ms)", "spawn (ms)",
+         "speedup");
+
+  const char* runs[][3] = {
+      {"8 x (fib 18)", "serial ns", "pmap await (spawned ns)"},
+      {"fib 24", "fib 24", "pfib 24"},
+  };
+  for (size_t i = 0; i < sizeof(runs) / sizeof(runs[0]); ++i) {
+    lval* serial;
+    lval* spawned;
+    double t_serial = timed(vm, runs[i][1], &serial);
+    double t_spawn = timed(vm, runs[i][2], &spawned);
+    printf("%18s %12.3f %12.3f %9.1fx%s\n", runs[i][0], t_serial * 1e3,
+           t_spawn * 1e3, t_serial / t_spawn,
+           lval_eq(serial, spawned, 1) ? "" : "  MISMATCH");
+    lval_del(serial);
+    lval_del(spawned);
+  }
+
+  lispy_vm_del(vm);
+  return 0;
+}
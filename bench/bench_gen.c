@@ -0,0 +1,73 @@
+// Sums the first n naturals made three ways, by an open range, by iterate
+// and by a generator yielding them from a fold, then walks a balanced tree
+// in order with a generator and by building the list of its values, and
+// reports the time per element.
+
+#include <time.h>
+
+#include "../lispy.h"
+
+#define ELEMENTS 100000
+#define DEPTH 10
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static lval* eval(lispy_vm_t* vm, const char* s) {
+  return lispy_vm_eval(vm, "<bench>", s);
+}
+
+static const char* setup[] = {
+    // evaluates both, in order, for the second
+    "def {then} (\\ {a b} {b})",
+    "def {sum} (\\ {s} {fold + 0 (take n s)})",
+    // a tree of the given depth, a node is {left value right}
+    "def {tree} (\\ {d v} {if (== d 0) {{}} {list (tree (- d 1) v) v (tree "
+    "(- d 1) v)}})",
+    "def {nth} (\\ {t i} {eval (head (fold (\\ {l _} {tail l}) t (range 0 "
+    "i)))})",
+    "def {walk} (\\ {t} {if (== t {}) {()} {then (walk (nth t 0)) (then "
+    "(yield (nth t 1)) (walk (nth t 2)))}})",
+    "def {values} (\\ {t} {if (== t {}) {{}} {join (values (nth t 0)) (cons "
+    "(nth t 1) (values (nth t 2)))}})",
+};
+
+// time per element of evaluating s, whose result is expect
+static void run(lispy_vm_t* vm, const char* name, const char* s, int n,
+                int64_t expect) {
+  double t0 = now();
+  lval* r = eval(vm, s);
+  double t = now() - t0;
+  int ok = r->type == LVAL_NUM && r->inum == expect;
+  printf("%-22s %12.3f %12.1f%s\n", name, t * 1e3, t * 1e9 / n,
+         ok ? "" : "  MISMATCH");
+  lval_del(r);
+}
+
+int main(void) {
+  lispy_vm_t* vm = lispy_vm_new();
+  for (size_t i = 0; i < sizeof(setup) / sizeof(setup[0]); ++i)
+    lval_del(eval(vm, setup[i]));
+  char def[64];
+  snprintf(def, sizeof(def), "def {n} %i", ELEMENTS);
+  lval_del(eval(vm, def));
+  snprintf(def, sizeof(def), "def {t} (tree %i 1)", DEPTH);
+  lval_del(eval(vm, def));
+
+  printf("%-22s %12s %12s\n", "", "time (ms)", "ns/element");
+  int64_t nats = (int64_t)ELEMENTS * (ELEMENTS - 1) / 2;
+  run(vm, "range", "sum (range 0)", ELEMENTS, nats);
+  run(vm, "iterate", "sum (iterate (\\ {i} {+ i 1}) 0)", ELEMENTS, nats);
+  run(vm, "generator", "sum (gen {fold (\\ {_ i} {yield i}) () (range 0 n)})",
+      ELEMENTS, nats);
+
+  int nodes = (1 << DEPTH) - 1;
+  run(vm, "tree, generator", "fold + 0 (gen {walk t})", nodes, nodes);
+  run(vm, "tree, list", "fold + 0 (values t)", nodes, nodes);
+
+  lispy_vm_del(vm);
+  return 0;
+}
@@ -0,0 +1,121 @@
+// Compares LVAL_MAT matmul against the same product computed over nested
+// Q-expressions with the arithmetic builtins, which is the least work a
+// nested-list Lispy program has to do (one boxed number per element, one
+// builtin call per multiply and per row-column sum).
+
+#include <time.h>
+
+#include "../lispy.h"
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static lval* nested_new(int n, int seed) {
+  lval* q = lval_qexpr();
+  for (int i = 0; i < n; ++i) {
+    lval* row = lval_qexpr();
+    for (int j = 0; j < n; ++j)
+      row = lval_add(row, lval_num((i * 7 + j * 3 + seed) % 10));
+    q = lval_add(q, row);
+  }
+  return q;
+}
+
+// c[i][j] = (+ (* a[i][0] bt[j][0]) (* a[i][1] bt[j][1]) ...)
+static lval* nested_matmul(lenv* e, lval* a, lval* bt) {
+  lval x, y;
+  lval* c = lval_qexpr();
+  for (int i = 0; i < a->count; ++i) {
+    lval* row = lval_qexpr();
+    for (int j = 0; j < bt->count; ++j) {
+      lval* sum = lval_sexpr();
+      for (int k = 0; k < a->cell[i]->count; ++k) {
+        lval* args = lval_sexpr();
+        args = lval_add(args, lval_copy(lval_peek(a->cell[i], k, &x)));
+        args = lval_add(args, lval_copy(lval_peek(bt->cell[j], k, &y)));
+        sum = lval_add(sum, builtin_mul(e, args));
+      }
+      row = lval_add(row, builtin_add(e, sum));
+    }
+    c = lval_add(c, row);
+  }
+  return c;
+}
+
+static lval* to_mat(lenv* e, lval* q) {
+  return builtin_list_to_mat(e, lval_add(lval_sexpr(), lval_copy(q)));
+}
+
+static int same(lval* q, lval* m) {
+  lval x;
+  for (int i = 0; i < m->rows; ++i)
+    for (int j = 0; j < m->cols; ++j)
+      if (lval_peek(q->cell[i], j, &x)->num != m->data[i * m->cols + j])
+        return 0;
+  return 1;
+}
+
+int main(void) {
+  lenv* e = lenv_new();
+  lenv_add_builtins(e);
+
+  printf("threads: %i\n", lpool_size(lpool_global()));
+  printf("%6s %14s %14s %10s\n", "n", "nested (ms)", "mat (ms)", "speedup");
+
+  int sizes[] = {16, 32, 64, 128, 256};
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    int n = sizes[s];
+    lval* a = nested_new(n, 1);
+    lval* b = nested_new(n, 2);
+
+    // the nested version walks columns of b as rows of its transpose
+    lval* bm = to_mat(e, b);
+    lval* bt = builtin_mat_to_list(
+        e, lval_add(lval_sexpr(),
+                    builtin_transpose(e, lval_add(lval_sexpr(), bm))));
+
+    double t0 = now();
+    lval* cq = nested_matmul(e, a, bt);
+    double t_nested = now() - t0;
+
+    lval* am = to_mat(e, a);
+    bm = to_mat(e, b);
+    t0 = now();
+    lval* cm = builtin_matmul(e, lval_add(lval_add(lval_sexpr(), am), bm));
+    double t_mat = now() - t0;
+
+    printf("%6i %14.3f %14.3f %9.1fx%s\n", n, t_nested * 1e3, t_mat * 1e3,
+           t_nested / t_mat, same(cq, cm) ? "" : "  MISMATCH");
+
+    lval_del(a);
+    lval_del(b);
+    lval_del(bt);
+    lval_del(cq);
+    lval_del(cm);
+  }
+
+  // sizes only the matrix type can handle in reasonable time
+  int large[] = {512, 1024};
+  for (size_t s = 0; s < sizeof(large) / sizeof(large[0]); ++s) {
+    int n = large[s];
+    lval* am = lval_mat(n, n);
+    lval* bm = lval_mat(n, n);
+    for (int i = 0; i < n * n; ++i) {
+      am->data[i] = i % 10;
+      bm->data[i] = (i * 3) % 10;
+    }
+
+    double t0 = now();
+    lval* cm = builtin_matmul(e, lval_add(lval_add(lval_sexpr(), am), bm));
+    double t_mat = now() - t0;
+
+    printf("%6i %14s %14.3f %10s\n", n, "-", t_mat * 1e3, "-");
+    lval_del(cm);
+  }
+
+  lenv_del(e);
+  return 0;
+}
@@ -0,0 +1,115 @@
+// Compares range and floor queries on an ordered map against the same
+// queries over a sorted association list {{k v} {k v} ...}, scanned from the
+// front the way head/tail recursion in Lispy has to.
+
+#include <time.h>
+
+#include "../lispy.h"
+
+#define QUERIES 2000
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// the key of the i-th pair
+static double key(lval* q, int i) {
+  lval tmp;
+  return lval_peek(q->cell[i], 0, &tmp)->num;
+}
+
+static lval* list_range(lval* q, double lo, double hi) {
+  lval* r = lval_qexpr();
+  for (int i = 0; i < q->count; ++i) {
+    double k = key(q, i);
+    if (k > hi)
+      break;
+    if (k >= lo)
+      r = lval_add(r, lval_copy(q->cell[i]));
+  }
+  return r;
+}
+
+static lval* list_floor(lval* q, double k) {
+  int at = -1;
+  for (int i = 0; i < q->count && key(q, i) <= k; ++i)
+    at = i;
+  return at < 0 ? lval_qexpr() : lval_copy(q->cell[at]);
+}
+
+static lval* args(lval* m, double x, double y, int n) {
+  lval* a = lval_add(lval_sexpr(), lval_copy(m));
+  a = lval_add(a, lval_num(x));
+  if (n == 3)
+    a = lval_add(a, lval_num(y));
+  return a;
+}
+
+int main(void) {
+  lenv* e = lenv_new();
+  lenv_add_builtins(e);
+
+  printf("%8s %8s %14s %14s %10s\n", "n", "query", "list (us)", "omap (us)",
+         "speedup");
+
+  int sizes[] = {1000, 10000, 100000};
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+    int n = sizes[s];
+
+    // timestamps every 10 units with a reading as the value
+    lval* list = lval_qexpr();
+    lval* m = lval_omap();
+    lval tmp;
+    for (int i = 0; i < n; ++i) {
+      lval* p = lval_add(lval_qexpr(), lval_num(i * 10));
+      p = lval_add(p, lval_num(i % 97));
+      m = lval_omap_put(m, lval_peek(p, 0, &tmp), lval_num(i % 97));
+      list = lval_add(list, p);
+    }
+
+    double t_list = 0, t_omap = 0;
+    long checksum = 0;
+    for (int i = 0; i < QUERIES; ++i) {
+      double lo = (i * 7919L) % (n * 10L);
+      double t0 = now();
+      lval* r = list_range(list, lo, lo + 100);
+      t_list += now() - t0;
+      checksum += r->count;
+      lval_del(r);
+
+      t0 = now();
+      r = builtin_omap_range(e, args(m, lo, lo + 100, 3));
+      t_omap += now() - t0;
+      checksum -= r->count;
+      lval_del(r);
+    }
+    printf("%8i %8s %14.3f %14.3f %9.1fx%s\n", n, "range", t_list / QUERIES * 1e6,
+           t_omap / QUERIES * 1e6, t_list / t_omap, checksum ? "  MISMATCH" : "");
+
+    t_list = t_omap = 0;
+    for (int i = 0; i < QUERIES; ++i) {
+      double k = (i * 7919L) % (n * 10L) + 5;
+      double t0 = now();
+      lval* r = list_floor(list, k);
+      t_list += now() - t0;
+      checksum += r->count ? lval_peek(r, 0, &tmp)->num : -1;
+      lval_del(r);
+
+      t0 = now();
+      r = builtin_omap_floor(e, args(m, k, 0, 2));
+      t_omap += now() - t0;
+      checksum -= r->count ? lval_peek(r, 0, &tmp)->num : -1;
+      lval_del(r);
+    }
+    printf("%8i %8s %14.3f %14.3f %9.1fx%s\n", n, "floor", t_list / QUERIES * 1e6,
+           t_omap / QUERIES * 1e6, t_list / t_omap, checksum ? "  MISMATCH" : "");
+
+    lval_del(list);
+    lval_del(m);
+  }
+
+  lenv_del(e);
+  return 0;
+}
@@ -0,0 +1,106 @@
+// Times pmap against calling the same CPU-heavy lambda, a naive fib, on
+// each element of a list in turn, then psum and preduce over a few million
+// numbers against serial folds of + and of a lambda, and last fib calls
+// with par-args off and on. Set LISPY_THREADS to compare pool sizes.
+
+#include <time.h>
+
+#include "../lispy.h"
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static lval* eval(lispy_vm_t* vm, const char* s) {
+  return lispy_vm_eval(vm, "<bench>", s);
+}
+
+static double timed(lispy_vm_t* vm, const char* s, lval** r) {
+  double t0 = now();
+  *r = eval(vm, s);
+  return now() - t0;
+}
+
+static lval* map(lenv* e, lval* f, lval* xs) {
+  lval* r = lval_qexpr();
+  lval tmp;
+  for (int i = 0; i < xs->count; ++i) {
+    lval* x = lval_copy(lval_peek(xs, i, &tmp));
+    r = lval_add(r, lval_call(e, f, lval_add(lval_sexpr(), x)));
+  }
+  return r;
+}
+
+int main(void) {
+  lispy_vm_t* vm = lispy_vm_new();
+  lval_del(eval(vm, "def {fib} (\\ {n} {if (< n 2) {n} {+ (fib (- n 1)) "
+                    "(fib (- n 2))}})"));
+  lval_del(eval(vm, "def {xs} (into {} (take 64 (repeat 16)))"));
+
+  lval* f = eval(vm, "fib");
+  lval* xs = eval(vm, "xs");
+
+  printf("threads: %i\n", lpool_size(lpool_global()));
+  printf("%10s %12s %12s %10s\n", "n", "map (ms)", "pmap (ms)", "speedup");
+
+  double t0 = now();
+  lval* serial = map(lispy_vm_env(vm), f, xs);
+  double t_map = now() - t0;
+
+  t0 = now();
+  lval* par = eval(vm, "pmap fib xs");
+  double t_pmap = now() - t0;
+
+  printf("%10i %12.3f %12.3f %9.1fx%s\n", 64, t_map * 1e3, t_pmap * 1e3,
+         t_map / t_pmap, lval_eq(serial, par, 1) ? "" : "  MISMATCH");
+
+  lval_del(f);
+  lval_del(xs);
+  lval_del(serial);
+  lval_del(par);
+
+  lval_del(eval(vm, "def {ints} (into {} (range 0 4000000))"));
+  lval_del(eval(vm, "def {add} (\\ {a b} {+ a b})"));
+  printf("\n%10s %12s %12s %10s\n", "reduce", "serial (ms)", "par (ms)",
+         "speedup");
+
+  const char* runs[][3] = {
+      {"psum", "fold + 0 ints", "psum ints"},
+      {"lambda", "fold add 0 (seq ints)", "preduce add ints"},
+  };
+  for (size_t i = 0; i < sizeof(runs) / sizeof(runs[0]); ++i) {
+    double t_serial = timed(vm, runs[i][1], &serial);
+    double t_par = timed(vm, runs[i][2], &par);
+    printf("%10s %12.3f %12.3f %9.1fx%s\n", runs[i][0], t_serial * 1e3,
+           t_par * 1e3, t_serial / t_par,
+           lval_eq(serial, par, 1) ? "" : "  MISMATCH");
+    lval_del(serial);
+    lval_del(par);
+  }
+
+  // the same expressions with arguments evaluated in order and, once the
+  // calls of fib have been timed, in parallel
+  printf("\n%10s %12s %12s %10s\n", "args", "serial (ms)", "par (ms)",
+         "speedup");
+  lval_del(eval(vm, "par-args 1"));
+  lval_del(eval(vm, "fib 20"));
+  const char* args[][2] = {
+      {"fib", "fib 24"},
+      {"+ fib", "+ (fib 21) (fib 21) (fib 21) (fib 21)"},
+  };
+  for (size_t i = 0; i < sizeof(args) / sizeof(args[0]); ++i) {
+    lval_del(eval(vm, "par-args 0"));
+    double t_serial = timed(vm, args[i][1], &serial);
+    lval_del(eval(vm, "par-args 1"));
+    double t_par = timed(vm, args[i][1], &par);
+    printf("%10s %12.3f %12.3f %9.1fx%s\n", args[i][0], t_serial * 1e3,
+           t_par * 1e3, t_serial / t_par,
+           lval_eq(serial, par, 1) ? "" : "  MISMATCH");
+    lval_del(serial);
+    lval_del(par);
+  }
+  lispy_vm_del(vm);
+  return 0;
+}
@@ -0,0 +1,73 @@
+// Sends a fixed number of messages spread over a growing number of green
+// processes, each summing what it receives and sending the sum back to the
+// interpreter's thread, and reports messages per second. Set LISPY_THREADS
+// to compare pool sizes.
+
+#include <time.h>
+
+#include "../lispy.h"
+
+#define MESSAGES 200000
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static lval* eval(lispy_vm_t* vm, const char* s) {
+  return lispy_vm_eval(vm, "<bench>", s);
+}
+
+int main(void) {
+  lispy_vm_t* vm = lispy_vm_new();
+  lenv* e = lispy_vm_env(vm);
+  lval_del(eval(vm, "def {boss} self"));
+  lval_del(eval(vm, "def {summer} {send boss (fold (\\ {acc _} {+ acc "
+                    "(receive self)}) 0 (range 0 n))}"));
+
+  printf("threads: %i\n", lpool_size(lpool_global()));
+  printf("%10s %12s %12s %14s\n", "procs", "spawn (ms)", "total (ms)",
+         "msgs/s");
+
+  int procs[] = {1, 8, 64, 512, 4096};
+  for (size_t k = 0; k < sizeof(procs) / sizeof(procs[0]); ++k) {
+    int n = procs[k];
+    int per = MESSAGES / n;
+    char def[64];
+    snprintf(def, sizeof(def), "def {n} %i", per);
+    lval_del(eval(vm, def));
+
+    double t0 = now();
+    lval** ps = malloc(sizeof(lval*) * n);
+    for (int i = 0; i < n; ++i)
+      ps[i] = eval(vm, "spawn-proc summer");
+    double t_spawn = now() - t0;
+
+    // round robin, so every process has messages waiting most of the time
+    for (int j = 0; j < per; ++j)
+      for (int i = 0; i < n; ++i) {
+        lval* a = lval_add(lval_sexpr(), lval_copy(ps[i]));
+        lval_del(builtin_send(e, lval_add(a, lval_int(j))));
+      }
+
+    int64_t sum = 0;
+    for (int i = 0; i < n; ++i) {
+      lval* r = eval(vm, "receive self");
+      sum += r->type == LVAL_NUM ? r->inum : 0;
+      lval_del(r);
+    }
+    double t = now() - t0;
+
+    int64_t expect = (int64_t)n * per * (per - 1) / 2;
+    printf("%10i %12.3f %12.3f %14.0f%s\n", n, t_spawn * 1e3, t * 1e3,
+           n * per / t, sum == expect ? "" : "  MISMATCH");
+
+    for (int i = 0; i < n; ++i)
+      lval_del(ps[i]);
+    free(ps);
+  }
+
+  lispy_vm_del(vm);
+  return 0;
+}
@@ -0,0 +1,115 @@
+// Feeds the server mode requests through pipes, with at most 1 or 256 of
+// them unanswered at a time, on 1 to 4 workers, and reports requests per
+// second. The server itself reports the p50 and p99 latency of each run on
+// stderr.
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lispy.h"
+
+#define REQUESTS 20000
+
+static const char* prelude =
+    "def {fib} (\\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}})\n";
+
+typedef struct client {
+  // the server's input and output
+  int in;
+  int out;
+  int depth;
+  int sent;
+  int answered;
+  int wrong;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} client;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void* send_requests(void* arg) {
+  client* c = arg;
+  char line[64];
+  for (int i = 0; i < REQUESTS; ++i) {
+    pthread_mutex_lock(&c->lock);
+    while (c->sent - c->answered >= c->depth)
+      pthread_cond_wait(&c->cond, &c->lock);
+    c->sent++;
+    pthread_mutex_unlock(&c->lock);
+    int n = snprintf(line, sizeof(line), "%i fib %i\n", i, i % 10);
+    if (write(c->in, line, n) != n)
+      break;
+  }
+  close(c->in);
+  return NULL;
+}
+
+static void* read_answers(void* arg) {
+  client* c = arg;
+  static const int fib[] = {0, 1, 1, 2, 3, 5, 8, 13, 21, 34};
+  FILE* f = fdopen(c->out, "r");
+  char* line = NULL;
+  size_t size = 0;
+  int id, x;
+  while (getline(&line, &size, f) > 0 &&
+         sscanf(line, "%i %i", &id, &x) == 2) {
+    pthread_mutex_lock(&c->lock);
+    c->answered++;
+    c->wrong += x != fib[id % 10];
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+  }
+  free(line);
+  fclose(f);
+  return NULL;
+}
+
+// requests per second at the given pipeline depth and number of workers
+static double run(const char* path, int depth, int workers) {
+  int in[2], out[2];
+  if (pipe(in) < 0 || pipe(out) < 0)
+    exit(1);
+  client c = {in[1], out[0], depth, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER,
+              PTHREAD_COND_INITIALIZER};
+  lispy_serve_opts o = {NULL, in[0], out[1], workers, path, 0, 0};
+
+  double t0 = now();
+  pthread_t sender, reader;
+  pthread_create(&sender, NULL, send_requests, &c);
+  pthread_create(&reader, NULL, read_answers, &c);
+  lispy_serve(&o);
+  close(in[0]);
+  close(out[1]);
+  pthread_join(sender, NULL);
+  pthread_join(reader, NULL);
+  double t = now() - t0;
+
+  if (c.answered != REQUESTS || c.wrong)
+    printf("  %i answers, %i wrong\n", c.answered, c.wrong);
+  return REQUESTS / t;
+}
+
+int main(void) {
+  char path[] = "/tmp/bench_serve_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0 || write(fd, prelude, strlen(prelude)) < 0)
+    return 1;
+  close(fd);
+
+  int depths[] = {1, 256};
+  for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); ++d)
+    for (int w = 1; w <= 4; w *= 2) {
+      double r = run(path, depths[d], w);
+      printf("depth %3i, %i workers: %10.0f requests/s\n", depths[d], w, r);
+      fflush(stdout);
+    }
+
+  unlink(path);
+  return 0;
+}
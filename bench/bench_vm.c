@@ -0,0 +1,82 @@
+// Measures what an interpreter instance costs to bring up and tear down
+// (grammar, global environment, builtins), then runs one interpreter per
+// thread on the same program to check that instances don't get in each
+// other's way: with nothing shared, the work should scale with the threads.
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lispy.h"
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static const char* program[] = {
+    "def {step} (\\ {acc n} {+ acc (* n n)})",
+    "fold step 0 (range 0 20000)",
+};
+
+typedef struct worker {
+  pthread_t thread;
+  int runs;
+  int ok;
+} worker;
+
+static void* run(void* arg) {
+  worker* w = arg;
+  w->ok = 1;
+  for (int i = 0; i < w->runs; ++i) {
+    lispy_vm_t* vm = lispy_vm_new();
+    lval* r = NULL;
+    for (size_t j = 0; j < sizeof(program) / sizeof(program[0]); ++j) {
+      if (r)
+        lval_del(r);
+      r = lispy_vm_eval(vm, "<bench>", program[j]);
+    }
+    // sum of squares below 20000
+    w->ok &= r->type == LVAL_NUM && r->inum == 2666466670000;
+    lval_del(r);
+    lispy_vm_del(vm);
+  }
+  return NULL;
+}
+
+int main(void) {
+  int n = 200;
+  double startup = 0;
+  double t0 = now();
+  for (int i = 0; i < n; ++i) {
+    lispy_vm_t* vm = lispy_vm_new();
+    startup += lispy_vm_stats(vm).startup;
+    lispy_vm_del(vm);
+  }
+  double total = now() - t0;
+  printf("startup: %.3f ms, new and del: %.3f ms\n", startup / n * 1e3,
+         total / n * 1e3);
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int runs = 8;
+  printf("%8s %12s %12s\n", "threads", "time (ms)", "runs/s");
+  for (int t = 1; t <= cpus && t <= 16; t *= 2) {
+    worker* ws = calloc(t, sizeof(worker));
+    t0 = now();
+    for (int i = 0; i < t; ++i) {
+      ws[i].runs = runs;
+      pthread_create(&ws[i].thread, NULL, run, &ws[i]);
+    }
+    int ok = 1;
+    for (int i = 0; i < t; ++i) {
+      pthread_join(ws[i].thread, NULL);
+      ok &= ws[i].ok;
+    }
+    double dt = now() - t0;
+    printf("%8i %12.3f %12.1f%s\n", t, dt * 1e3, t * runs / dt,
+           ok ? "" : "  MISMATCH");
+    free(ws);
+  }
+  return 0;
+}
@@ -0,0 +1,495 @@
+#include <stdatomic.h>
+
+#include "lispy.h"
+
+// Integers that overflow 64 bits become bignums: immutable, reference
+// counted sign-magnitude numbers with little-endian 64-bit limbs and no
+// leading zero limbs. Results that fit back into an int64 are demoted, so a
+// bignum is never zero and never in int64 range.
+
+__extension__ typedef unsigned __int128 ldlimb;
+
+// below this many limbs in the shorter operand schoolbook multiplication
+// beats Karatsuba's extra additions
+#define LBIG_KARATSUBA 32
+
+// the largest power of ten in a limb, used for base-10 conversion
+#define LBIG_DEC_BASE 10000000000000000000ULL
+#define LBIG_DEC_DIGITS 19
+
+// limbs in the largest finite double
+#define LBIG_DBL_LIMBS 17
+
+struct lbig {
+  atomic_int refs;
+  int neg;
+  int len;
+  uint64_t limbs[];
+};
+
+static lbig* lbig_new(int len) {
+  lbig* b = malloc(sizeof(lbig) + sizeof(uint64_t) * MAX(len, 1));
+  atomic_init(&b->refs, 1);
+  b->neg = 0;
+  b->len = len;
+  return b;
+}
+
+lbig* lbig_retain(lbig* b) {
+  if (b)
+    atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
+  return b;
+}
+
+void lbig_release(lbig* b) {
+  if (b && atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) == 1)
+    free(b);
+}
+
+// magnitudes, as raw limb arrays
+
+static int lmag_len(const uint64_t* x, int n) {
+  while (n > 0 && x[n - 1] == 0)
+    --n;
+  return n;
+}
+
+static int lmag_cmp(const uint64_t* x, int xn, const uint64_t* y, int yn) {
+  if (xn != yn)
+    return xn < yn ? -1 : 1;
+  for (int i = xn - 1; i >= 0; --i)
+    if (x[i] != y[i])
+      return x[i] < y[i] ? -1 : 1;
+  return 0;
+}
+
+// r[0..rn) += x[0..xn) with xn <= rn, returns the carry out of r
+static uint64_t lmag_add(uint64_t* r, int rn, const uint64_t* x, int xn) {
+  uint64_t carry = 0;
+  int i = 0;
+  for (; i < xn; ++i) {
+    ldlimb s = (ldlimb)r[i] + x[i] + carry;
+    r[i] = (uint64_t)s;
+    carry = (uint64_t)(s >> 64);
+  }
+  for (; carry && i < rn; ++i)
+    carry = ++r[i] == 0;
+  return carry;
+}
+
+// r[0..rn) -= x[0..xn) with xn <= rn, requires r >= x
+static void lmag_sub(uint64_t* r, int rn, const uint64_t* x, int xn) {
+  uint64_t borrow = 0;
+  int i = 0;
+  for (; i < xn; ++i) {
+    ldlimb d = (ldlimb)r[i] - x[i] - borrow;
+    r[i] = (uint64_t)d;
+    borrow = (uint64_t)(d >> 64) != 0;
+  }
+  for (; borrow && i < rn; ++i)
+    borrow = r[i]-- == 0;
+}
+
+// x[0..n) = x * m + a, returns the limb carried out
+static uint64_t lmag_mul_1(uint64_t* x, int n, uint64_t m, uint64_t a) {
+  uint64_t carry = a;
+  for (int i = 0; i < n; ++i) {
+    ldlimb t = (ldlimb)x[i] * m + carry;
+    x[i] = (uint64_t)t;
+    carry = (uint64_t)(t >> 64);
+  }
+  return carry;
+}
+
+// x[0..n) /= d in place, returns the remainder
+static uint64_t lmag_div_1(uint64_t* x, int n, uint64_t d) {
+  uint64_t rem = 0;
+  for (int i = n - 1; i >= 0; --i) {
+    ldlimb cur = ((ldlimb)rem << 64) | x[i];
+    x[i] = (uint64_t)(cur / d);
+    rem = (uint64_t)(cur % d);
+  }
+  return rem;
+}
+
+// r[0..an+bn) = a * b, r must not overlap the inputs
+static void lmag_mul_school(uint64_t* r,
+                            const uint64_t* a,
+                            int an,
+                            const uint64_t* b,
+                            int bn) {
+  memset(r, 0, sizeof(uint64_t) * (an + bn));
+  for (int i = 0; i < bn; ++i) {
+    uint64_t carry = 0;
+    for (int j = 0; j < an; ++j) {
+      ldlimb t = (ldlimb)a[j] * b[i] + r[i + j] + carry;
+      r[i + j] = (uint64_t)t;
+      carry = (uint64_t)(t >> 64);
+    }
+    r[i + an] = carry;
+  }
+}
+
+// r[0..an+bn) = a * b, r must not overlap the inputs
+static void lmag_mul(uint64_t* r,
+                     const uint64_t* a,
+                     int an,
+                     const uint64_t* b,
+                     int bn) {
+  if (an < bn) {
+    const uint64_t* t = a;
+    a = b;
+    b = t;
+    int tn = an;
+    an = bn;
+    bn = tn;
+  }
+
+  if (bn < LBIG_KARATSUBA) {
+    lmag_mul_school(r, a, an, b, bn);
+    return;
+  }
+
+  // lopsided operands: multiply b by b-sized slices of a
+  if (an >= 2 * bn) {
+    memset(r, 0, sizeof(uint64_t) * (an + bn));
+    uint64_t* t = malloc(sizeof(uint64_t) * 2 * bn);
+    for (int i = 0; i < an; i += bn) {
+      int n = MIN(bn, an - i);
+      lmag_mul(t, a + i, n, b, bn);
+      lmag_add(r + i, an + bn - i, t, n + bn);
+    }
+    free(t);
+    return;
+  }
+
+  // with a = a1 B^m + a0 and b = b1 B^m + b0,
+  // a b = z2 B^2m + ((a0 + a1)(b0 + b1) - z2 - z0) B^m + z0
+  int m = an / 2;
+  int a1n = an - m;
+  int b1n = bn - m;
+  int rn = an + bn;
+
+  // z0 and z2 go straight into their places in r
+  lmag_mul(r, a, m, b, m);
+  lmag_mul(r + 2 * m, a + m, a1n, b + m, b1n);
+
+  int san = a1n + 1;
+  int sbn = MAX(m, b1n) + 1;
+  uint64_t* sa = calloc(san + sbn + san + sbn, sizeof(uint64_t));
+  uint64_t* sb = sa + san;
+  uint64_t* mid = sb + sbn;
+
+  memcpy(sa, a + m, sizeof(uint64_t) * a1n);
+  lmag_add(sa, san, a, m);
+  if (b1n >= m) {
+    memcpy(sb, b + m, sizeof(uint64_t) * b1n);
+    lmag_add(sb, sbn, b, m);
+  } else {
+    memcpy(sb, b, sizeof(uint64_t) * m);
+    lmag_add(sb, sbn, b + m, b1n);
+  }
+  san = lmag_len(sa, san);
+  sbn = lmag_len(sb, sbn);
+
+  lmag_mul(mid, sa, san, sb, sbn);
+  int midn = lmag_len(mid, san + sbn);
+  lmag_sub(mid, midn, r, lmag_len(r, 2 * m));
+  lmag_sub(mid, midn, r + 2 * m, lmag_len(r + 2 * m, rn - 2 * m));
+  lmag_add(r + m, rn - m, mid, lmag_len(mid, midn));
+
+  free(sa);
+}
+
+// only the top two limbs can reach a double's 53 bits of mantissa
+static double lbig_to_double(lbig* b) {
+  int n = b->len;
+  double d = b->limbs[n - 1];
+  if (n > 1)
+    d = ldexp(d, 64) + b->limbs[n - 2];
+  d = ldexp(d, 64 * MAX(n - 2, 0));
+  return b->neg ? -d : d;
+}
+
+// signed magnitudes
+
+// x + y for signs xneg and yneg
+static lbig* lbig_add(const uint64_t* x,
+                      int xn,
+                      int xneg,
+                      const uint64_t* y,
+                      int yn,
+                      int yneg) {
+  // order by magnitude so the result takes the sign of x
+  if (lmag_cmp(x, xn, y, yn) < 0) {
+    const uint64_t* t = x;
+    x = y;
+    y = t;
+    int tn = xn;
+    xn = yn;
+    yn = tn;
+    int tneg = xneg;
+    xneg = yneg;
+    yneg = tneg;
+  }
+
+  lbig* r = lbig_new(xn + 1);
+  memcpy(r->limbs, x, sizeof(uint64_t) * xn);
+  r->limbs[xn] = 0;
+  if (xneg == yneg)
+    lmag_add(r->limbs, xn + 1, y, yn);
+  else
+    lmag_sub(r->limbs, xn + 1, y, yn);
+  r->neg = xneg;
+  r->len = lmag_len(r->limbs, xn + 1);
+  return r;
+}
+
+static lbig* lbig_mul(const uint64_t* x,
+                      int xn,
+                      int xneg,
+                      const uint64_t* y,
+                      int yn,
+                      int yneg) {
+  lbig* r = lbig_new(xn + yn);
+  lmag_mul(r->limbs, x, xn, y, yn);
+  r->neg = xneg != yneg;
+  r->len = lmag_len(r->limbs, xn + yn);
+  return r;
+}
+
+// x / y when y fits in a limb and divides x exactly, NULL otherwise
+static lbig* lbig_div(const uint64_t* x,
+                      int xn,
+                      int xneg,
+                      const uint64_t* y,
+                      int yn,
+                      int yneg) {
+  if (yn != 1)
+    return NULL;
+
+  lbig* r = lbig_new(xn);
+  memcpy(r->limbs, x, sizeof(uint64_t) * xn);
+  if (lmag_div_1(r->limbs, xn, y[0]) != 0) {
+    lbig_release(r);
+    return NULL;
+  }
+  r->neg = xneg != yneg;
+  r->len = lmag_len(r->limbs, xn);
+  return r;
+}
+
+// exact numbers as magnitudes, 'buf' backs the limb of an int
+static const uint64_t* lval_mag(lval* v, uint64_t* buf, int* len, int* neg) {
+  if (v->numt == LNUM_BIG) {
+    *len = v->big->len;
+    *neg = v->big->neg;
+    return v->big->limbs;
+  }
+  *neg = v->inum < 0;
+  *buf = *neg ? 0 - (uint64_t)v->inum : (uint64_t)v->inum;
+  *len = *buf != 0;
+  return buf;
+}
+
+// stores r in x, demoted to an int when it fits, takes ownership of r
+static void lval_num_set_big(lval* x, lbig* r) {
+  lbig_release(x->big);
+  x->big = NULL;
+
+  if (r->len <= 1) {
+    uint64_t m = r->len ? r->limbs[0] : 0;
+    if (m <= INT64_MAX || (r->neg && m == (uint64_t)INT64_MAX + 1)) {
+      x->numt = LNUM_INT;
+      x->inum = r->neg ? (int64_t)(0 - m) : (int64_t)m;
+      x->num = x->inum;
+      lbig_release(r);
+      return;
+    }
+  }
+
+  x->numt = LNUM_BIG;
+  x->inum = 0;
+  x->big = r;
+  x->num = lbig_to_double(r);
+}
+
+// bignum values
+
+lval* lval_read_big(const char* s) {
+  int neg = *s == '-';
+  if (neg)
+    ++s;
+
+  // fold in the digits a limb's worth of decimal at a time
+  int digits = strlen(s);
+  lbig* r = lbig_new(digits / LBIG_DEC_DIGITS + 1);
+  int n = 0;
+  while (*s) {
+    uint64_t chunk = 0;
+    uint64_t scale = 1;
+    for (int i = 0; i < LBIG_DEC_DIGITS && *s; ++i, ++s) {
+      chunk = chunk * 10 + (*s - '0');
+      scale *= 10;
+    }
+    uint64_t carry = lmag_mul_1(r->limbs, n, scale, chunk);
+    if (carry)
+      r->limbs[n++] = carry;
+  }
+  r->neg = neg;
+  r->len = n;
+
+  lval* v = lval_int(0);
+  lval_num_set_big(v, r);
+  return v;
+}
+
+// x = x op y on exact numbers, returns 0 when the result is not an exact
+// integer and the caller has to fall back to doubles
+int lval_big_apply(lval* x, lval* y, char op) {
+  uint64_t xbuf, ybuf;
+  int xn, yn, xneg, yneg;
+  const uint64_t* xm = lval_mag(x, &xbuf, &xn, &xneg);
+  const uint64_t* ym = lval_mag(y, &ybuf, &yn, &yneg);
+
+  lbig* r = NULL;
+  switch (op) {
+    case '+':
+      r = lbig_add(xm, xn, xneg, ym, yn, yneg);
+      break;
+    case '-':
+      r = lbig_add(xm, xn, xneg, ym, yn, !yneg);
+      break;
+    case '*':
+      r = lbig_mul(xm, xn, xneg, ym, yn, yneg);
+      break;
+    case '/':
+      r = lbig_div(xm, xn, xneg, ym, yn, yneg);
+      break;
+  }
+
+  if (!r)
+    return 0;
+  lval_num_set_big(x, r);
+  return 1;
+}
+
+void lval_big_neg(lval* x) {
+  uint64_t buf;
+  int n, neg;
+  const uint64_t* m = lval_mag(x, &buf, &n, &neg);
+
+  lbig* r = lbig_new(n);
+  memcpy(r->limbs, m, sizeof(uint64_t) * n);
+  r->neg = !neg;
+  lval_num_set_big(x, r);
+}
+
+// orders two exact numbers, ints or bignums, as -1, 0 or 1
+int lval_big_cmp(lval* x, lval* y) {
+  uint64_t xbuf, ybuf;
+  int xn, yn, xneg, yneg;
+  const uint64_t* xm = lval_mag(x, &xbuf, &xn, &xneg);
+  const uint64_t* ym = lval_mag(y, &ybuf, &yn, &yneg);
+  if (xneg != yneg)
+    return xneg ? -1 : 1;
+  int c = lmag_cmp(xm, xn, ym, yn);
+  return xneg ? -c : c;
+}
+
+// the magnitude of an integral double in r, which holds LBIG_DBL_LIMBS
+static int ldbl_mag(double d, uint64_t* r) {
+  d = fabs(d);
+  if (d < 18446744073709551616.0) {
+    r[0] = (uint64_t)d;
+    return r[0] != 0;
+  }
+
+  // doubles this large are integers, their 64 top bits shifted into place
+  int e = ilogb(d);
+  uint64_t m = (uint64_t)ldexp(d, 63 - e);
+  int n = (e - 63) / 64;
+  int s = (e - 63) % 64;
+  memset(r, 0, sizeof(uint64_t) * (n + 2));
+  r[n] = m << s;
+  if (s)
+    r[n + 1] = m >> (64 - s);
+  return lmag_len(r, n + 2);
+}
+
+// orders any two numbers exactly as -1, 0 or 1, or 2 when either is NaN.
+// an exact number is compared with the floor of a double, which is exact
+// too, and below the double if it equals a floor with a fraction cut off
+int lval_num_cmp(lval* x, lval* y) {
+  if (x->numt == LNUM_INT && y->numt == LNUM_INT)
+    return (x->inum > y->inum) - (x->inum < y->inum);
+  if (x->numt != LNUM_DBL && y->numt != LNUM_DBL)
+    return lval_big_cmp(x, y);
+  if (x->numt == LNUM_DBL && y->numt == LNUM_DBL) {
+    if (isnan(x->num) || isnan(y->num))
+      return 2;
+    return (x->num > y->num) - (x->num < y->num);
+  }
+  if (x->numt == LNUM_DBL) {
+    int c = lval_num_cmp(y, x);
+    return c == 2 ? c : -c;
+  }
+
+  double d = y->num;
+  if (isnan(d))
+    return 2;
+  if (isinf(d))
+    return d > 0 ? -1 : 1;
+
+  double f = floor(d);
+  uint64_t xbuf, fm[LBIG_DBL_LIMBS];
+  int xn, xneg;
+  const uint64_t* xm = lval_mag(x, &xbuf, &xn, &xneg);
+  int fn = ldbl_mag(f, fm);
+  int fneg = f < 0;
+  if (xneg != fneg)
+    return xneg ? -1 : 1;
+  int c = lmag_cmp(xm, xn, fm, fn);
+  if (c)
+    return xneg ? -c : c;
+  return f == d ? 0 : -1;
+}
+
+int lval_big_eq(lval* x, lval* y) {
+  return x->big->neg == y->big->neg &&
+         lmag_cmp(x->big->limbs, x->big->len, y->big->limbs, y->big->len) == 0;
+}
+
+// the decimal digits of a bignum in a new string
+char* lval_big_str(lval* v) {
+  lbig* b = v->big;
+  uint64_t* x = malloc(sizeof(uint64_t) * b->len);
+  memcpy(x, b->limbs, sizeof(uint64_t) * b->len);
+
+  // peel off 19 digits per pass rather than one
+  uint64_t* chunks = malloc(sizeof(uint64_t) * (b->len + b->len / 32 + 2));
+  int c = 0;
+  int n = b->len;
+  do {
+    chunks[c++] = lmag_div_1(x, n, LBIG_DEC_BASE);
+    n = lmag_len(x, n);
+  } while (n > 0);
+
+  char* s = malloc(c * LBIG_DEC_DIGITS + 2);
+  char* p = s;
+  if (b->neg)
+    *p++ = '-';
+  p += sprintf(p, "%" PRIu64, chunks[c - 1]);
+  for (int i = c - 2; i >= 0; --i)
+    p += sprintf(p, "%019" PRIu64, chunks[i]);
+
+  free(chunks);
+  free(x);
+  return s;
+}
+
+void lval_big_print(FILE* f, lval* v) {
+  char* s = lval_big_str(v);
+  fputs(s, f);
+  free(s);
+}
@@ -0,0 +1,368 @@
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "lispy.h"
+
+// Channels: (chan n) makes a channel holding up to n values, (put! c x)
+// adds x, waiting while the channel is full, (take! c) takes the oldest
+// value out, waiting while it is empty, and (close! c) ends it: puts fail
+// from then on, takes fail once what was put is taken. Values are moved
+// through, not copied, so a stage hands its result to the next one as is.
+//
+// The values sit in a bounded MPMC ring, every cell carrying a sequence
+// number that tells putters and takers whose turn it is, so neither takes
+// a lock: on the lap-th time round, 2 * lap while the cell is free and one
+// more while it holds a value. Only a caller that has to wait does: it
+// gets in line under the channel's lock, looks at the ring once more, then
+// parks if it is a process or blocks on the channel's condition if it is
+// a thread. The call that makes room or a value available wakes the first
+// in line.
+
+enum { LCHAN_PUT, LCHAN_TAKE };
+
+// the most values a channel holds, its ring takes 16 bytes a value
+#define LCHAN_MAX (1 << 24)
+
+typedef struct lchan_cell {
+  atomic_size_t seq;
+  lval* v;
+} lchan_cell;
+
+typedef struct lchan_waiter lchan_waiter;
+
+struct lchan_waiter {
+  // process to unpark, NULL for a thread blocked on the channel
+  lproc* proc;
+  // set once taken out of line by a wake
+  atomic_int woken;
+  lchan_waiter* prev;
+  lchan_waiter* next;
+};
+
+struct lchan {
+  atomic_int refs;
+  size_t size;
+  lchan_cell* cells;
+  // positions of the next put and the next take, on lines of their own
+  _Alignas(64) atomic_size_t put;
+  _Alignas(64) atomic_size_t take;
+  _Alignas(64) atomic_int closed;
+
+  // callers waiting to put and to take, in the order they came
+  atomic_int waiting[2];
+  lchan_waiter* first[2];
+  lchan_waiter* last[2];
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+};
+
+// a channel holding up to size values, NULL when there is no memory for it
+static lchan* lchan_new(size_t size) {
+  lchan_cell* cells = malloc(sizeof(lchan_cell) * size);
+  if (!cells)
+    return NULL;
+  lchan* c = aligned_alloc(_Alignof(lchan), sizeof(lchan));
+  atomic_init(&c->refs, 1);
+  c->size = size;
+  c->cells = cells;
+  for (size_t i = 0; i < size; ++i) {
+    atomic_init(&c->cells[i].seq, 0);
+    c->cells[i].v = NULL;
+  }
+  atomic_init(&c->put, 0);
+  atomic_init(&c->take, 0);
+  atomic_init(&c->closed, 0);
+  for (int i = 0; i < 2; ++i) {
+    atomic_init(&c->waiting[i], 0);
+    c->first[i] = NULL;
+    c->last[i] = NULL;
+  }
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->wake, NULL);
+  return c;
+}
+
+lchan* lchan_retain(lchan* c) {
+  atomic_fetch_add_explicit(&c->refs, 1, memory_order_relaxed);
+  return c;
+}
+
+void lchan_release(lchan* c) {
+  if (atomic_fetch_sub_explicit(&c->refs, 1, memory_order_acq_rel) != 1)
+    return;
+  // values nobody took
+  size_t take = atomic_load_explicit(&c->take, memory_order_relaxed);
+  size_t put = atomic_load_explicit(&c->put, memory_order_relaxed);
+  for (size_t i = take; i != put; ++i)
+    lval_del(c->cells[i % c->size].v);
+  free(c->cells);
+  pthread_mutex_destroy(&c->lock);
+  pthread_cond_destroy(&c->wake);
+  free(c);
+}
+
+lval* lval_chan(lchan* c) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_CHAN;
+  v->chan = c;
+  return v;
+}
+
+// ring
+
+// puts v in a free cell, 0 when the channel is full
+static int lchan_push(lchan* c, lval* v) {
+  size_t pos = atomic_load_explicit(&c->put, memory_order_relaxed);
+  while (1) {
+    lchan_cell* cell = &c->cells[pos % c->size];
+    size_t turn = pos / c->size * 2;
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    intptr_t d = (intptr_t)seq - (intptr_t)turn;
+    if (d == 0) {
+      if (atomic_compare_exchange_weak_explicit(&c->put, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        cell->v = v;
+        atomic_store_explicit(&cell->seq, turn + 1, memory_order_release);
+        return 1;
+      }
+    } else if (d < 0)
+      // the cell still holds the value put a lap ago
+      return 0;
+    else
+      pos = atomic_load_explicit(&c->put, memory_order_relaxed);
+  }
+}
+
+// takes the oldest value out, NULL when the channel is empty or its put is
+// half done
+static lval* lchan_pop(lchan* c) {
+  size_t pos = atomic_load_explicit(&c->take, memory_order_relaxed);
+  while (1) {
+    lchan_cell* cell = &c->cells[pos % c->size];
+    size_t turn = pos / c->size * 2;
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    intptr_t d = (intptr_t)seq - (intptr_t)(turn + 1);
+    if (d == 0) {
+      if (atomic_compare_exchange_weak_explicit(&c->take, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        lval* v = cell->v;
+        atomic_store_explicit(&cell->seq, turn + 2, memory_order_release);
+        return v;
+      }
+    } else if (d < 0)
+      return NULL;
+    else
+      pos = atomic_load_explicit(&c->take, memory_order_relaxed);
+  }
+}
+
+// an attempt at a put or a take: 1 when done, 0 when it has to wait, -1
+// when the channel is closed
+typedef int (*lchan_op)(lchan* c, lval** v);
+
+static int lchan_try_put(lchan* c, lval** v) {
+  if (atomic_load(&c->closed))
+    return -1;
+  return lchan_push(c, *v);
+}
+
+static int lchan_try_take(lchan* c, lval** v) {
+  if ((*v = lchan_pop(c)))
+    return 1;
+  if (!atomic_load(&c->closed))
+    return 0;
+  // a put may have finished right before the close
+  return (*v = lchan_pop(c)) ? 1 : -1;
+}
+
+// waiting
+
+static void lchan_enlist(lchan* c, int side, lchan_waiter* w) {
+  w->prev = c->last[side];
+  w->next = NULL;
+  if (w->prev)
+    w->prev->next = w;
+  else
+    c->first[side] = w;
+  c->last[side] = w;
+  atomic_fetch_add(&c->waiting[side], 1);
+}
+
+static void lchan_delist(lchan* c, int side, lchan_waiter* w) {
+  if (w->prev)
+    w->prev->next = w->next;
+  else
+    c->first[side] = w->next;
+  if (w->next)
+    w->next->prev = w->prev;
+  else
+    c->last[side] = w->prev;
+  atomic_fetch_sub(&c->waiting[side], 1);
+}
+
+// takes the first waiting on side out of line, 0 when there is none; w is
+// gone once the lock is let go, a process to unpark is kept in *p
+static int lchan_dequeue(lchan* c, int side, lproc** p) {
+  lchan_waiter* w = c->first[side];
+  if (!w)
+    return 0;
+  lchan_delist(c, side, w);
+  *p = w->proc ? lproc_retain(w->proc) : NULL;
+  atomic_store(&w->woken, 1);
+  if (!*p)
+    pthread_cond_broadcast(&c->wake);
+  return 1;
+}
+
+// outside the lock, with no workers the pool runs it right here and it
+// may use the channel
+static void lchan_unpark(lproc* p) {
+  if (!p)
+    return;
+  lproc_unpark(p);
+  lproc_release(p);
+}
+
+// wakes the first waiting on side, after a change to the ring they wait for
+static void lchan_wake(lchan* c, int side) {
+  // pairs with the fence a waiter puts between getting in line and looking
+  // at the ring, one of the two sees the other
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!atomic_load_explicit(&c->waiting[side], memory_order_relaxed))
+    return;
+  lproc* p = NULL;
+  pthread_mutex_lock(&c->lock);
+  lchan_dequeue(c, side, &p);
+  pthread_mutex_unlock(&c->lock);
+  lchan_unpark(p);
+}
+
+static void lchan_wake_all(lchan* c) {
+  for (int side = 0; side < 2; ++side)
+    while (1) {
+      lproc* p = NULL;
+      pthread_mutex_lock(&c->lock);
+      int found = lchan_dequeue(c, side, &p);
+      pthread_mutex_unlock(&c->lock);
+      if (!found)
+        break;
+      lchan_unpark(p);
+    }
+}
+
+// blocks the calling thread until w is woken, running other work from the
+// pool meanwhile; 0 when nothing else can run to wake it
+static int lchan_block(lchan* c, lchan_waiter* w) {
+  lpool* pool = lpool_global();
+  while (!atomic_load(&w->woken))
+    if (!lpool_help(pool))
+      break;
+
+  pthread_mutex_lock(&c->lock);
+  int alone = lpool_size(pool) == 1;
+  while (!atomic_load(&w->woken) && !alone)
+    pthread_cond_wait(&c->wake, &c->lock);
+  pthread_mutex_unlock(&c->lock);
+  return atomic_load(&w->woken);
+}
+
+// runs op until it is done or the channel is closed, waiting on side in
+// between; -2 when the caller can't wait
+static int lchan_wait(lenv* e, lchan* c, int side, lchan_op op, lval** v) {
+  lproc* p = lproc_of(e);
+  int r;
+  while (!(r = op(c, v))) {
+    lchan_waiter w = {p, 0, NULL, NULL};
+    pthread_mutex_lock(&c->lock);
+    lchan_enlist(c, side, &w);
+    pthread_mutex_unlock(&c->lock);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // in line now, whatever changes the ring from here on wakes it
+    int waited = 1;
+    if (!(r = op(c, v)))
+      waited = p ? lproc_park(p) : lchan_block(c, &w);
+
+    pthread_mutex_lock(&c->lock);
+    if (!atomic_load(&w.woken))
+      lchan_delist(c, side, &w);
+    pthread_mutex_unlock(&c->lock);
+    if (r)
+      break;
+    if (!waited)
+      return -2;
+  }
+
+  // a waiter on the other side may go on now
+  if (r == 1)
+    lchan_wake(c, !side);
+  return r;
+}
+
+// builtins
+
+lval* builtin_chan(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("chan", a, 1);
+  LASSERT_TYPE("chan", a, 0, LVAL_NUM);
+  lval* n = a->cell[0];
+  LASSERT(a, n->numt == LNUM_INT,
+          "Function 'chan': capacity must be an integer.");
+  LASSERT(a, n->inum >= 1 && n->inum <= LCHAN_MAX,
+          "Function 'chan': capacity must be from 1 to %i.", LCHAN_MAX);
+
+  lchan* c = lchan_new((size_t)n->inum);
+  lval_del(a);
+  if (!c)
+    return lval_err("Function 'chan': capacity too large.");
+  return lval_chan(c);
+}
+
+lval* builtin_chan_put(lenv* e, lval* a) {
+  LASSERT_NUM("put!", a, 2);
+  LASSERT_TYPE("put!", a, 0, LVAL_CHAN);
+
+  lchan* c = a->cell[0]->chan;
+  lval* v = lval_pop(a, 1);
+  int r = lchan_wait(e, c, LCHAN_PUT, lchan_try_put, &v);
+  if (r != 1)
+    lval_del(v);
+  lval_del(a);
+
+  if (r == -1)
+    return lval_err("Function 'put!': the channel is closed.");
+  if (r == -2)
+    return lval_err("Function 'put!': nothing can take from the channel.");
+  return lval_sexpr();
+}
+
+lval* builtin_chan_take(lenv* e, lval* a) {
+  LASSERT_NUM("take!", a, 1);
+  LASSERT_TYPE("take!", a, 0, LVAL_CHAN);
+
+  lval* v = NULL;
+  int r = lchan_wait(e, a->cell[0]->chan, LCHAN_TAKE, lchan_try_take, &v);
+  lval_del(a);
+
+  if (r == -1)
+    return lval_err("Function 'take!': the channel is closed.");
+  if (r == -2)
+    return lval_err("Function 'take!': nothing can put to the channel.");
+  return v;
+}
+
+lval* builtin_chan_close(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("close!", a, 1);
+  LASSERT_TYPE("close!", a, 0, LVAL_CHAN);
+
+  lchan* c = a->cell[0]->chan;
+  atomic_store(&c->closed, 1);
+  lchan_wake_all(c);
+  lval_del(a);
+  return lval_sexpr();
+}
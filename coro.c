@@ -0,0 +1,152 @@
+#include <stdint.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "lispy.h"
+
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/common_interface_defs.h>
+#endif
+#if defined(__SANITIZE_THREAD__)
+#include <sanitizer/tsan_interface.h>
+#endif
+
+// Coroutines: a function running on a stack of its own, which the thread
+// that resumes it switches to until it suspends or returns. Green
+// processes and generators are built on them. The stack is mapped lazily,
+// only the pages it touches are backed, and its lowest page turns an
+// overflow into a fault.
+//
+// Every switch is announced to the sanitizers, which would lose track of
+// the stack they are on otherwise.
+
+struct lcoro {
+  char* stack;
+  size_t size;
+  ucontext_t ctx;
+  // where the thread that resumed it goes on when it suspends
+  ucontext_t* ret;
+  void (*fn)(void*);
+  void* arg;
+  int done;
+  // what sanitizers need told on every switch, when built with them
+  void* fiber;
+  void* caller;
+  void* fake;
+  const void* ret_stack;
+  size_t ret_size;
+};
+
+// on the thread's stack, before switching to c
+static void lcoro_switch_in(lcoro* c, void** fake) {
+  UNUSED(c);
+  UNUSED(fake);
+#if defined(__SANITIZE_THREAD__)
+  c->caller = __tsan_get_current_fiber();
+  __tsan_switch_to_fiber(c->fiber, 0);
+#endif
+#if defined(__SANITIZE_ADDRESS__)
+  __sanitizer_start_switch_fiber(fake, c->stack, c->size);
+#endif
+}
+
+// on the thread's stack, once c has switched back
+static void lcoro_switched_out(void* fake) {
+  UNUSED(fake);
+#if defined(__SANITIZE_ADDRESS__)
+  __sanitizer_finish_switch_fiber(fake, NULL, NULL);
+#endif
+}
+
+// on c's stack, once switched to
+static void lcoro_switched_in(lcoro* c) {
+  UNUSED(c);
+#if defined(__SANITIZE_ADDRESS__)
+  __sanitizer_finish_switch_fiber(c->fake, &c->ret_stack, &c->ret_size);
+#endif
+}
+
+// on c's stack, before switching back to the thread, for the last time
+// when c has returned
+static void lcoro_switch_out(lcoro* c, int last) {
+  UNUSED(c);
+  UNUSED(last);
+#if defined(__SANITIZE_THREAD__)
+  __tsan_switch_to_fiber(c->caller, 0);
+#endif
+#if defined(__SANITIZE_ADDRESS__)
+  __sanitizer_start_switch_fiber(last ? NULL : &c->fake, c->ret_stack,
+                                 c->ret_size);
+#endif
+}
+
+static void lcoro_main(unsigned hi, unsigned lo) {
+  lcoro* c = (lcoro*)(((uintptr_t)hi << 32) | lo);
+  lcoro_switched_in(c);
+  c->fn(c->arg);
+  c->done = 1;
+  lcoro_switch_out(c, 1);
+  setcontext(c->ret);
+}
+
+// has c start in lcoro_main(c), with c split in two to pass as ints
+static void lcoro_make(lcoro* c) {
+  getcontext(&c->ctx);
+  c->ctx.uc_stack.ss_sp = c->stack;
+  c->ctx.uc_stack.ss_size = c->size;
+  c->ctx.uc_link = NULL;
+  makecontext(&c->ctx, (void (*)(void))lcoro_main, 2,
+              (unsigned)((uintptr_t)c >> 32), (unsigned)(uintptr_t)c);
+}
+
+// a coroutine calling fn(arg) on a stack of size bytes once first resumed,
+// NULL when there is no memory for the stack
+lcoro* lcoro_new(size_t size, void (*fn)(void*), void* arg) {
+  lcoro* c = calloc(1, sizeof(lcoro));
+  c->stack = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1,
+                  0);
+  if (c->stack == MAP_FAILED) {
+    free(c);
+    return NULL;
+  }
+  mprotect(c->stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+  c->size = size;
+  c->fn = fn;
+  c->arg = arg;
+#if defined(__SANITIZE_THREAD__)
+  c->fiber = __tsan_create_fiber(0);
+#endif
+  lcoro_make(c);
+  return c;
+}
+
+// frees c, which has either returned or never been resumed
+void lcoro_del(lcoro* c) {
+  munmap(c->stack, c->size);
+#if defined(__SANITIZE_THREAD__)
+  __tsan_destroy_fiber(c->fiber);
+#endif
+  free(c);
+}
+
+// runs c on the calling thread until it suspends or returns; 0 once it
+// has returned
+int lcoro_resume(lcoro* c) {
+  ucontext_t ret;
+  void* fake;
+  c->ret = &ret;
+  lcoro_switch_in(c, &fake);
+  swapcontext(&ret, &c->ctx);
+  lcoro_switched_out(fake);
+  return !c->done;
+}
+
+// called on c's stack, switches back to the thread that resumed it until
+// it is resumed again, maybe by another thread
+void lcoro_suspend(lcoro* c) {
+  lcoro_switch_out(c, 0);
+  swapcontext(&c->ctx, c->ret);
+  lcoro_switched_in(c);
+}
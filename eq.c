@@ -0,0 +1,336 @@
+#include "lispy.h"
+
+// Structural equality and hashing. == and != compare numbers by value
+// across kinds, equal? also requires the same kind. Q-expressions cache
+// their hash on the node (0 means not yet computed, and any change to the
+// list resets it), so telling apart two big lists that were hashed before
+// costs one comparison. Equal hash-consed values are the same entry.
+
+static uint64_t lhash_fmix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static uint64_t lhash_mix(uint64_t h, uint64_t x) {
+  return lhash_fmix(h ^ (x + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2)));
+}
+
+static uint64_t lhash_bytes(uint64_t h, const void* p, size_t n) {
+  const unsigned char* b = p;
+  h ^= 14695981039346656037ULL;
+  for (size_t i = 0; i < n; ++i)
+    h = (h ^ b[i]) * 1099511628211ULL;
+  return lhash_fmix(h);
+}
+
+// whether d holds an exact 64-bit integer value
+static int ldbl_is_int(double d) {
+  return d >= -9223372036854775808.0 && d < 9223372036854775808.0 &&
+         d == trunc(d);
+}
+
+// numbers that are == hash alike: integral doubles hash as the integer
+// they equal, and bignums lie beyond any double that does
+static uint64_t lhash_dbl(double d) {
+  if (ldbl_is_int(d))
+    return lhash_fmix((uint64_t)(int64_t)d);
+  uint64_t bits;
+  memcpy(&bits, &d, sizeof(bits));
+  return lhash_fmix(bits ^ 0x5bd1e995ULL);
+}
+
+static uint64_t lhash_num(lval* v) {
+  if (v->numt == LNUM_INT)
+    return lhash_fmix((uint64_t)v->inum);
+  return lhash_dbl(v->num);
+}
+
+// the value holding a list's storage and hash cache
+static lval* lval_canon(lval* v) {
+  return lval_is_internable(v) && v->cons ? lcons_value(v->cons) : v;
+}
+
+static uint64_t lhash_list(lval* v) {
+  v = lval_canon(v);
+  int cache = v->type == LVAL_QEXPR;
+  uint64_t h = cache ? __atomic_load_n(&v->hash, __ATOMIC_RELAXED) : 0;
+  if (h)
+    return h;
+
+  h = lhash_fmix(v->type ^ ((uint64_t)v->count << 8));
+  lval tmp;
+  for (int i = 0; i < v->count; ++i)
+    h = lhash_mix(h, lval_hash(lval_peek(v, i, &tmp)));
+  h += !h;
+
+  if (cache)
+    __atomic_store_n(&v->hash, h, __ATOMIC_RELAXED);
+  return h;
+}
+
+uint64_t lval_hash(lval* v) {
+  switch (v->type) {
+    case LVAL_NUM:
+      return lhash_num(v);
+    case LVAL_SYM:
+      return lhash_bytes(LVAL_SYM, v->sym, strlen(v->sym));
+    case LVAL_ERR:
+      return lhash_bytes(LVAL_ERR, v->err, strlen(v->err));
+
+    case LVAL_STR: {
+      if (!v->rope)
+        return lhash_bytes(LVAL_STR, v->small, v->count);
+      char* buf = malloc(v->count);
+      lval_str_flatten(v, buf);
+      uint64_t h = lhash_bytes(LVAL_STR, buf, v->count);
+      free(buf);
+      return h;
+    }
+
+    case LVAL_FUN: {
+      if (v->builtin)
+        return lhash_fmix((uintptr_t)v->builtin);
+      llambda* l = v->lambda;
+      uint64_t h = lhash_mix(lval_hash(l->formals), lval_hash(l->body));
+      return v->bound ? lhash_mix(h, lval_hash(v->bound)) : h;
+    }
+
+    case LVAL_VEC:
+    case LVAL_MAT: {
+      uint64_t h = lhash_fmix(v->type ^ ((uint64_t)v->rows << 8) ^
+                              ((uint64_t)v->cols << 36));
+      for (int i = 0; i < v->count; ++i)
+        h = lhash_mix(h, lhash_dbl(v->data[i]));
+      return h;
+    }
+
+    case LVAL_MAP:
+      return lval_map_hash(v);
+    case LVAL_OMAP:
+      return lval_omap_hash(v);
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      return lhash_list(v);
+
+    case LVAL_SEQ:
+      // sequences are unevaluated, only the same pipeline is equal
+      return lhash_fmix((uintptr_t)v->seq);
+    case LVAL_FUTURE:
+      return lhash_fmix((uintptr_t)v->future);
+    case LVAL_PROC:
+      return lhash_fmix((uintptr_t)v->proc);
+    case LVAL_CHAN:
+      return lhash_fmix((uintptr_t)v->chan);
+  }
+  return 0;
+}
+
+// strict equality also tells ints, bignums and doubles apart
+static int lval_num_eq(lval* x, lval* y, int strict) {
+  if (strict && x->numt != y->numt)
+    return 0;
+  return lval_num_cmp(x, y) == 0;
+}
+
+static int lval_str_eq(lval* x, lval* y) {
+  if (x->count != y->count)
+    return 0;
+  if (!x->rope && !y->rope)
+    return memcmp(x->small, y->small, x->count) == 0;
+  if (x->rope == y->rope)
+    return 1;
+
+  char* a = malloc(x->count);
+  char* b = malloc(y->count);
+  lval_str_flatten(x, a);
+  lval_str_flatten(y, b);
+  int eq = memcmp(a, b, x->count) == 0;
+  free(a);
+  free(b);
+  return eq;
+}
+
+// the cached hash of a list, or 0
+static uint64_t lhash_cached(lval* v) {
+  v = lval_canon(v);
+  return v->type == LVAL_QEXPR ? __atomic_load_n(&v->hash, __ATOMIC_RELAXED)
+                               : 0;
+}
+
+// pairs of values still to be compared
+typedef struct leq_stack {
+  lval** items;
+  int count;
+  int size;
+} leq_stack;
+
+static void leq_push(leq_stack* s, lval* x, lval* y) {
+  if (s->count + 2 > s->size) {
+    s->size = s->size ? s->size * 2 : 32;
+    s->items = realloc(s->items, sizeof(lval*) * s->size);
+  }
+  s->items[s->count++] = x;
+  s->items[s->count++] = y;
+}
+
+// compares the elements of two lists of the same length when either is
+// packed, which leaves nothing to descend into on that side
+static int lval_packed_eq(lval* x, lval* y, int strict) {
+  lval xtmp, ytmp;
+  for (int i = 0; i < x->count; ++i) {
+    lval* a = lval_peek(x, i, &xtmp);
+    lval* b = lval_peek(y, i, &ytmp);
+    if (a->type != LVAL_NUM || b->type != LVAL_NUM || !lval_num_eq(a, b, strict))
+      return 0;
+  }
+  return 1;
+}
+
+int lval_eq(lval* x, lval* y, int strict) {
+  leq_stack s = {NULL, 0, 0};
+  int eq = 1;
+  leq_push(&s, x, y);
+
+  while (eq && s.count) {
+    y = s.items[--s.count];
+    x = s.items[--s.count];
+    if (x == y)
+      continue;
+    if (x->type != y->type) {
+      eq = 0;
+      break;
+    }
+
+    switch (x->type) {
+      case LVAL_NUM:
+        eq = lval_num_eq(x, y, strict);
+        break;
+      case LVAL_SYM:
+        eq = (x->cons && x->cons == y->cons) || strcmp(x->sym, y->sym) == 0;
+        break;
+      case LVAL_ERR:
+        eq = strcmp(x->err, y->err) == 0;
+        break;
+      case LVAL_STR:
+        eq = lval_str_eq(x, y);
+        break;
+
+      case LVAL_FUN:
+        if (x->builtin || y->builtin) {
+          eq = x->builtin == y->builtin;
+          break;
+        }
+        // partial applications are equal when they bound equal arguments
+        if ((x->bound ? x->bound->count : 0) !=
+            (y->bound ? y->bound->count : 0)) {
+          eq = 0;
+          break;
+        }
+        if (x->bound)
+          leq_push(&s, x->bound, y->bound);
+        if (x->lambda != y->lambda) {
+          leq_push(&s, x->lambda->body, y->lambda->body);
+          leq_push(&s, x->lambda->formals, y->lambda->formals);
+        }
+        break;
+
+      case LVAL_VEC:
+      case LVAL_MAT:
+        eq = x->rows == y->rows && x->cols == y->cols && x->count == y->count;
+        for (int i = 0; eq && i < x->count; ++i)
+          eq = x->data[i] == y->data[i];
+        break;
+
+      case LVAL_MAP:
+        eq = lval_map_eq(x, y, strict);
+        break;
+      case LVAL_OMAP:
+        eq = lval_omap_eq(x, y, strict);
+        break;
+      case LVAL_SEQ:
+        eq = x->seq == y->seq;
+        break;
+      case LVAL_FUTURE:
+        eq = x->future == y->future;
+        break;
+      case LVAL_PROC:
+        eq = x->proc == y->proc;
+        break;
+      case LVAL_CHAN:
+        eq = x->chan == y->chan;
+        break;
+
+      case LVAL_SEXPR:
+      case LVAL_QEXPR: {
+        if (x->type == LVAL_QEXPR && x->cons && x->cons == y->cons)
+          break;
+        if (x->count != y->count) {
+          eq = 0;
+          break;
+        }
+
+        // lists hashed before are told apart without looking inside
+        uint64_t hx = lhash_cached(x);
+        uint64_t hy = lhash_cached(y);
+        if (hx && hy && hx != hy) {
+          eq = 0;
+          break;
+        }
+
+        if (lval_packed(x) || lval_packed(y)) {
+          eq = lval_packed_eq(x, y, strict);
+          break;
+        }
+
+        // pushed in reverse so the first elements are compared first
+        for (int i = x->count - 1; i >= 0; --i)
+          leq_push(&s, x->cell[i], y->cell[i]);
+        break;
+      }
+    }
+  }
+
+  free(s.items);
+  return eq;
+}
+
+// builtins
+
+static lval* builtin_cmp(lenv* e, lval* a, char* op) {
+  UNUSED(e);
+
+  LASSERT_NUM(op, a, 2);
+
+  int r = lval_eq(a->cell[0], a->cell[1], strcmp(op, "equal?") == 0);
+  if (strcmp(op, "!=") == 0)
+    r = !r;
+  lval_del(a);
+  return lval_int(r);
+}
+
+lval* builtin_eq(lenv* e, lval* a) {
+  return builtin_cmp(e, a, "==");
+}
+
+lval* builtin_ne(lenv* e, lval* a) {
+  return builtin_cmp(e, a, "!=");
+}
+
+lval* builtin_equal(lenv* e, lval* a) {
+  return builtin_cmp(e, a, "equal?");
+}
+
+lval* builtin_hash(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("hash", a, 1);
+
+  lval* x = lval_int((int64_t)lval_hash(a->cell[0]));
+  lval_del(a);
+  return x;
+}
@@ -0,0 +1,119 @@
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "lispy.h"
+
+// Futures: (spawn {expr}) evaluates expr as a task on the global pool
+// against a snapshot of the environments it was spawned from, taken right
+// away: a copy of the local ones and the global bindings pinned as they
+// were, still read without locks. A later def on the spawning side is not
+// seen, however the task is scheduled, and a def inside the task stays
+// there. (await f) runs other pending work until the result is in, then
+// blocks for it, and returns a copy. A failed evaluation is its error
+// value.
+
+struct lfuture {
+  atomic_int refs;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  atomic_int done;
+  lval* result;
+
+  // what the task evaluates, owned by it until it runs
+  lenv* env;
+  lval* expr;
+};
+
+static lfuture* lfuture_new(lenv* env, lval* expr) {
+  lfuture* f = malloc(sizeof(lfuture));
+  // one reference for the value, one for the task
+  atomic_init(&f->refs, 2);
+  pthread_mutex_init(&f->lock, NULL);
+  pthread_cond_init(&f->ready, NULL);
+  atomic_init(&f->done, 0);
+  f->result = NULL;
+  f->env = env;
+  f->expr = expr;
+  return f;
+}
+
+lfuture* lfuture_retain(lfuture* f) {
+  atomic_fetch_add_explicit(&f->refs, 1, memory_order_relaxed);
+  return f;
+}
+
+void lfuture_release(lfuture* f) {
+  if (atomic_fetch_sub_explicit(&f->refs, 1, memory_order_acq_rel) != 1)
+    return;
+  if (f->result)
+    lval_del(f->result);
+  pthread_mutex_destroy(&f->lock);
+  pthread_cond_destroy(&f->ready);
+  free(f);
+}
+
+lval* lval_future(lfuture* f) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_FUTURE;
+  v->future = f;
+  return v;
+}
+
+static void lfuture_task(void* ctx, int i) {
+  UNUSED(i);
+  lfuture* f = ctx;
+
+  lispy_vm_t* vm = f->env->vm;
+  lval* r = builtin_eval(f->env, lval_add(lval_sexpr(), f->expr));
+  lenv_del_chain(f->env);
+  f->env = NULL;
+  f->expr = NULL;
+
+  pthread_mutex_lock(&f->lock);
+  f->result = r;
+  atomic_store_explicit(&f->done, 1, memory_order_release);
+  pthread_cond_broadcast(&f->ready);
+  pthread_mutex_unlock(&f->lock);
+  lfuture_release(f);
+  lispy_vm_unhold(vm);
+}
+
+// builtins
+
+lval* builtin_spawn(lenv* e, lval* a) {
+  LASSERT_NUM("spawn", a, 1);
+  LASSERT_TYPE("spawn", a, 0, LVAL_QEXPR);
+
+  lenv* env = lenv_new();
+  env->par = lenv_snapshot_chain(e);
+  env->vm = e->vm;
+  env->isolated = 1;
+  lfuture* f = lfuture_new(env, lval_take(a, 0));
+  lval* v = lval_future(f);
+  lispy_vm_hold(e->vm);
+  lpool_submit(lpool_global(), lfuture_task, f);
+  return v;
+}
+
+lval* builtin_await(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("await", a, 1);
+  LASSERT_TYPE("await", a, 0, LVAL_FUTURE);
+
+  lfuture* f = a->cell[0]->future;
+  lpool* p = lpool_global();
+  while (!atomic_load_explicit(&f->done, memory_order_acquire))
+    if (!lpool_help(p))
+      break;
+
+  // nothing left to help with, the task is running elsewhere
+  pthread_mutex_lock(&f->lock);
+  while (!atomic_load_explicit(&f->done, memory_order_relaxed))
+    pthread_cond_wait(&f->ready, &f->lock);
+  lval* r = lval_copy(f->result);
+  pthread_mutex_unlock(&f->lock);
+
+  lval_del(a);
+  return r;
+}
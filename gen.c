@@ -0,0 +1,130 @@
+#include "lispy.h"
+
+// Generators: (gen {expr}) is a lazy sequence whose elements are the
+// values expr passes to (yield x) as it runs, so recursive code such as a
+// tree walk hands out one element at a time instead of building a list.
+// Each consumer runs expr afresh on a coroutine of its own, in an
+// environment of its own above a copy of the local environments gen was
+// called from: yield switches back to the consumer with x, the next
+// element it asks for switches to the body again. An error from the body
+// ends the sequence with it.
+//
+// A consumer that stops early, a take or an error, has the body unwound
+// rather than its stack thrown away: yield and every call fail from then
+// on, so what the body holds is freed on the way out.
+
+// stack of a generator's body, deep recursion is what it is for
+#define LGEN_STACK (8 * 1024 * 1024)
+
+struct lgen {
+  lcoro* co;
+  // yield only works in code running below env
+  lenv* env;
+  lval* expr;
+  // the value the last yield handed out
+  lval* out;
+  // set once the consumer let go
+  int stop;
+};
+
+// the generator whose body the thread is running, if any
+static _Thread_local lgen* lgen_self;
+_Thread_local int lgen_unwinding;
+
+static void lgen_main(void* arg) {
+  lgen* g = arg;
+  lval* r = builtin_eval(g->env, lval_add(lval_sexpr(), g->expr));
+  g->expr = NULL;
+  if (r->type == LVAL_ERR && !g->stop)
+    g->out = r;
+  else
+    lval_del(r);
+  lenv_del(g->env);
+  g->env = NULL;
+}
+
+// a generator running expr in an environment above par, NULL when there
+// is no memory for its stack
+lgen* lgen_new(lenv* par, lval* expr) {
+  lgen* g = malloc(sizeof(lgen));
+  g->co = lcoro_new(LGEN_STACK, lgen_main, g);
+  if (!g->co) {
+    lval_del(expr);
+    free(g);
+    return NULL;
+  }
+  g->env = lenv_new();
+  g->env->par = par;
+  g->env->vm = par->vm;
+  g->env->isolated = 1;
+  g->expr = expr;
+  g->out = NULL;
+  g->stop = 0;
+  return g;
+}
+
+// runs the body until it yields or ends; 0 once it has ended
+static int lgen_resume(lgen* g) {
+  lgen* self = lgen_self;
+  int unwinding = lgen_unwinding;
+  lgen_self = g;
+  lgen_unwinding = g->stop;
+  int live = lcoro_resume(g->co);
+  lgen_self = self;
+  lgen_unwinding = unwinding;
+  return live;
+}
+
+// the next value the body yields, NULL once it has ended
+lval* lgen_next(lgen* g) {
+  if (!g->co)
+    return NULL;
+  if (!lgen_resume(g)) {
+    lcoro_del(g->co);
+    g->co = NULL;
+  }
+  lval* x = g->out;
+  g->out = NULL;
+  return x;
+}
+
+void lgen_del(lgen* g) {
+  if (g->co) {
+    g->stop = 1;
+    while (lgen_resume(g))
+      ;
+    lcoro_del(g->co);
+  }
+  if (g->out)
+    lval_del(g->out);
+  free(g);
+}
+
+// whether code evaluating in e runs as g's body, and not as a task some
+// parallel builtin handed out
+static int lgen_owns(lgen* g, lenv* e) {
+  for (; e; e = e->par) {
+    if (e == g->env)
+      return 1;
+    if (e->isolated)
+      return 0;
+  }
+  return 0;
+}
+
+// builtins
+
+lval* builtin_yield(lenv* e, lval* a) {
+  LASSERT_NUM("yield", a, 1);
+  lgen* g = lgen_self;
+  LASSERT(a, g && lgen_owns(g, e),
+          "Function 'yield': not called by a generator.");
+  LASSERT(a, !g->stop, "Function 'yield': the generator was let go.");
+
+  // hand x out and wait for the next element to be asked for
+  g->out = lval_take(a, 0);
+  lcoro_suspend(g->co);
+  if (g->stop)
+    return lval_err("Function 'yield': the generator was let go.");
+  return lval_sexpr();
+}
@@ -0,0 +1,377 @@
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "lispy.h"
+
+// Hash-consing: while enabled, symbols and Q-expressions stored in an
+// environment or read from source are canonicalized through a weak table,
+// so structurally equal values share one frozen copy. Each interpreter has
+// its own table and switch; an entry keeps its table alive, so handles may
+// outlive the interpreter that made them. A handle is an
+// ordinary lval whose sym, or count, cell, ints and dbls, alias the
+// canonical value; code that modifies a list thaws it into private storage
+// first.
+// Entries leave the table when their last handle goes away.
+
+struct lcons {
+  atomic_int refs;
+  uint64_t hash;
+  // storage the canonical value holds beyond its handles
+  size_t bytes;
+  lval* val;
+  lcons* next;
+  lcons_table* tab;
+};
+
+struct lcons_table {
+  atomic_int on;
+  pthread_mutex_t lock;
+  lcons** buckets;
+  int size;
+  int count;
+  long hits;
+  long misses;
+  long saved;
+  // its interpreter is gone, freed with its last entry
+  int dead;
+};
+
+lcons_table* lcons_table_new(void) {
+  lcons_table* t = calloc(1, sizeof(lcons_table));
+  atomic_init(&t->on, 0);
+  pthread_mutex_init(&t->lock, NULL);
+  return t;
+}
+
+static void lcons_table_free(lcons_table* t) {
+  pthread_mutex_destroy(&t->lock);
+  free(t->buckets);
+  free(t);
+}
+
+// called by the interpreter going away, the table stays while entries do
+void lcons_table_del(lcons_table* t) {
+  pthread_mutex_lock(&t->lock);
+  t->dead = 1;
+  int empty = t->count == 0;
+  pthread_mutex_unlock(&t->lock);
+  if (empty)
+    lcons_table_free(t);
+}
+
+void lcons_table_save(lcons_table* t, lispy_vm_flags_t* f) {
+  f->hashcons = atomic_load(&t->on);
+}
+
+void lcons_table_restore(lcons_table* t, const lispy_vm_flags_t* f) {
+  atomic_store(&t->on, f->hashcons);
+}
+
+static lcons_table* lcons_table_of(lenv* e) {
+  return e->vm ? lispy_vm_cons(e->vm) : NULL;
+}
+
+static uint64_t lcons_mix(uint64_t h, uint64_t x) {
+  h = (h ^ x) * 0x9e3779b97f4a7c15ULL;
+  return h ^ (h >> 32);
+}
+
+static uint64_t lcons_bytes_hash(uint64_t h, const void* p, size_t n) {
+  const unsigned char* b = p;
+  for (size_t i = 0; i < n; ++i)
+    h = (h ^ b[i]) * 1099511628211ULL;
+  return h;
+}
+
+static uint64_t lcons_num_hash(lval* v) {
+  if (v->numt == LNUM_INT)
+    return lcons_mix(LNUM_INT, v->inum);
+  uint64_t bits;
+  memcpy(&bits, &v->num, sizeof(bits));
+  return lcons_mix(v->numt, bits);
+}
+
+// the structural hash of a symbol or of a list whose children are canonical
+static uint64_t lcons_hash(lval* v) {
+  uint64_t h = 14695981039346656037ULL ^ v->type;
+  if (v->type == LVAL_SYM)
+    return lcons_bytes_hash(h, v->sym, strlen(v->sym));
+  if (v->ints)
+    return lcons_bytes_hash(h ^ LNUM_INT, v->ints, sizeof(int64_t) * v->count);
+  if (v->dbls)
+    return lcons_bytes_hash(h ^ LNUM_DBL, v->dbls, sizeof(double) * v->count);
+
+  for (int i = 0; i < v->count; ++i) {
+    lval* c = v->cell[i];
+    h = lcons_mix(h, c->type == LVAL_NUM ? lcons_num_hash(c) : c->cons->hash);
+  }
+  return h;
+}
+
+static int lcons_num_eq(lval* x, lval* y) {
+  if (x->numt != y->numt)
+    return 0;
+  if (x->numt == LNUM_INT)
+    return x->inum == y->inum;
+  if (x->numt == LNUM_BIG)
+    return lval_big_eq(x, y);
+  return memcmp(&x->num, &y->num, sizeof(double)) == 0;
+}
+
+// children of both are canonical, so lists compare one level deep
+static int lcons_same(lval* x, lval* y) {
+  if (x->type != y->type)
+    return 0;
+  if (x->type == LVAL_SYM)
+    return strcmp(x->sym, y->sym) == 0;
+
+  if (x->count != y->count || !x->ints != !y->ints || !x->dbls != !y->dbls)
+    return 0;
+  if (x->ints)
+    return memcmp(x->ints, y->ints, sizeof(int64_t) * x->count) == 0;
+  if (x->dbls)
+    return memcmp(x->dbls, y->dbls, sizeof(double) * x->count) == 0;
+
+  for (int i = 0; i < x->count; ++i) {
+    lval* a = x->cell[i];
+    lval* b = y->cell[i];
+    if (a->type == LVAL_NUM && b->type == LVAL_NUM) {
+      if (!lcons_num_eq(a, b))
+        return 0;
+    } else if (a->type == LVAL_NUM || b->type == LVAL_NUM ||
+               a->cons != b->cons) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static size_t lcons_size(lval* v) {
+  size_t n = sizeof(lval);
+  if (v->type == LVAL_SYM)
+    return n + strlen(v->sym) + 1;
+  if (v->ints)
+    return n + sizeof(int64_t) * v->count;
+  if (v->dbls)
+    return n + sizeof(double) * v->count;
+  return n + (sizeof(lval*) + sizeof(lval)) * v->count;
+}
+
+static lval* lcons_handle(lcons* c) {
+  lval* v = c->val;
+  lval* h = malloc(sizeof(lval));
+  h->type = v->type;
+  h->cons = c;
+  if (v->type == LVAL_SYM) {
+    h->sym = v->sym;
+    return h;
+  }
+  h->count = v->count;
+  h->cell = v->cell;
+  h->ints = v->ints;
+  h->dbls = v->dbls;
+  h->hash = 0;
+  return h;
+}
+
+lcons* lcons_retain(lcons* c) {
+  atomic_fetch_add_explicit(&c->refs, 1, memory_order_relaxed);
+  return c;
+}
+
+void lcons_release(lcons* c) {
+  if (atomic_fetch_sub_explicit(&c->refs, 1, memory_order_acq_rel) != 1)
+    return;
+
+  // dead entries are never revived by lookups, so this thread owns c
+  lcons_table* t = c->tab;
+  pthread_mutex_lock(&t->lock);
+  lcons** p = &t->buckets[c->hash & (t->size - 1)];
+  while (*p != c)
+    p = &(*p)->next;
+  *p = c->next;
+  t->count--;
+  int last = t->dead && t->count == 0;
+  pthread_mutex_unlock(&t->lock);
+
+  lval_del(c->val);
+  free(c);
+  if (last)
+    lcons_table_free(t);
+}
+
+// a new reference to a live entry, 0 when it is already being released
+static int lcons_try_retain(lcons* c) {
+  int refs = atomic_load_explicit(&c->refs, memory_order_relaxed);
+  while (refs > 0)
+    if (atomic_compare_exchange_weak_explicit(&c->refs, &refs, refs + 1,
+                                              memory_order_acquire,
+                                              memory_order_relaxed))
+      return 1;
+  return 0;
+}
+
+static void lcons_grow(lcons_table* t) {
+  int size = t->size ? t->size * 2 : 64;
+  lcons** buckets = calloc(size, sizeof(lcons*));
+  for (int i = 0; i < t->size; ++i)
+    for (lcons* c = t->buckets[i]; c;) {
+      lcons* next = c->next;
+      c->next = buckets[c->hash & (size - 1)];
+      buckets[c->hash & (size - 1)] = c;
+      c = next;
+    }
+  free(t->buckets);
+  t->buckets = buckets;
+  t->size = size;
+}
+
+// the only types with a cons field
+int lval_is_internable(lval* v) {
+  return v->type == LVAL_SYM || v->type == LVAL_QEXPR;
+}
+
+// the canonical entry for v in t, v is consumed
+static lcons* lcons_find(lcons_table* t, lval* v) {
+  uint64_t h = lcons_hash(v);
+
+  pthread_mutex_lock(&t->lock);
+  if (t->size)
+    for (lcons* c = t->buckets[h & (t->size - 1)]; c; c = c->next)
+      if (c->hash == h && lcons_same(c->val, v) && lcons_try_retain(c)) {
+        t->hits++;
+        t->saved += c->bytes;
+        pthread_mutex_unlock(&t->lock);
+        lval_del(v);
+        return c;
+      }
+
+  if (t->count >= t->size)
+    lcons_grow(t);
+
+  lcons* c = malloc(sizeof(lcons));
+  atomic_init(&c->refs, 1);
+  c->hash = h;
+  c->bytes = lcons_size(v);
+  c->val = v;
+  c->tab = t;
+  c->next = t->buckets[h & (t->size - 1)];
+  t->buckets[h & (t->size - 1)] = c;
+  t->count++;
+  t->misses++;
+  pthread_mutex_unlock(&t->lock);
+  return c;
+}
+
+// canonicalizes a symbol or a Q-expression of numbers, symbols and lists
+// through t, returning a handle that shares storage with equal values;
+// takes ownership of v and returns it unchanged when t is NULL or
+// hash-consing is off
+lval* lval_intern(lcons_table* t, lval* v) {
+  if (!t || !atomic_load_explicit(&t->on, memory_order_relaxed))
+    return v;
+  if (!lval_is_internable(v) || v->cons)
+    return v;
+
+  if (v->type == LVAL_QEXPR) {
+    lval_pack(v);
+    if (!lval_packed(v)) {
+      for (int i = 0; i < v->count; ++i)
+        v->cell[i] = lval_intern(t, v->cell[i]);
+
+      // lists holding functions or other mutable values stay private
+      for (int i = 0; i < v->count; ++i) {
+        lval* c = v->cell[i];
+        if (c->type != LVAL_NUM && !(lval_is_internable(c) && c->cons))
+          return v;
+      }
+    }
+  }
+
+  return lcons_handle(lcons_find(t, v));
+}
+
+// gives a handle private storage again so it can be modified
+lval* lval_thaw(lval* v) {
+  if (!lval_is_internable(v) || !v->cons)
+    return v;
+
+  lcons* c = v->cons;
+  lval* s = c->val;
+  v->cons = NULL;
+
+  if (v->type == LVAL_SYM) {
+    v->sym = malloc(strlen(s->sym) + 1);
+    strcpy(v->sym, s->sym);
+    lcons_release(c);
+    return v;
+  }
+
+  v->cell = NULL;
+  v->ints = NULL;
+  v->dbls = NULL;
+  if (s->ints) {
+    v->ints = malloc(sizeof(int64_t) * v->count);
+    memcpy(v->ints, s->ints, sizeof(int64_t) * v->count);
+  } else if (s->dbls) {
+    v->dbls = malloc(sizeof(double) * v->count);
+    memcpy(v->dbls, s->dbls, sizeof(double) * v->count);
+  } else {
+    // children stay shared
+    v->cell = malloc(sizeof(lval*) * v->count);
+    for (int i = 0; i < v->count; ++i)
+      v->cell[i] = lval_copy(s->cell[i]);
+  }
+
+  lcons_release(c);
+  return v;
+}
+
+lval* lval_cons_copy(lval* v) {
+  return lcons_handle(lcons_retain(v->cons));
+}
+
+// the frozen value shared by every handle of c
+lval* lcons_value(lcons* c) {
+  return c->val;
+}
+
+// builtins
+
+lval* builtin_hashcons(lenv* e, lval* a) {
+  LASSERT_NUM("hashcons", a, 1);
+  LASSERT_TYPE("hashcons", a, 0, LVAL_NUM);
+
+  lcons_table* t = lcons_table_of(e);
+  LASSERT(a, t, "Function 'hashcons': not running in an interpreter.");
+
+  atomic_store(&t->on, a->cell[0]->num != 0);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+static lval* lcons_stat(lval* m, char* name, long n) {
+  return lval_map_put(m, lval_sym(name), lval_int(n));
+}
+
+lval* builtin_hashcons_stats(lenv* e, lval* a) {
+  lcons_table* t = lcons_table_of(e);
+  LASSERT(a, t, "Function 'hashcons-stats': not running in an interpreter.");
+
+  pthread_mutex_lock(&t->lock);
+  long count = t->count;
+  long hits = t->hits;
+  long misses = t->misses;
+  long saved = t->saved;
+  pthread_mutex_unlock(&t->lock);
+
+  // bytes of duplicate storage freed by interning, over the interpreter's
+  // life
+  lval* m = lval_map();
+  m = lcons_stat(m, "entries", count);
+  m = lcons_stat(m, "hits", hits);
+  m = lcons_stat(m, "misses", misses);
+  m = lcons_stat(m, "saved", saved);
+  lval_del(a);
+  return m;
+}
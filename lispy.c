@@ -1,3 +1,5 @@
+#include <time.h>
+
 #include "lispy.h"
 
 char* lval_t_name(lval_t t) {
@@ -14,6 +16,24 @@ char* lval_t_name(lval_t t) {
       return "S-Expression";
     case LVAL_QEXPR:
       return "Q-Expression";
+    case LVAL_VEC:
+      return "Vector";
+    case LVAL_MAT:
+      return "Matrix";
+    case LVAL_MAP:
+      return "Hash Map";
+    case LVAL_OMAP:
+      return "Ordered Map";
+    case LVAL_STR:
+      return "String";
+    case LVAL_SEQ:
+      return "Sequence";
+    case LVAL_FUTURE:
+      return "Future";
+    case LVAL_PROC:
+      return "Process";
+    case LVAL_CHAN:
+      return "Channel";
     default:
       return "Unknown";
   }
@@ -22,6 +42,19 @@ char* lval_t_name(lval_t t) {
 lval* lval_num(double x) {
   lval* v = malloc(sizeof(lval));
   v->type = LVAL_NUM;
+  v->numt = LNUM_DBL;
+  v->inum = 0;
+  v->big = NULL;
+  v->num = x;
+  return v;
+}
+
+lval* lval_int(int64_t x) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_NUM;
+  v->numt = LNUM_INT;
+  v->inum = x;
+  v->big = NULL;
   v->num = x;
   return v;
 }
@@ -29,6 +62,7 @@ lval* lval_num(double x) {
 lval* lval_sym(char* s) {
   lval* v = malloc(sizeof(lval));
   v->type = LVAL_SYM;
+  v->cons = NULL;
   v->sym = malloc(strlen(s) + 1);
   strcpy(v->sym, s);
   return v;
@@ -39,6 +73,10 @@ lval* lval_sexpr(void) {
   v->type = LVAL_SEXPR;
   v->count = 0;
   v->cell = NULL;
+  v->ints = NULL;
+  v->dbls = NULL;
+  v->cons = NULL;
+  v->hash = 0;
   return v;
 }
 
@@ -47,6 +85,10 @@ lval* lval_qexpr(void) {
   v->type = LVAL_QEXPR;
   v->count = 0;
   v->cell = NULL;
+  v->ints = NULL;
+  v->dbls = NULL;
+  v->cons = NULL;
+  v->hash = 0;
   return v;
 }
 
@@ -58,12 +100,47 @@ lval* lval_fun(lbuiltin fun) {
 }
 
 lval* lval_lambda(lval* formals, lval* body) {
+  llambda* l = malloc(sizeof(llambda));
+  atomic_init(&l->refs, 1);
+  l->formals = formals;
+  l->body = body;
+  l->fbody = NULL;
+  l->fversion = 0;
+  atomic_init(&l->cost, 0);
+  atomic_init(&l->pure, 0);
+
   lval* v = malloc(sizeof(lval));
   v->type = LVAL_FUN;
   v->builtin = NULL;
-  v->env = lenv_new();
-  v->formals = formals;
-  v->body = body;
+  v->lambda = l;
+  v->bound = NULL;
+  v->memo = NULL;
+  return v;
+}
+
+static llambda* llambda_retain(llambda* l) {
+  atomic_fetch_add_explicit(&l->refs, 1, memory_order_relaxed);
+  return l;
+}
+
+static void llambda_release(llambda* l) {
+  if (atomic_fetch_sub_explicit(&l->refs, 1, memory_order_acq_rel) != 1)
+    return;
+  lval_del(l->formals);
+  lval_del(l->body);
+  if (l->fbody)
+    lval_del(l->fbody);
+  free(l);
+}
+
+// a partial application of f holding the arguments bound so far
+static lval* lval_partial(lval* f, lval* bound) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_FUN;
+  v->builtin = NULL;
+  v->lambda = llambda_retain(f->lambda);
+  v->bound = bound;
+  v->memo = lmemo_retain(f->memo);
   return v;
 }
 
@@ -91,71 +168,221 @@ lval* lval_err(char* fmt, ...) {
 lenv* lenv_new(void) {
   lenv* e = malloc(sizeof(lenv));
   e->par = NULL;
+  e->vm = NULL;
+  e->isolated = 0;
+  e->shared = 0;
+  e->pinned = 0;
   e->count = 0;
-  e->syms = NULL;
-  e->vals = NULL;
+  e->size = 0;
+  atomic_init(&e->binds, NULL);
   return e;
 }
 
-void lenv_del(lenv* e) {
-  for (int i = 0; i < e->count; ++i) {
-    free(e->syms[i]);
-    lval_del(e->vals[i]);
+static lbinds* lbinds_new(int size) {
+  lbinds* b = calloc(1, sizeof(lbinds) + sizeof(lbind) * size);
+  atomic_init(&b->refs, 1);
+  return b;
+}
+
+// drops a reference to b, the last one frees it with its bindings
+static void lbinds_release(void* p) {
+  lbinds* b = p;
+  if (atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) != 1)
+    return;
+  for (lbind* x = b->b; x->sym; ++x) {
+    free(x->sym);
+    lval_del(x->val);
   }
-  free(e->syms);
-  free(e->vals);
+  free(b);
+}
+
+void lenv_del(lenv* e) {
+  // nothing a reader could still hold outlives the environment
+  if (e->shared)
+    lrcu_barrier();
+  lbinds* b = atomic_load_explicit(&e->binds, memory_order_relaxed);
+  if (b)
+    lbinds_release(b);
   free(e);
 }
 
+// replaces the array of e by one of size entries, readers of a shared
+// environment may still be in the old one. Bindings move over unless a
+// snapshot is pinned to the old array, then they are copied.
+static void lenv_resize(lenv* e, int size) {
+  lbinds* old = atomic_load_explicit(&e->binds, memory_order_relaxed);
+  lbinds* b = lbinds_new(size);
+  int pinned =
+      old && atomic_load_explicit(&old->refs, memory_order_acquire) > 1;
+  for (int i = 0; i < e->count; ++i)
+    if (pinned) {
+      char* s = malloc(strlen(old->b[i].sym) + 1);
+      strcpy(s, old->b[i].sym);
+      atomic_init(&b->b[i].sym, s);
+      atomic_init(&b->b[i].val, lval_copy(old->b[i].val));
+    } else {
+      b->b[i] = old->b[i];
+    }
+  e->size = size;
+  atomic_store_explicit(&e->binds, b, memory_order_release);
+  if (!old)
+    return;
+  void (*del)(void*) = pinned ? lbinds_release : free;
+  if (e->shared)
+    lrcu_retire(old, del);
+  else
+    del(old);
+}
+
+// makes sure a write to e changes no pinned snapshot, only writers call it
+static void lenv_unpin(lenv* e) {
+  lbinds* b = atomic_load_explicit(&e->binds, memory_order_relaxed);
+  if (b && atomic_load_explicit(&b->refs, memory_order_acquire) > 1)
+    lenv_resize(e, e->size);
+}
+
+// binds sym to v, which it takes, in e, where sym is not bound yet
+static void lenv_append(lenv* e, char* sym, lval* v) {
+  if (e->count + 1 >= e->size)
+    lenv_resize(e, e->size ? e->size * 2 : 8);
+  else
+    lenv_unpin(e);
+  lbind* b = atomic_load_explicit(&e->binds, memory_order_relaxed)->b;
+  b += e->count++;
+  char* s = malloc(strlen(sym) + 1);
+  strcpy(s, sym);
+  atomic_store_explicit(&b->val, v, memory_order_relaxed);
+  // the symbol last, a reader stops at the first one not there yet
+  atomic_store_explicit(&b->sym, s, memory_order_release);
+}
+
 lenv* lenv_copy(lenv* e) {
-  lenv* n = malloc(sizeof(lenv));
+  if (e->pinned)
+    return lenv_pin(e);
+  lenv* n = lenv_new();
   n->par = e->par;
+  n->vm = e->vm;
+  n->isolated = e->isolated;
+  if (e->shared)
+    lrcu_read_lock();
+  lbinds* bs = atomic_load_explicit(&e->binds, memory_order_acquire);
+  lbind* b = bs ? bs->b : NULL;
+  for (char* sym; b && (sym = atomic_load(&b->sym)); ++b)
+    lenv_append(n, sym, lval_copy(atomic_load(&b->val)));
+  if (e->shared)
+    lrcu_read_unlock();
+  return n;
+}
+
+// copies e along with every environment above it short of a shared one,
+// which the copies go on reading
+lenv* lenv_copy_chain(lenv* e) {
+  if (e->shared)
+    return e;
+  lenv* n = lenv_copy(e);
+  for (lenv* c = n; c->par && !c->par->shared; c = c->par)
+    c->par = lenv_copy(c->par);
+  return n;
+}
+
+// a snapshot of the bindings of e, which it goes on reading however e
+// changes; the snapshot has no parent and takes no writes of its own
+lenv* lenv_pin(lenv* e) {
+  lenv* n = lenv_new();
+  n->vm = e->vm;
+  n->pinned = 1;
+  // writers of a shared environment check for pins under the same lock
+  if (e->shared)
+    lrcu_write_lock();
+  lbinds* b = atomic_load_explicit(&e->binds, memory_order_acquire);
+  if (b)
+    atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
   n->count = e->count;
-  n->syms = malloc(sizeof(char*) * n->count);
-  n->vals = malloc(sizeof(lval*) * n->count);
-  for (int i = 0; i < e->count; ++i) {
-    n->syms[i] = malloc(strlen(e->syms[i] + 1));
-    strcpy(n->syms[i], e->syms[i]);
-    n->vals[i] = lval_copy(e->vals[i]);
-  }
+  n->size = e->size;
+  if (e->shared)
+    lrcu_write_unlock();
+  atomic_init(&n->binds, b);
+  return n;
+}
+
+// copies e along with every environment above it, the shared one pinned as
+// it is now, so what runs in the copy does not depend on when it runs
+lenv* lenv_snapshot_chain(lenv* e) {
+  lenv* n = e->shared ? lenv_pin(e) : lenv_copy(e);
+  for (lenv* c = n; c->par; c = c->par)
+    c->par = c->par->shared ? lenv_pin(c->par) : lenv_copy(c->par);
   return n;
 }
 
+void lenv_del_chain(lenv* e) {
+  while (e && !e->shared) {
+    lenv* par = e->par;
+    lenv_del(e);
+    e = par;
+  }
+}
+
 void lenv_def(lenv* e, lval* k, lval* v) {
-  while (e->par)
+  while (e->par && !e->isolated)
     e = e->par;
+  lopt_rebind(e, k);
+  lpar_rebind(e, k);
   lenv_put(e, k, v);
 }
 
-lval* lenv_get(lenv* e, lval* k) {
-  for (int i = 0; i < e->count; ++i)
-    if (strcmp(e->syms[i], k->sym) == 0)
-      return lval_copy(e->vals[i]);
+// the binding of sym in e itself, NULL when there is none; for a shared e
+// it is only good inside a read section
+lbind* lenv_find(lenv* e, const char* sym) {
+  lbinds* bs = atomic_load_explicit(&e->binds, memory_order_acquire);
+  if (!bs)
+    return NULL;
+  lbind* b = bs->b;
+  for (char* s; (s = atomic_load_explicit(&b->sym, memory_order_acquire));
+       ++b)
+    if (strcmp(s, sym) == 0)
+      return b;
+  return NULL;
+}
 
-  if (e->par)
-    return lenv_get(e->par, k);
+lval* lenv_get(lenv* e, lval* k) {
+  for (; e; e = e->par) {
+    if (e->shared)
+      lrcu_read_lock();
+    lbind* b = lenv_find(e, k->sym);
+    lval* x = b ? lval_copy(atomic_load(&b->val)) : NULL;
+    if (e->shared)
+      lrcu_read_unlock();
+    if (x)
+      return x;
+  }
 
   return lval_err("Unbound symbol '%s'", k->sym);
 }
 
-void lenv_put(lenv* e, lval* k, lval* v) {
-  for (int i = 0; i < e->count; ++i)
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      // delete the old value
-      lval_del(e->vals[i]);
-      // assign a new value
-      e->vals[i] = lval_copy(v);
-      return;
-    }
-
-  e->count++;
-  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-  e->syms = realloc(e->syms, sizeof(char*) * e->count);
+static void lenv_val_del(void* v) {
+  lval_del(v);
+}
 
-  // copy contents of the lval and symbol
-  e->vals[e->count - 1] = lval_copy(v);
-  e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-  strcpy(e->syms[e->count - 1], k->sym);
+void lenv_put(lenv* e, lval* k, lval* v) {
+  lval* x = lval_intern(e->vm ? lispy_vm_cons(e->vm) : NULL, lval_copy(v));
+  if (e->shared)
+    lrcu_write_lock();
+
+  lenv_unpin(e);
+  lbind* b = lenv_find(e, k->sym);
+  if (b) {
+    // readers see the old value or the new one, the old one is deleted
+    // once none can hold it
+    lval* old = atomic_exchange(&b->val, x);
+    if (e->shared)
+      lrcu_retire(old, lenv_val_del);
+    else
+      lval_del(old);
+  } else
+    lenv_append(e, k->sym, x);
+
+  if (e->shared)
+    lrcu_write_unlock();
 }
 
 void lenv_add_builtin(lenv* e, char* name, lbuiltin fun) {
@@ -168,15 +395,25 @@ void lenv_add_builtin(lenv* e, char* name, lbuiltin fun) {
 
 lval* lval_read_num(mpc_ast_t* t) {
   errno = 0;
+
+  // integer literals are read exactly, anything with a fraction as a double
+  if (!strchr(t->contents, '.')) {
+    long long x = strtoll(t->contents, NULL, 10);
+    // too wide for 64 bits, read it as a bignum
+    return errno != ERANGE ? lval_int(x) : lval_read_big(t->contents);
+  }
+
   double x = strtod(t->contents, NULL);
   return errno != ERANGE ? lval_num(x) : lval_err("Invalid number");
 }
 
-lval* lval_read(mpc_ast_t* t) {
+lval* lval_read(lcons_table* c, mpc_ast_t* t) {
+  if (strstr(t->tag, "string"))
+    return lval_read_str(t);
   if (strstr(t->tag, "number"))
     return lval_read_num(t);
   if (strstr(t->tag, "symbol"))
-    return lval_sym(t->contents);
+    return lval_intern(c, lval_sym(t->contents));
 
   lval* e = NULL;
   if (strcmp(t->tag, ">") == 0)
@@ -197,15 +434,23 @@ lval* lval_read(mpc_ast_t* t) {
       continue;
     if (strcmp(t->children[i]->tag, "regex") == 0)
       continue;
-    e = lval_add(e, lval_read(t->children[i]));
+    e = lval_add(e, lval_read(c, t->children[i]));
   }
 
-  return e;
+  // literal lists are immutable, share them when hash-consing
+  return e->type == LVAL_QEXPR ? lval_intern(c, e) : e;
 }
 
 void lval_del(lval* v) {
+  if (lval_is_internable(v) && v->cons) {
+    lcons_release(v->cons);
+    free(v);
+    return;
+  }
+
   switch (v->type) {
     case LVAL_NUM:
+      lbig_release(v->big);
       break;
     case LVAL_ERR:
       free(v->err);
@@ -215,15 +460,44 @@ void lval_del(lval* v) {
       break;
     case LVAL_SEXPR:
     case LVAL_QEXPR:
-      for (int i = 0; i < v->count; ++i)
-        lval_del(v->cell[i]);
+      if (!lval_packed(v))
+        for (int i = 0; i < v->count; ++i)
+          lval_del(v->cell[i]);
       free(v->cell);
+      free(v->ints);
+      free(v->dbls);
+      break;
+    case LVAL_VEC:
+    case LVAL_MAT:
+      free(v->data);
+      break;
+    case LVAL_MAP:
+      lval_map_del(v);
+      break;
+    case LVAL_OMAP:
+      lval_omap_del(v);
+      break;
+    case LVAL_STR:
+      lval_str_del(v);
+      break;
+    case LVAL_SEQ:
+      lseq_release(v->seq);
+      break;
+    case LVAL_FUTURE:
+      lfuture_release(v->future);
+      break;
+    case LVAL_PROC:
+      lproc_release(v->proc);
+      break;
+    case LVAL_CHAN:
+      lchan_release(v->chan);
       break;
     case LVAL_FUN:
       if (!v->builtin) {
-        lenv_del(v->env);
-        lval_del(v->formals);
-        lval_del(v->body);
+        llambda_release(v->lambda);
+        if (v->bound)
+          lval_del(v->bound);
+        lmemo_release(v->memo);
       }
       break;
   }
@@ -231,7 +505,97 @@ void lval_del(lval* v) {
   free(v);
 }
 
+int lval_packed(lval* v) {
+  return v->type == LVAL_QEXPR && (v->ints || v->dbls);
+}
+
+// the i-th element of a list, boxed into 'tmp' when the list is packed
+lval* lval_peek(lval* v, int i, lval* tmp) {
+  if (!lval_packed(v))
+    return v->cell[i];
+
+  tmp->type = LVAL_NUM;
+  tmp->big = NULL;
+  if (v->ints) {
+    tmp->numt = LNUM_INT;
+    tmp->inum = v->ints[i];
+    tmp->num = tmp->inum;
+  } else {
+    tmp->numt = LNUM_DBL;
+    tmp->inum = 0;
+    tmp->num = v->dbls[i];
+  }
+  return tmp;
+}
+
+// packs a Q-expression whose elements are all numbers of one kind
+lval* lval_pack(lval* v) {
+  if (v->type != LVAL_QEXPR || v->count < 1 || lval_packed(v) ||
+      v->cell[0]->type != LVAL_NUM)
+    return v;
+
+  lnum_t t = v->cell[0]->numt;
+  for (int i = 0; i < v->count; ++i)
+    if (v->cell[i]->type != LVAL_NUM || v->cell[i]->numt != t ||
+        t == LNUM_BIG)
+      return v;
+
+  if (t == LNUM_INT) {
+    v->ints = malloc(sizeof(int64_t) * v->count);
+    for (int i = 0; i < v->count; ++i)
+      v->ints[i] = v->cell[i]->inum;
+  } else {
+    v->dbls = malloc(sizeof(double) * v->count);
+    for (int i = 0; i < v->count; ++i)
+      v->dbls[i] = v->cell[i]->num;
+  }
+
+  for (int i = 0; i < v->count; ++i)
+    lval_del(v->cell[i]);
+  free(v->cell);
+  v->cell = NULL;
+  return v;
+}
+
+// boxes the elements of a packed Q-expression back into cells
+lval* lval_unpack(lval* v) {
+  if (!lval_packed(v))
+    return v;
+
+  lval_thaw(v);
+  lval tmp;
+  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+  for (int i = 0; i < v->count; ++i)
+    v->cell[i] = lval_copy(lval_peek(v, i, &tmp));
+
+  free(v->ints);
+  free(v->dbls);
+  v->ints = NULL;
+  v->dbls = NULL;
+  return v;
+}
+
 lval* lval_add(lval* v, lval* c) {
+  lval_thaw(v);
+  v->hash = 0;
+
+  // numbers stay unboxed while they are all of the same kind
+  if (v->type == LVAL_QEXPR && c->type == LVAL_NUM) {
+    if (c->numt == LNUM_INT && (v->ints || v->count == 0)) {
+      v->ints = realloc(v->ints, sizeof(int64_t) * (v->count + 1));
+      v->ints[v->count++] = c->inum;
+      lval_del(c);
+      return v;
+    }
+    if (c->numt == LNUM_DBL && (v->dbls || v->count == 0)) {
+      v->dbls = realloc(v->dbls, sizeof(double) * (v->count + 1));
+      v->dbls[v->count++] = c->num;
+      lval_del(c);
+      return v;
+    }
+  }
+
+  lval_unpack(v);
   v->count += 1;
   v->cell = realloc(v->cell, sizeof(lval*) * v->count);
   v->cell[v->count - 1] = c;
@@ -239,6 +603,28 @@ lval* lval_add(lval* v, lval* c) {
 }
 
 lval* lval_pop(lval* v, int i) {
+  lval_thaw(v);
+  v->hash = 0;
+
+  if (lval_packed(v)) {
+    lval tmp;
+    lval* x = lval_copy(lval_peek(v, i, &tmp));
+    v->count -= 1;
+    if (v->ints)
+      memmove(&v->ints[i], &v->ints[i + 1], sizeof(int64_t) * (v->count - i));
+    else
+      memmove(&v->dbls[i], &v->dbls[i + 1], sizeof(double) * (v->count - i));
+
+    // an emptied list is no longer packed
+    if (v->count == 0) {
+      free(v->ints);
+      free(v->dbls);
+      v->ints = NULL;
+      v->dbls = NULL;
+    }
+    return x;
+  }
+
   lval* x = v->cell[i];
 
   // shift the memory after the item at "i" over the top
@@ -259,7 +645,27 @@ lval* lval_take(lval* v, int i) {
 }
 
 lval* lval_join(lval* x, lval* y) {
+  lval_thaw(x);
+  x->hash = 0;
+
+  // packed lists of the same kind join with a single copy
+  if (x->type == LVAL_QEXPR && y->ints && (x->ints || x->count == 0)) {
+    x->ints = realloc(x->ints, sizeof(int64_t) * (x->count + y->count));
+    memcpy(x->ints + x->count, y->ints, sizeof(int64_t) * y->count);
+    x->count += y->count;
+    lval_del(y);
+    return x;
+  }
+  if (x->type == LVAL_QEXPR && y->dbls && (x->dbls || x->count == 0)) {
+    x->dbls = realloc(x->dbls, sizeof(double) * (x->count + y->count));
+    memcpy(x->dbls + x->count, y->dbls, sizeof(double) * y->count);
+    x->count += y->count;
+    lval_del(y);
+    return x;
+  }
+
   // add each cell from 'y' to 'x'
+  lval_unpack(y);
   while (y->count)
     x = lval_add(x, lval_pop(y, 0));
 
@@ -268,6 +674,10 @@ lval* lval_join(lval* x, lval* y) {
 }
 
 lval* lval_copy(lval* v) {
+  // hash-consed values share their storage
+  if (lval_is_internable(v) && v->cons)
+    return lval_cons_copy(v);
+
   lval* x = malloc(sizeof(lval));
   x->type = v->type;
 
@@ -277,12 +687,15 @@ lval* lval_copy(lval* v) {
         x->builtin = v->builtin;
       else {
         x->builtin = NULL;
-        x->env = lenv_copy(v->env);
-        x->formals = lval_copy(v->formals);
-        x->body = lval_copy(v->body);
+        x->lambda = llambda_retain(v->lambda);
+        x->bound = v->bound ? lval_copy(v->bound) : NULL;
+        x->memo = lmemo_retain(v->memo);
       }
       break;
     case LVAL_NUM:
+      x->numt = v->numt;
+      x->inum = v->inum;
+      x->big = lbig_retain(v->big);
       x->num = v->num;
       break;
 
@@ -292,17 +705,72 @@ lval* lval_copy(lval* v) {
       break;
 
     case LVAL_SYM:
+      x->cons = NULL;
       x->sym = malloc(strlen(v->sym) + 1);
       strcpy(x->sym, v->sym);
       break;
 
     case LVAL_SEXPR:
     case LVAL_QEXPR:
-      // recursively copy sub-expressions
       x->count = v->count;
-      x->cell = malloc(sizeof(lval*) * x->count);
-      for (int i = 0; i < x->count; ++i)
-        x->cell[i] = lval_copy(v->cell[i]);
+      x->cell = NULL;
+      x->ints = NULL;
+      x->dbls = NULL;
+      x->cons = NULL;
+      x->hash = v->hash;
+      if (v->ints) {
+        x->ints = malloc(sizeof(int64_t) * x->count);
+        memcpy(x->ints, v->ints, sizeof(int64_t) * x->count);
+      } else if (v->dbls) {
+        x->dbls = malloc(sizeof(double) * x->count);
+        memcpy(x->dbls, v->dbls, sizeof(double) * x->count);
+      } else {
+        // recursively copy sub-expressions
+        x->cell = malloc(sizeof(lval*) * x->count);
+        for (int i = 0; i < x->count; ++i)
+          x->cell[i] = lval_copy(v->cell[i]);
+      }
+      break;
+
+    case LVAL_VEC:
+    case LVAL_MAT:
+      x->count = v->count;
+      x->rows = v->rows;
+      x->cols = v->cols;
+      x->data = lvec_alloc(x->count);
+      memcpy(x->data, v->data, sizeof(double) * x->count);
+      break;
+
+    case LVAL_MAP:
+      // maps are persistent, copies share their nodes
+      lval_map_copy(x, v);
+      break;
+
+    case LVAL_OMAP:
+      lval_omap_copy(x, v);
+      break;
+
+    case LVAL_STR:
+      // long strings share their rope
+      lval_str_copy(x, v);
+      break;
+
+    case LVAL_SEQ:
+      // sequences are immutable descriptions, copies share them
+      x->seq = lseq_retain(v->seq);
+      break;
+
+    case LVAL_FUTURE:
+      // every copy waits on the same evaluation
+      x->future = lfuture_retain(v->future);
+      break;
+
+    case LVAL_PROC:
+      x->proc = lproc_retain(v->proc);
+      break;
+
+    case LVAL_CHAN:
+      x->chan = lchan_retain(v->chan);
       break;
   }
 
@@ -310,8 +778,12 @@ lval* lval_copy(lval* v) {
 }
 
 lval* lval_eval_sexpr(lenv* e, lval* v) {
-  for (int i = 0; i < v->count; ++i)
-    v->cell[i] = lval_eval(e, v->cell[i]);
+  // independent arguments may be evaluated at once when asked to
+  if (lpar_on(e))
+    lpar_eval_args(e, v);
+  else
+    for (int i = 0; i < v->count; ++i)
+      v->cell[i] = lval_eval(e, v->cell[i]);
 
   // check for errors
   for (int i = 0; i < v->count; ++i)
@@ -355,50 +827,125 @@ lval* lval_eval(lenv* e, lval* v) {
   return v;
 }
 
+// limits
+
+enum { LLIMIT_NONE, LLIMIT_TIME, LLIMIT_DEPTH };
+
+_Thread_local llimit* llimit_self;
+
+static double llimit_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// bounds the lambda calls made on this thread until llimit_end
+void llimit_begin(llimit* l, double timeout, int depth) {
+  l->timeout = timeout;
+  l->depth = depth;
+  l->deadline = timeout > 0 ? llimit_now() + timeout : 0;
+  l->nested = 0;
+  l->calls = 0;
+  l->hit = LLIMIT_NONE;
+  llimit_self = l;
+}
+
+void llimit_end(void) {
+  llimit_self = NULL;
+}
+
+// an error when a call would go past a bound, the clock is only read
+// every 256 calls
+static lval* llimit_enter(llimit* l) {
+  if (!l->hit) {
+    if (l->depth && l->nested >= l->depth)
+      l->hit = LLIMIT_DEPTH;
+    else if (l->deadline && (++l->calls & 255) == 0 &&
+             llimit_now() > l->deadline)
+      l->hit = LLIMIT_TIME;
+  }
+
+  if (l->hit == LLIMIT_DEPTH)
+    return lval_err("Evaluation nested deeper than %i calls.", l->depth);
+  if (l->hit == LLIMIT_TIME)
+    return lval_err("Evaluation ran longer than %g s.", l->timeout);
+  l->nested++;
+  return NULL;
+}
+
 lval* lval_call(lenv* e, lval* f, lval* a) {
+  // a generator that was let go runs nothing more on its way out
+  if (lgen_unwinding) {
+    lval_del(a);
+    return lval_err("Generator was let go.");
+  }
+
   if (f->builtin)
     return f->builtin(e, a);
 
   // record argument counts
+  llambda* l = f->lambda;
   int given = a->count;
-  int total = f->formals->count;
+  int bound = f->bound ? f->bound->count : 0;
+  int total = l->formals->count;
 
-  // while arguments still remain to be processed
-  while (a->count) {
-    // if we've ran out of formal arguments to bind
-    if (f->formals->count == 0) {
-      lval_del(a);
-      return lval_err(
-          "Function passed too many arguments. Got %i, Expected %i.", given,
-          given, total);
-    }
+  if (bound + given > total) {
+    lval_del(a);
+    return lval_err("Function passed too many arguments. Got %i, Expected %i.",
+                    given, total - bound);
+  }
 
-    // pop the first symbol from the formals
-    lval* sym = lval_pop(f->formals, 0);
+  // arguments given so far, in order
+  if (f->bound)
+    a = lval_join(lval_copy(f->bound), a);
 
-    // pop the next argument from the list
-    lval* val = lval_pop(a, 0);
+  // short of arguments, return a partial application sharing the lambda
+  if (bound + given < total)
+    return lval_partial(f, a);
 
-    // bind a copy in the function's environment
-    lenv_put(f->env, sym, val);
+  // a memoized function answers a full call it has seen from its cache,
+  // otherwise the arguments are kept to record the result under
+  lval* key = NULL;
+  if (f->memo) {
+    lval* hit = lmemo_get(f->memo, a);
+    if (hit) {
+      lval_del(a);
+      return hit;
+    }
+    key = lval_copy(a);
+  }
 
-    // delete symbol and value
-    lval_del(sym);
-    lval_del(val);
+  llimit* lim = llimit_self;
+  lval* err = lim ? llimit_enter(lim) : NULL;
+  if (err) {
+    lval_del(a);
+    if (key)
+      lval_del(key);
+    return err;
   }
 
-  // argument list is now bound, let's clean-up
+  // bind every formal in a fresh environment whose parent is the
+  // evaluation environment
+  lenv* env = lenv_new();
+  env->par = e;
+  env->vm = e->vm;
+  for (int i = 0; i < total; ++i)
+    lenv_put(env, l->formals->cell[i], a->cell[i]);
   lval_del(a);
 
-  if (f->formals->count == 0) {
-    // set environment parent to evaluation environment
-    f->env->par = e;
-    // evaluate the function
-    return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-  }
-
-  // return the partially evaluated function
-  return lval_copy(f);
+  // evaluate the function, optimized unless a builtin it relies on has
+  // been redefined since
+  uint64_t start = lpar_clock(e);
+  lval* body = l->fbody && l->fversion == lopt_version(e) ? l->fbody : l->body;
+  lval* r = builtin_eval(env, lval_add(lval_sexpr(), lval_copy(body)));
+  lenv_del(env);
+  if (lim)
+    lim->nested--;
+  if (start)
+    lpar_profile(l, start);
+  if (key)
+    lmemo_put(f->memo, key, r);
+  return r;
 }
 
 void lenv_add_builtins(lenv* e) {
@@ -417,43 +964,223 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "-", builtin_sub);
   lenv_add_builtin(e, "*", builtin_mul);
   lenv_add_builtin(e, "/", builtin_div);
+
+  // comparison functions
+  lenv_add_builtin(e, "if", builtin_if);
+  lenv_add_builtin(e, ">", builtin_gt);
+  lenv_add_builtin(e, "<", builtin_lt);
+  lenv_add_builtin(e, ">=", builtin_ge);
+  lenv_add_builtin(e, "<=", builtin_le);
+  lenv_add_builtin(e, "==", builtin_eq);
+  lenv_add_builtin(e, "!=", builtin_ne);
+  lenv_add_builtin(e, "equal?", builtin_equal);
+  lenv_add_builtin(e, "hash", builtin_hash);
+
+  // vector functions
+  lenv_add_builtin(e, "vec", builtin_vec);
+  lenv_add_builtin(e, "list->vec", builtin_list_to_vec);
+  lenv_add_builtin(e, "vec->list", builtin_vec_to_list);
+  lenv_add_builtin(e, "vlen", builtin_vlen);
+  lenv_add_builtin(e, "vsum", builtin_vsum);
+  lenv_add_builtin(e, "vdot", builtin_vdot);
+  lenv_add_builtin(e, "vscale", builtin_vscale);
+  lenv_add_builtin(e, "vadd", builtin_vadd);
+  lenv_add_builtin(e, "vmap", builtin_vmap);
+  lenv_add_builtin(e, "vmin", builtin_vmin);
+  lenv_add_builtin(e, "vmax", builtin_vmax);
+
+  // matrix functions
+  lenv_add_builtin(e, "mat", builtin_mat);
+  lenv_add_builtin(e, "list->mat", builtin_list_to_mat);
+  lenv_add_builtin(e, "mat->list", builtin_mat_to_list);
+  lenv_add_builtin(e, "mshape", builtin_mshape);
+  lenv_add_builtin(e, "matmul", builtin_matmul);
+  lenv_add_builtin(e, "transpose", builtin_transpose);
+  lenv_add_builtin(e, "m+", builtin_madd);
+  lenv_add_builtin(e, "m-", builtin_msub);
+  lenv_add_builtin(e, "m*", builtin_mmul);
+  lenv_add_builtin(e, "m/", builtin_mdiv);
+  lenv_add_builtin(e, "msum", builtin_msum);
+  lenv_add_builtin(e, "mmin", builtin_mmin);
+  lenv_add_builtin(e, "mmax", builtin_mmax);
+
+  // hash map functions
+  lenv_add_builtin(e, "hash-map", builtin_hash_map);
+  lenv_add_builtin(e, "hash-get", builtin_hash_get);
+  lenv_add_builtin(e, "hash-put", builtin_hash_put);
+  lenv_add_builtin(e, "hash-del", builtin_hash_del);
+  lenv_add_builtin(e, "hash-keys", builtin_hash_keys);
+  lenv_add_builtin(e, "hash-len", builtin_hash_len);
+
+  // ordered map functions
+  lenv_add_builtin(e, "omap", builtin_omap);
+  lenv_add_builtin(e, "omap-put", builtin_omap_put);
+  lenv_add_builtin(e, "omap-get", builtin_omap_get);
+  lenv_add_builtin(e, "omap-range", builtin_omap_range);
+  lenv_add_builtin(e, "omap-min", builtin_omap_min);
+  lenv_add_builtin(e, "omap-max", builtin_omap_max);
+  lenv_add_builtin(e, "omap-floor", builtin_omap_floor);
+  lenv_add_builtin(e, "omap-ceil", builtin_omap_ceil);
+  lenv_add_builtin(e, "omap-len", builtin_omap_len);
+
+  // string functions
+  lenv_add_builtin(e, "str-len", builtin_str_len);
+  lenv_add_builtin(e, "str-cat", builtin_str_cat);
+  lenv_add_builtin(e, "str-sub", builtin_str_sub);
+  lenv_add_builtin(e, "str-build", builtin_str_build);
+
+  // optimization
+  lenv_add_builtin(e, "fuse-debug", builtin_fuse_debug);
+
+  // memoization
+  lenv_add_builtin(e, "memo", builtin_memo);
+  lenv_add_builtin(e, "memo-stats", builtin_memo_stats);
+
+  // lazy sequence functions
+  lenv_add_builtin(e, "range", builtin_range);
+  lenv_add_builtin(e, "repeat", builtin_repeat);
+  lenv_add_builtin(e, "iterate", builtin_iterate);
+  lenv_add_builtin(e, "seq", builtin_seq);
+  lenv_add_builtin(e, "lazy-map", builtin_lazy_map);
+  lenv_add_builtin(e, "lazy-filter", builtin_lazy_filter);
+  lenv_add_builtin(e, "take", builtin_take);
+  lenv_add_builtin(e, "into", builtin_into);
+  lenv_add_builtin(e, "realize", builtin_realize);
+  lenv_add_builtin(e, "fold", builtin_fold);
+
+  // generators
+  lenv_add_builtin(e, "gen", builtin_gen);
+  lenv_add_builtin(e, "yield", builtin_yield);
+
+  // hash-consing
+  lenv_add_builtin(e, "hashcons", builtin_hashcons);
+  lenv_add_builtin(e, "hashcons-stats", builtin_hashcons_stats);
+
+  // parallel functions
+  lenv_add_builtin(e, "pmap", builtin_pmap);
+  lenv_add_builtin(e, "preduce", builtin_preduce);
+  lenv_add_builtin(e, "psum", builtin_psum);
+  lenv_add_builtin(e, "par-args", builtin_par_args);
+
+  // futures
+  lenv_add_builtin(e, "spawn", builtin_spawn);
+  lenv_add_builtin(e, "await", builtin_await);
+
+  // green processes
+  lenv_add_builtin(e, "spawn-proc", builtin_spawn_proc);
+  lenv_add_builtin(e, "send", builtin_send);
+  lenv_add_builtin(e, "receive", builtin_receive);
+
+  // channels
+  lenv_add_builtin(e, "chan", builtin_chan);
+  lenv_add_builtin(e, "put!", builtin_chan_put);
+  lenv_add_builtin(e, "take!", builtin_chan_take);
+  lenv_add_builtin(e, "close!", builtin_chan_close);
+}
+
+static void lval_num_set_int(lval* x, int64_t i) {
+  lbig_release(x->big);
+  x->big = NULL;
+  x->numt = LNUM_INT;
+  x->inum = i;
+  x->num = i;
+}
+
+static void lval_num_set_dbl(lval* x, double d) {
+  lbig_release(x->big);
+  x->big = NULL;
+  x->numt = LNUM_DBL;
+  x->inum = 0;
+  x->num = d;
+}
+
+// x = x op y, staying on exact 64-bit integers while both sides are
+// integers and the result fits, promoting to bignums when it does not and
+// computing on doubles once either side is one
+void lval_num_apply(lval* x, lval* y, char op) {
+  if (x->numt == LNUM_INT && y->numt == LNUM_INT) {
+    int64_t r = 0;
+    int overflow = 0;
+    switch (op) {
+      case '+':
+        overflow = __builtin_add_overflow(x->inum, y->inum, &r);
+        break;
+      case '-':
+        overflow = __builtin_sub_overflow(x->inum, y->inum, &r);
+        break;
+      case '*':
+        overflow = __builtin_mul_overflow(x->inum, y->inum, &r);
+        break;
+      case '/':
+        // only exact quotients stay integers
+        overflow = x->inum == INT64_MIN && y->inum == -1;
+        if (!overflow && x->inum % y->inum != 0) {
+          lval_num_set_dbl(x, x->num / y->num);
+          return;
+        }
+        if (!overflow)
+          r = x->inum / y->inum;
+        break;
+    }
+    if (!overflow) {
+      lval_num_set_int(x, r);
+      return;
+    }
+  }
+
+  if (x->numt != LNUM_DBL && y->numt != LNUM_DBL && lval_big_apply(x, y, op))
+    return;
+
+  switch (op) {
+    case '+':
+      lval_num_set_dbl(x, x->num + y->num);
+      break;
+    case '-':
+      lval_num_set_dbl(x, x->num - y->num);
+      break;
+    case '*':
+      lval_num_set_dbl(x, x->num * y->num);
+      break;
+    case '/':
+      lval_num_set_dbl(x, x->num / y->num);
+      break;
+  }
 }
 
 lval* builtin_op(lenv* e, lval* a, char* op) {
   UNUSED(e);
+
   // ensure arguments are numbers
   for (int i = 0; i < a->count; ++i)
     if (a->cell[i]->type != LVAL_NUM) {
-      // lval_del(a);
-      return lval_err("Cannot operate on a non-number. Got %s, Expected %s",
-                      lval_t_name(a->cell[i]->type), lval_t_name(LVAL_NUM));
+      lval* err =
+          lval_err("Cannot operate on a non-number. Got %s, Expected %s",
+                   lval_t_name(a->cell[i]->type), lval_t_name(LVAL_NUM));
+      lval_del(a);
+      return err;
     }
 
-  lval* x = lval_pop(a, 0);
+  lval* x = lval_copy(a->cell[0]);
 
   // if no arguments and a minus symbol, do unary negation
-  if ((strcmp(op, "-") == 0) && a->count == 0)
-    x->num = -x->num;
-
-  while (a->count > 0) {
-    lval* y = lval_pop(a, 0);
-    if (strcmp(op, "+") == 0)
-      x->num += y->num;
-    else if (strcmp(op, "-") == 0)
-      x->num -= y->num;
-    else if (strcmp(op, "*") == 0)
-      x->num *= y->num;
-    else if (strcmp(op, "/") == 0) {
-      if (y->num == 0) {
-        lval_del(x);
-        lval_del(y);
-        x = lval_err("Division by zero");
-        break;
-      }
-      x->num /= y->num;
+  if ((strcmp(op, "-") == 0) && a->count == 1) {
+    if (x->numt == LNUM_INT && x->inum != INT64_MIN)
+      lval_num_set_int(x, -x->inum);
+    else if (x->numt == LNUM_DBL)
+      lval_num_set_dbl(x, -x->num);
+    else
+      lval_big_neg(x);
+  }
+
+  for (int i = 1; i < a->count; ++i) {
+    lval* y = a->cell[i];
+    if (op[0] == '/' && y->num == 0) {
+      lval_del(x);
+      x = lval_err("Division by zero");
+      break;
     }
 
-    lval_del(y);
+    lval_num_apply(x, y, op[0]);
   }
 
   lval_del(a);
@@ -476,6 +1203,49 @@ lval* builtin_div(lenv* e, lval* a) {
   return builtin_op(e, a, "/");
 }
 
+lval* builtin_ord(lenv* e, lval* a, char* op) {
+  UNUSED(e);
+
+  LASSERT_NUM(op, a, 2);
+  LASSERT_TYPE(op, a, 0, LVAL_NUM);
+  LASSERT_TYPE(op, a, 1, LVAL_NUM);
+
+  lval* x = a->cell[0];
+  lval* y = a->cell[1];
+  // comparisons with NaN are false
+  int c = lval_num_cmp(x, y);
+  int r = 0;
+  if (c == 2)
+    r = 0;
+  else if (strcmp(op, ">") == 0)
+    r = c > 0;
+  else if (strcmp(op, "<") == 0)
+    r = c < 0;
+  else if (strcmp(op, ">=") == 0)
+    r = c >= 0;
+  else if (strcmp(op, "<=") == 0)
+    r = c <= 0;
+
+  lval_del(a);
+  return lval_int(r);
+}
+
+lval* builtin_gt(lenv* e, lval* a) {
+  return builtin_ord(e, a, ">");
+}
+
+lval* builtin_lt(lenv* e, lval* a) {
+  return builtin_ord(e, a, "<");
+}
+
+lval* builtin_ge(lenv* e, lval* a) {
+  return builtin_ord(e, a, ">=");
+}
+
+lval* builtin_le(lenv* e, lval* a) {
+  return builtin_ord(e, a, "<=");
+}
+
 lval* builtin_head(lenv* e, lval* a) {
   UNUSED(e);
 
@@ -484,7 +1254,14 @@ lval* builtin_head(lenv* e, lval* a) {
   LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
   LASSERT_NOT_EMPTY("head", a, 0)
 
-  lval* v = lval_take(a, 0);
+  lval* v = lval_thaw(lval_take(a, 0));
+  // a packed list just drops its tail
+  if (lval_packed(v)) {
+    v->count = 1;
+    v->hash = 0;
+    return v;
+  }
+
   // delete all non-head elements
   while (v->count > 1)
     lval_del(lval_pop(v, 1));
@@ -509,18 +1286,32 @@ lval* builtin_list(lenv* e, lval* a) {
   UNUSED(e);
 
   a->type = LVAL_QEXPR;
-  return a;
+  a->hash = 0;
+  return lval_pack(a);
 }
 
 lval* builtin_eval(lenv* e, lval* a) {
   LASSERT_NUM("eval", a, 1);
   LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
 
-  lval* x = lval_take(a, 0);
+  lval* x = lval_unpack(lval_thaw(lval_take(a, 0)));
   x->type = LVAL_SEXPR;
+  x->hash = 0;
   return lval_eval(e, x);
 }
 
+lval* builtin_if(lenv* e, lval* a) {
+  LASSERT_NUM("if", a, 3);
+  LASSERT_TYPE("if", a, 0, LVAL_NUM);
+  LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
+  LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+
+  // evaluate the chosen branch, any nonzero number is true
+  lval* x = lval_pop(a, a->cell[0]->num != 0 ? 1 : 2);
+  lval_del(a);
+  return builtin_eval(e, lval_add(lval_sexpr(), x));
+}
+
 lval* builtin_join(lenv* e, lval* a) {
   UNUSED(e);
 
@@ -545,10 +1336,7 @@ lval* builtin_cons(lenv* e, lval* a) {
 
   lval* x = lval_pop(a, 0);
   lval* y = lval_pop(a, 0);
-  lval* z = lval_add(lval_qexpr(), x);
-  while (y->count > 0) {
-    z = lval_add(z, lval_pop(y, 0));
-  }
+  lval* z = lval_join(lval_add(lval_qexpr(), x), y);
 
   lval_del(a);
   return z;
@@ -566,7 +1354,7 @@ lval* builtin_var(lenv* e, lval* a, char* func) {
   LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
 
   // first arg is symbol list
-  lval* syms = a->cell[0];
+  lval* syms = lval_unpack(a->cell[0]);
 
   // elements must all be symbols
   for (int i = 0; i < syms->count; ++i)
@@ -581,22 +1369,24 @@ lval* builtin_var(lenv* e, lval* a, char* func) {
   for (int i = 0; i < syms->count; ++i)
     if (strcmp(func, "def") == 0)
       lenv_def(e, syms->cell[i], a->cell[i + 1]);
-    else if (strcmp(func, "=") == 0)
+    else if (strcmp(func, "=") == 0) {
+      lopt_rebind(e, syms->cell[i]);
+      lpar_rebind(e, syms->cell[i]);
       lenv_put(e, syms->cell[i], a->cell[i + 1]);
+    }
 
   lval_del(a);
   return lval_sexpr();
 }
 
 lval* builtin_lambda(lenv* e, lval* a) {
-  UNUSED(e);
-
   // check two arguments, each of which are q-expressions
   LASSERT_NUM("\\", a, 2);
   LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
   LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
 
   // check the first q-expression contains only symbols
+  lval_unpack(a->cell[0]);
   for (int i = 0; i < a->cell[0]->count; ++i)
     LASSERT_TYPE("\\", a->cell[0], i, LVAL_SYM);
 
@@ -605,106 +1395,146 @@ lval* builtin_lambda(lenv* e, lval* a) {
   lval* body = lval_pop(a, 0);
   lval_del(a);
 
-  return lval_lambda(formals, body);
+  // the version is read first, a def racing with the optimizer leaves the
+  // body it made stale
+  lopt_bind_formals(e, formals);
+  lpar_bind_formals(e, formals);
+  unsigned long version = lopt_version(e);
+  lval* f = lval_lambda(formals, body);
+  f->lambda->fbody = lval_optimize_body(e, formals, body);
+  f->lambda->fversion = version;
+  return f;
 }
 
-void lval_expr_print(lval* v, char open, char close) {
-  putchar(open);
+// writes x to buf, which holds LNUM_DBL_SIZE bytes, with the fewest
+// digits that read back as x; when mark is set a whole x gets a ".0" so it
+// does not read back as an integer. Returns the length.
+int lnum_dbl_str(char* buf, double x, int mark) {
+  int n = 0;
+  for (int digits = 15; digits <= 17; ++digits) {
+    n = snprintf(buf, LNUM_DBL_SIZE, "%.*g", digits, x);
+    if (!isfinite(x) || strtod(buf, NULL) == x)
+      break;
+  }
+  if (mark && isfinite(x) && strspn(buf, "-0123456789") == (size_t)n)
+    n += snprintf(buf + n, LNUM_DBL_SIZE - n, ".0");
+  return n;
+}
+
+static void lnum_dbl_print(FILE* f, double x, int mark) {
+  char buf[LNUM_DBL_SIZE];
+  fwrite(buf, 1, lnum_dbl_str(buf, x, mark), f);
+}
+
+void lval_expr_print(FILE* f, lval* v, char open, char close) {
+  fputc(open, f);
   for (int i = 0; i < v->count; ++i) {
-    lval_print(v->cell[i]);
+    if (v->ints)
+      fprintf(f, "%" PRId64, v->ints[i]);
+    else if (v->dbls)
+      lnum_dbl_print(f, v->dbls[i], 1);
+    else
+      lval_fprint(f, v->cell[i]);
     if (i != (v->count - 1))
-      putchar(' ');
+      fputc(' ', f);
   }
 
-  putchar(close);
+  fputc(close, f);
 }
 
-void lval_print(lval* v) {
+void lval_fprint(FILE* f, lval* v) {
   switch (v->type) {
     case LVAL_NUM:
-      printf("%.0f", v->num);
+      if (v->numt == LNUM_INT)
+        fprintf(f, "%" PRId64, v->inum);
+      else if (v->numt == LNUM_BIG)
+        lval_big_print(f, v);
+      else
+        lnum_dbl_print(f, v->num, 1);
       break;
     case LVAL_ERR:
-      printf("Error: %s", v->err);
+      fprintf(f, "Error: %s", v->err);
       break;
     case LVAL_SYM:
-      printf("%s", v->sym);
+      fprintf(f, "%s", v->sym);
       break;
     case LVAL_SEXPR:
-      lval_expr_print(v, '(', ')');
+      lval_expr_print(f, v, '(', ')');
       break;
     case LVAL_QEXPR:
-      lval_expr_print(v, '{', '}');
+      lval_expr_print(f, v, '{', '}');
+      break;
+    case LVAL_VEC:
+      fputc('[', f);
+      for (int i = 0; i < v->count; ++i) {
+        lnum_dbl_print(f, v->data[i], 0);
+        if (i != (v->count - 1))
+          fputc(' ', f);
+      }
+      fputc(']', f);
+      break;
+    case LVAL_MAT:
+      fputc('[', f);
+      for (int i = 0; i < v->rows; ++i) {
+        fputc('[', f);
+        for (int j = 0; j < v->cols; ++j) {
+          lnum_dbl_print(f, v->data[i * v->cols + j], 0);
+          if (j != (v->cols - 1))
+            fputc(' ', f);
+        }
+        fputc(']', f);
+        if (i != (v->rows - 1))
+          fputc(' ', f);
+      }
+      fputc(']', f);
+      break;
+    case LVAL_MAP:
+      lval_map_print(f, v);
+      break;
+    case LVAL_OMAP:
+      lval_omap_print(f, v);
+      break;
+    case LVAL_STR:
+      lval_str_print(f, v);
+      break;
+    case LVAL_SEQ:
+      fprintf(f, "<seq>");
+      break;
+    case LVAL_FUTURE:
+      fprintf(f, "<future>");
+      break;
+    case LVAL_PROC:
+      fprintf(f, "<proc>");
+      break;
+    case LVAL_CHAN:
+      fprintf(f, "<chan>");
       break;
     case LVAL_FUN:
       if (v->builtin)
-        printf("<builtin>");
+        fprintf(f, "<builtin>");
       else {
-        printf("(\\ ");
-        lval_print(v->formals);
-        putchar(' ');
-        lval_print(v->body);
-        putchar(')');
+        // a partial application shows the formals still to be bound
+        lval* formals = v->lambda->formals;
+        int from = v->bound ? v->bound->count : 0;
+        fprintf(f, "(\\ {");
+        for (int i = from; i < formals->count; ++i) {
+          lval_fprint(f, formals->cell[i]);
+          if (i != formals->count - 1)
+            fputc(' ', f);
+        }
+        fprintf(f, "} ");
+        lval_fprint(f, v->lambda->body);
+        fputc(')', f);
       }
       break;
   }
 }
 
+void lval_print(lval* v) {
+  lval_fprint(stdout, v);
+}
+
 void lval_println(lval* v) {
   lval_print(v);
   putchar('\n');
 }
-
-int main(void) {
-  // create some parsers
-  mpc_parser_t* Number = mpc_new("number");
-  mpc_parser_t* Symbol = mpc_new("symbol");
-  mpc_parser_t* Sexpr = mpc_new("sexpr");
-  mpc_parser_t* Qexpr = mpc_new("qexpr");
-  mpc_parser_t* Expr = mpc_new("expr");
-  mpc_parser_t* Lispy = mpc_new("lispy");
-
-  const char* language =
-      "\
-    number  : /-?[0-9]+/ ; \
-    symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; \
-    sexpr   : '(' <expr>* ')' ; \
-    qexpr   : '{' <expr>* '}' ; \
-    expr    : <number> | <symbol> | <sexpr> | <qexpr> ; \
-    lispy   : /^/ <expr>* /$/ ; ";
-
-  // define them with the following language
-  mpca_lang(MPCA_LANG_DEFAULT, language, Number, Symbol, Sexpr, Qexpr, Expr,
-            Lispy);
-
-  puts("Lispy version 0.1");
-  puts("Press Ctrl+C to exit\n");
-
-  // setup environment
-  lenv* e = lenv_new();
-  lenv_add_builtins(e);
-
-  while (1) {
-    char* input = readline("lispy> ");
-    add_history(input);
-
-    // attempt to parse the user input
-    mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Lispy, &r)) {
-      lval* result = lval_eval(e, lval_read(r.output));
-      lval_println(result);
-      lval_del(result);
-
-      mpc_ast_delete(r.output);
-    } else {
-      mpc_err_print(r.error);
-      mpc_err_delete(r.error);
-    }
-
-    free(input);
-  }
-
-  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
-
-  return 0;
-}
@@ -1,4 +1,7 @@
+#include <inttypes.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -9,7 +12,7 @@
 static char buffer[2048];
 
 /* Fake readline function */
-char* readline(char* prompt) {
+static char* readline(char* prompt) {
   fputs(prompt, stdout);
   fgets(buffer, 2048, stdin);
   char* cpy = malloc(strlen(buffer) + 1);
@@ -19,7 +22,7 @@ char* readline(char* prompt) {
 }
 
 /* Fake add_history function */
-void add_history(char* unused) {}
+static void add_history(char* unused) {}
 
 #else
 #include <editline/readline.h>
@@ -59,53 +62,232 @@ typedef struct lval lval;
 struct lenv;
 typedef struct lenv lenv;
 
+struct lhnode;
+typedef struct lhnode lhnode;
+
+struct lbnode;
+typedef struct lbnode lbnode;
+
+struct lrope;
+typedef struct lrope lrope;
+
+struct lbig;
+typedef struct lbig lbig;
+
+struct lcons;
+typedef struct lcons lcons;
+
+struct lcons_table;
+typedef struct lcons_table lcons_table;
+
+struct lmemo;
+typedef struct lmemo lmemo;
+
+struct lseq;
+typedef struct lseq lseq;
+
+struct lfuture;
+typedef struct lfuture lfuture;
+
+struct lproc;
+typedef struct lproc lproc;
+
+struct lproc_group;
+typedef struct lproc_group lproc_group;
+
+struct lchan;
+typedef struct lchan lchan;
+
+struct lcoro;
+typedef struct lcoro lcoro;
+
+struct lgen;
+typedef struct lgen lgen;
+
+struct lopt_state;
+typedef struct lopt_state lopt_state;
+
+struct lpar_state;
+typedef struct lpar_state lpar_state;
+
+struct lispy_vm;
+typedef struct lispy_vm lispy_vm_t;
+
+struct lispy_vm_flags_t;
+typedef struct lispy_vm_flags_t lispy_vm_flags_t;
+
+// strings shorter than this are stored inline
+#define LSTR_SMALL 16
+
+// numbers quoted in error messages, values print with lnum_dbl_str
+#define LNUM_DBL_FMT "%.15g"
+// room lnum_dbl_str needs for any double
+#define LNUM_DBL_SIZE 32
+
+typedef enum lnum_t { LNUM_INT, LNUM_DBL, LNUM_BIG } lnum_t;
+
 typedef enum lval_t {
   LVAL_ERR,
   LVAL_NUM,
   LVAL_SYM,
   LVAL_FUN,
   LVAL_SEXPR,
-  LVAL_QEXPR
+  LVAL_QEXPR,
+  LVAL_VEC,
+  LVAL_MAT,
+  LVAL_MAP,
+  LVAL_OMAP,
+  LVAL_STR,
+  LVAL_SEQ,
+  LVAL_FUTURE,
+  LVAL_PROC,
+  LVAL_CHAN
 } lval_t;
 
 char* lval_t_name(lval_t t);
 
 typedef lval* (*lbuiltin)(lenv*, lval*);
 
+// an environment keeps its bindings in one array ended by a NULL symbol,
+// so a reader on another thread loads it once and sees each binding whole
+// or not at all
+typedef struct lbind {
+  _Atomic(char*) sym;
+  _Atomic(lval*) val;
+} lbind;
+
+// the array with a count of who holds it: its environment while it is
+// current, and every snapshot pinned to it, which writers copy it rather
+// than change
+typedef struct lbinds {
+  atomic_int refs;
+  lbind b[];
+} lbinds;
+
 typedef struct lenv {
   lenv* par;
+  // interpreter the environment belongs to, NULL outside of one
+  lispy_vm_t* vm;
+  // def stops here instead of reaching the global environment, so code
+  // run on another thread keeps its definitions to itself
+  int isolated;
+  // read by several threads at once, the interpreter's global environment;
+  // reads take no lock and what a write replaces goes through rcu.c
+  int shared;
+  // a snapshot of another environment's bindings as they were when pinned
+  int pinned;
+  // bindings and room for them, only looked at by the writer
   int count;
-  char** syms;
-  lval** vals;
+  int size;
+  _Atomic(lbinds*) binds;
 } lenv;
 
+// the immutable part of a lambda, shared by its copies and the partial
+// applications made from it
+typedef struct llambda {
+  atomic_int refs;
+  lval* formals;
+  lval* body;
+  // optimized body, used while the optimizer's version is still fversion
+  lval* fbody;
+  unsigned long fversion;
+  // kept while arguments are evaluated in parallel: the running average
+  // time of a call in nanoseconds, and what is known of the body's effects
+  atomic_ulong cost;
+  atomic_ulong pure;
+} llambda;
+
 typedef struct lval {
   lval_t type;
+  // elements of an expression, vector or matrix, entries of a map, bytes of
+  // a string
+  int count;
+  // hash-consed symbols and Q-expressions alias the storage of the
+  // canonical value in cons
+  lcons* cons;
 
-  // basic
-  double num;
-  char* err;
-  char* sym;
+  // what else a value holds depends on its type
+  union {
+    // number (num also holds the value of integers and bignums, as a double)
+    struct {
+      lnum_t numt;
+      int64_t inum;
+      lbig* big;
+      double num;
+    };
+    char* err;
+    char* sym;
 
-  // function
-  lbuiltin builtin;
-  lenv* env;
-  lval* formals;
-  lval* body;
+    // function, a partial application holds the arguments given so far in
+    // bound, bound to the formals all at once when the call is saturated
+    struct {
+      lbuiltin builtin;
+      llambda* lambda;
+      lval* bound;
+      // cache of a memoized lambda, shared by its copies
+      lmemo* memo;
+    };
 
-  // expression
-  int count;
-  lval** cell;
+    // expression, a Q-expression of numbers of a single kind is packed
+    // unboxed into ints or dbls instead of cell
+    struct {
+      lval** cell;
+      int64_t* ints;
+      double* dbls;
+      // structural hash of a Q-expression, 0 until computed
+      uint64_t hash;
+    };
+
+    // vector and matrix
+    struct {
+      double* data;
+      int rows;
+      int cols;
+    };
+
+    // hash and ordered maps
+    lhnode* map;
+    lbnode* omap;
+
+    // string, inline when rope is NULL
+    struct {
+      char small[LSTR_SMALL];
+      lrope* rope;
+    };
+
+    // lazy sequence
+    lseq* seq;
+
+    // result of a spawned evaluation
+    lfuture* future;
+
+    // green process
+    lproc* proc;
+
+    // channel
+    lchan* chan;
+  };
 } lval;
 
 // lval constructors
 lval* lval_num(double x);
+lval* lval_int(int64_t x);
 lval* lval_sym(char* s);
 lval* lval_sexpr(void);
 lval* lval_qexpr(void);
 lval* lval_fun(lbuiltin fun);
 lval* lval_lambda(lval* formals, lval* body);
 lval* lval_err(char* fmt, ...);
+lval* lval_vec(int n);
+lval* lval_mat(int rows, int cols);
+lval* lval_map(void);
+lval* lval_omap(void);
+lval* lval_str(const char* s);
+lval* lval_str_n(const char* s, int len);
+lval* lval_seq(lseq* s);
+lval* lval_future(lfuture* f);
+lval* lval_proc(lproc* p);
+lval* lval_chan(lchan* c);
 
 // lval destructor
 void lval_del(lval* v);
@@ -114,6 +296,10 @@ void lval_del(lval* v);
 lval* lval_add(lval* v, lval* c);
 lval* lval_pop(lval* v, int i);
 lval* lval_take(lval* v, int i);
+int lval_packed(lval* v);
+lval* lval_pack(lval* v);
+lval* lval_unpack(lval* v);
+lval* lval_peek(lval* v, int i, lval* tmp);
 lval* lval_join(lval* x, lval* y);
 lval* lval_copy(lval* v);
 
@@ -124,22 +310,48 @@ void lenv_del(lenv* e);
 
 // lenv manupilations
 lval* lenv_get(lenv* e, lval* k);
+lbind* lenv_find(lenv* e, const char* sym);
 lenv* lenv_copy(lenv* e);
+lenv* lenv_copy_chain(lenv* e);
+lenv* lenv_pin(lenv* e);
+lenv* lenv_snapshot_chain(lenv* e);
+void lenv_del_chain(lenv* e);
 void lenv_put(lenv* e, lval* k, lval* v);
 void lenv_def(lenv* e, lval* k, lval* v);
 
 // ast to lval
 lval* lval_read_num(mpc_ast_t* t);
-lval* lval_read(mpc_ast_t* t);
+lval* lval_read_str(mpc_ast_t* t);
+lval* lval_read(lcons_table* c, mpc_ast_t* t);
 
 // evaluators
 lval* lval_eval_sexpr(lenv* e, lval* v);
 lval* lval_eval(lenv* e, lval* v);
 lval* lval_call(lenv* e, lval* f, lval* a);
 
+// bounds on the lambda calls of an evaluation on one thread, so one that
+// runs away fails instead of running forever or off the stack
+typedef struct llimit {
+  // seconds and nested calls allowed, 0 for no bound
+  double timeout;
+  int depth;
+  double deadline;
+  int nested;
+  unsigned calls;
+  // the bound hit, every call after it fails so the evaluation unwinds
+  int hit;
+} llimit;
+
+extern _Thread_local llimit* llimit_self;
+
+void llimit_begin(llimit* l, double timeout, int depth);
+void llimit_end(void);
+
 // builtin functions
 void lenv_add_builtin(lenv* e, char* name, lbuiltin fun);
+void lenv_add_builtins(lenv* e);
 lval* builtin_op(lenv* e, lval* a, char* op);
+void lval_num_apply(lval* x, lval* y, char op);
 lval* builtin_var(lenv* e, lval* a, char* func);
 
 lval* builtin_add(lenv* e, lval* a);
@@ -156,9 +368,322 @@ lval* builtin_cons(lenv* e, lval* a);
 lval* builtin_def(lenv* e, lval* a);
 lval* builtin_lambda(lenv* e, lval* a);
 lval* builtin_put(lenv* e, lval* a);
+lval* builtin_if(lenv* e, lval* a);
+lval* builtin_ord(lenv* e, lval* a, char* op);
+lval* builtin_gt(lenv* e, lval* a);
+lval* builtin_lt(lenv* e, lval* a);
+lval* builtin_ge(lenv* e, lval* a);
+lval* builtin_le(lenv* e, lval* a);
+
+// vector functions
+double* lvec_alloc(int n);
+double lvec_sum(const double* x, int n);
+double lvec_min(const double* x, int n);
+double lvec_max(const double* x, int n);
+
+lval* builtin_vec(lenv* e, lval* a);
+lval* builtin_list_to_vec(lenv* e, lval* a);
+lval* builtin_vec_to_list(lenv* e, lval* a);
+lval* builtin_vlen(lenv* e, lval* a);
+lval* builtin_vsum(lenv* e, lval* a);
+lval* builtin_vdot(lenv* e, lval* a);
+lval* builtin_vscale(lenv* e, lval* a);
+lval* builtin_vadd(lenv* e, lval* a);
+lval* builtin_vmap(lenv* e, lval* a);
+lval* builtin_vmin(lenv* e, lval* a);
+lval* builtin_vmax(lenv* e, lval* a);
+
+// matrix functions
+lval* builtin_mat(lenv* e, lval* a);
+lval* builtin_list_to_mat(lenv* e, lval* a);
+lval* builtin_mat_to_list(lenv* e, lval* a);
+lval* builtin_mshape(lenv* e, lval* a);
+lval* builtin_matmul(lenv* e, lval* a);
+lval* builtin_transpose(lenv* e, lval* a);
+lval* builtin_madd(lenv* e, lval* a);
+lval* builtin_msub(lenv* e, lval* a);
+lval* builtin_mmul(lenv* e, lval* a);
+lval* builtin_mdiv(lenv* e, lval* a);
+lval* builtin_msum(lenv* e, lval* a);
+lval* builtin_mmin(lenv* e, lval* a);
+lval* builtin_mmax(lenv* e, lval* a);
+
+// hash map functions
+int lval_is_key(lval* k);
+uint64_t lval_key_hash(lval* k);
+int lval_key_eq(lval* x, lval* y);
+
+void lval_map_del(lval* v);
+void lval_map_copy(lval* x, lval* v);
+void lval_map_print(FILE* f, lval* m);
+lval* lval_map_get(lval* m, lval* k);
+lval* lval_map_put(lval* m, lval* k, lval* v);
+lval* lval_map_remove(lval* m, lval* k);
+int lval_map_eq(lval* x, lval* y, int strict);
+uint64_t lval_map_hash(lval* m);
+
+lval* builtin_hash_map(lenv* e, lval* a);
+lval* builtin_hash_get(lenv* e, lval* a);
+lval* builtin_hash_put(lenv* e, lval* a);
+lval* builtin_hash_del(lenv* e, lval* a);
+lval* builtin_hash_keys(lenv* e, lval* a);
+lval* builtin_hash_len(lenv* e, lval* a);
+
+// ordered map functions
+void lval_omap_del(lval* v);
+void lval_omap_copy(lval* x, lval* v);
+void lval_omap_print(FILE* f, lval* m);
+lval* lval_omap_get(lval* m, lval* k);
+lval* lval_omap_put(lval* m, lval* k, lval* v);
+int lval_omap_eq(lval* x, lval* y, int strict);
+uint64_t lval_omap_hash(lval* m);
+
+lval* builtin_omap(lenv* e, lval* a);
+lval* builtin_omap_put(lenv* e, lval* a);
+lval* builtin_omap_get(lenv* e, lval* a);
+lval* builtin_omap_range(lenv* e, lval* a);
+lval* builtin_omap_min(lenv* e, lval* a);
+lval* builtin_omap_max(lenv* e, lval* a);
+lval* builtin_omap_floor(lenv* e, lval* a);
+lval* builtin_omap_ceil(lenv* e, lval* a);
+lval* builtin_omap_len(lenv* e, lval* a);
+
+// bignum functions
+lbig* lbig_retain(lbig* b);
+void lbig_release(lbig* b);
+lval* lval_read_big(const char* s);
+int lval_big_apply(lval* x, lval* y, char op);
+void lval_big_neg(lval* x);
+int lval_big_eq(lval* x, lval* y);
+int lval_big_cmp(lval* x, lval* y);
+int lval_num_cmp(lval* x, lval* y);
+char* lval_big_str(lval* v);
+void lval_big_print(FILE* f, lval* v);
+
+// equality functions
+int lval_eq(lval* x, lval* y, int strict);
+uint64_t lval_hash(lval* v);
+
+lval* builtin_eq(lenv* e, lval* a);
+lval* builtin_ne(lenv* e, lval* a);
+lval* builtin_equal(lenv* e, lval* a);
+lval* builtin_hash(lenv* e, lval* a);
+
+// optimization functions
+lval* lval_optimize(lenv* e, lval* v);
+lval* lval_optimize_body(lenv* e, lval* formals, lval* body);
+unsigned long lopt_version(lenv* e);
+void lopt_rebind(lenv* e, lval* k);
+void lopt_bind_formals(lenv* e, lval* formals);
+int lopt_pure(lbuiltin f);
+
+lopt_state* lopt_state_new(void);
+void lopt_state_del(lopt_state* st);
+void lopt_state_save(lopt_state* st, lispy_vm_flags_t* f);
+void lopt_state_restore(lopt_state* st, const lispy_vm_flags_t* f);
+
+lval* builtin_fuse_debug(lenv* e, lval* a);
+
+// memoization functions
+lmemo* lmemo_new(int capacity);
+lmemo* lmemo_retain(lmemo* m);
+void lmemo_release(lmemo* m);
+lval* lmemo_get(lmemo* m, lval* args);
+void lmemo_put(lmemo* m, lval* args, lval* result);
+
+lval* builtin_memo(lenv* e, lval* a);
+lval* builtin_memo_stats(lenv* e, lval* a);
+
+// hash-consing functions
+lcons* lcons_retain(lcons* c);
+void lcons_release(lcons* c);
+int lval_is_internable(lval* v);
+lval* lval_intern(lcons_table* t, lval* v);
+lval* lval_thaw(lval* v);
+lval* lval_cons_copy(lval* v);
+lval* lcons_value(lcons* c);
+lcons_table* lcons_table_new(void);
+void lcons_table_del(lcons_table* t);
+void lcons_table_save(lcons_table* t, lispy_vm_flags_t* f);
+void lcons_table_restore(lcons_table* t, const lispy_vm_flags_t* f);
+
+lval* builtin_hashcons(lenv* e, lval* a);
+lval* builtin_hashcons_stats(lenv* e, lval* a);
+
+// string functions
+void lval_str_del(lval* v);
+void lval_str_copy(lval* x, lval* v);
+void lval_str_flatten(lval* v, char* out);
+void lval_str_print(FILE* f, lval* v);
+
+lval* builtin_str_len(lenv* e, lval* a);
+lval* builtin_str_cat(lenv* e, lval* a);
+lval* builtin_str_sub(lenv* e, lval* a);
+lval* builtin_str_build(lenv* e, lval* a);
+
+// lazy sequence functions
+lseq* lseq_retain(lseq* s);
+void lseq_release(lseq* s);
+
+lval* builtin_range(lenv* e, lval* a);
+lval* builtin_repeat(lenv* e, lval* a);
+lval* builtin_iterate(lenv* e, lval* a);
+lval* builtin_seq(lenv* e, lval* a);
+lval* builtin_lazy_map(lenv* e, lval* a);
+lval* builtin_lazy_filter(lenv* e, lval* a);
+lval* builtin_take(lenv* e, lval* a);
+lval* builtin_into(lenv* e, lval* a);
+lval* builtin_realize(lenv* e, lval* a);
+lval* builtin_fold(lenv* e, lval* a);
+lval* builtin_gen(lenv* e, lval* a);
+
+// thread pool
+typedef struct lpool lpool;
+typedef void (*ltask)(void* ctx, int i);
+
+lpool* lpool_new(int nthreads);
+void lpool_del(lpool* p);
+lpool* lpool_global(void);
+int lpool_size(lpool* p);
+void lpool_run(lpool* p, ltask fn, void* ctx, int n);
+void lpool_submit(lpool* p, ltask fn, void* ctx);
+int lpool_help(lpool* p);
+int lpool_hungry(lpool* p);
+
+// read-copy-update
+void lrcu_read_lock(void);
+void lrcu_read_unlock(void);
+void lrcu_write_lock(void);
+void lrcu_write_unlock(void);
+void lrcu_retire(void* p, void (*del)(void*));
+void lrcu_barrier(void);
+
+// coroutines
+lcoro* lcoro_new(size_t size, void (*fn)(void*), void* arg);
+void lcoro_del(lcoro* c);
+int lcoro_resume(lcoro* c);
+void lcoro_suspend(lcoro* c);
+
+// generators
+extern _Thread_local int lgen_unwinding;
+
+lgen* lgen_new(lenv* par, lval* expr);
+lval* lgen_next(lgen* g);
+void lgen_del(lgen* g);
+
+lval* builtin_yield(lenv* e, lval* a);
+
+// futures
+lfuture* lfuture_retain(lfuture* f);
+void lfuture_release(lfuture* f);
+
+lval* builtin_spawn(lenv* e, lval* a);
+lval* builtin_await(lenv* e, lval* a);
+
+// green processes
+lproc* lproc_retain(lproc* p);
+void lproc_release(lproc* p);
+lproc_group* lproc_group_new(void);
+void lproc_group_del(lproc_group* g);
+void lproc_group_stop(lproc_group* g);
+void lproc_bind_root(lenv* e);
+lproc* lproc_of(lenv* e);
+int lproc_park(lproc* p);
+void lproc_unpark(lproc* p);
+
+lval* builtin_spawn_proc(lenv* e, lval* a);
+lval* builtin_send(lenv* e, lval* a);
+lval* builtin_receive(lenv* e, lval* a);
+
+// channels
+lchan* lchan_retain(lchan* c);
+void lchan_release(lchan* c);
+
+lval* builtin_chan(lenv* e, lval* a);
+lval* builtin_chan_put(lenv* e, lval* a);
+lval* builtin_chan_take(lenv* e, lval* a);
+lval* builtin_chan_close(lenv* e, lval* a);
+
+// parallel functions
+lval* builtin_pmap(lenv* e, lval* a);
+lval* builtin_preduce(lenv* e, lval* a);
+lval* builtin_psum(lenv* e, lval* a);
+
+// parallel argument evaluation
+int lpar_on(lenv* e);
+void lpar_eval_args(lenv* e, lval* v);
+uint64_t lpar_clock(lenv* e);
+void lpar_profile(llambda* l, uint64_t start);
+void lpar_rebind(lenv* e, lval* k);
+void lpar_bind_formals(lenv* e, lval* formals);
+
+lpar_state* lpar_state_new(void);
+void lpar_state_del(lpar_state* st);
+void lpar_state_save(lpar_state* st, lispy_vm_flags_t* f);
+void lpar_state_restore(lpar_state* st, const lispy_vm_flags_t* f);
+
+lval* builtin_par_args(lenv* e, lval* a);
+
+// interpreter, each owns its grammar and global environment so several
+// can run on separate threads
+typedef struct lispy_vm_stats_t {
+  // seconds spent in lispy_vm_new
+  double startup;
+  long evals;
+  long parse_errors;
+  long errors;
+} lispy_vm_stats_t;
+
+// what evaluation can switch on an interpreter for good, saved and put
+// back around code that must not leave it changed
+struct lispy_vm_flags_t {
+  // set by hashcons, par-args and fuse-debug
+  int hashcons;
+  int par_args;
+  int fuse_debug;
+  // set by a binding that shadows a builtin or global function
+  int opt_shadowed;
+  int par_shadowed;
+};
+
+lispy_vm_t* lispy_vm_new(void);
+void lispy_vm_del(lispy_vm_t* vm);
+lenv* lispy_vm_env(lispy_vm_t* vm);
+lval* lispy_vm_eval(lispy_vm_t* vm, const char* filename, const char* input);
+lval* lispy_vm_eval_in(lispy_vm_t* vm, lenv* e, const char* filename,
+                       const char* input);
+lispy_vm_stats_t lispy_vm_stats(lispy_vm_t* vm);
+lispy_vm_flags_t lispy_vm_save(lispy_vm_t* vm);
+void lispy_vm_restore(lispy_vm_t* vm, const lispy_vm_flags_t* f);
+lopt_state* lispy_vm_opt(lispy_vm_t* vm);
+lpar_state* lispy_vm_par(lispy_vm_t* vm);
+lproc_group* lispy_vm_procs(lispy_vm_t* vm);
+lcons_table* lispy_vm_cons(lispy_vm_t* vm);
+void lispy_vm_hold(lispy_vm_t* vm);
+void lispy_vm_unhold(lispy_vm_t* vm);
+
+// server mode, see serve.c
+typedef struct lispy_serve_opts {
+  // Unix domain socket to listen on, NULL to serve requests read from in
+  // with answers written to out
+  const char* socket;
+  int in;
+  int out;
+  // interpreters evaluating requests, one per thread, 0 for one per CPU
+  int workers;
+  // file of expressions, one per line, each interpreter evaluates first
+  const char* prelude;
+  // seconds a request may evaluate for and lambda calls it may nest before
+  // it is answered with an error, 0 for no bound
+  double timeout;
+  int depth;
+} lispy_serve_opts;
+
+int lispy_serve(const lispy_serve_opts* o);
 
 // outputs
-void lval_expr_print(lval* v, char open, char close);
-void lval_print(lval* v);
+int lnum_dbl_str(char* buf, double x, int mark);
+void lval_expr_print(FILE* f, lval* v, char open, char close);
+void lval_fprint(FILE* f, lval* v);
 void lval_print(lval* v);
 void lval_println(lval* v);
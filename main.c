@@ -0,0 +1,55 @@
+#include "lispy.h"
+
+static int usage(void) {
+  fputs("usage: lispy [--serve [--socket path] [--workers n] "
+        "[--prelude file] [--timeout seconds] [--depth n]]\n",
+        stderr);
+  return 2;
+}
+
+// lispy --serve evaluates requests on a pool of interpreters, see serve.c
+static int serve(int argc, char** argv) {
+  // deep enough for any sensible recursion, well short of a worker's stack
+  lispy_serve_opts o = {NULL, 0, 1, 0, NULL, 0, 10000};
+  for (int i = 0; i < argc; ++i) {
+    if (i + 1 < argc && strcmp(argv[i], "--socket") == 0)
+      o.socket = argv[++i];
+    else if (i + 1 < argc && strcmp(argv[i], "--workers") == 0)
+      o.workers = atoi(argv[++i]);
+    else if (i + 1 < argc && strcmp(argv[i], "--prelude") == 0)
+      o.prelude = argv[++i];
+    else if (i + 1 < argc && strcmp(argv[i], "--timeout") == 0)
+      o.timeout = atof(argv[++i]);
+    else if (i + 1 < argc && strcmp(argv[i], "--depth") == 0)
+      o.depth = atoi(argv[++i]);
+    else
+      return usage();
+  }
+  return lispy_serve(&o);
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1)
+    return strcmp(argv[1], "--serve") == 0 ? serve(argc - 2, argv + 2)
+                                           : usage();
+
+  puts("Lispy version 0.1");
+  puts("Press Ctrl+C to exit\n");
+
+  lispy_vm_t* vm = lispy_vm_new();
+
+  while (1) {
+    char* input = readline("lispy> ");
+    add_history(input);
+
+    lval* result = lispy_vm_eval(vm, "<stdin>", input);
+    lval_println(result);
+    lval_del(result);
+
+    free(input);
+  }
+
+  lispy_vm_del(vm);
+
+  return 0;
+}
@@ -0,0 +1,540 @@
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "lispy.h"
+
+// Hash maps are hash array mapped tries. Every node maps 5 bits of the key
+// hash to a packed array of entries through a 32-bit bitmap; an entry is
+// either a key/value leaf or a child node. Nodes never change once built,
+// updates copy the path from the root and share everything else, so
+// lval_copy of a map only has to bump the reference count of its root.
+
+#define LHAMT_BITS 5
+#define LHAMT_MASK ((1 << LHAMT_BITS) - 1)
+#define LHAMT_MAX_SHIFT 64
+
+// leaves are shared between all the nodes that reach them
+typedef struct lhleaf {
+  atomic_int refs;
+  uint64_t hash;
+  lval* key;
+  lval* val;
+} lhleaf;
+
+typedef struct lhentry {
+  lhleaf* leaf;
+  lhnode* child;
+} lhentry;
+
+struct lhnode {
+  atomic_int refs;
+  // 0 once the hash bits run out, entries are then a list of collisions
+  uint32_t bitmap;
+  int count;
+  lhentry entries[];
+};
+
+// takes ownership of k and v
+static lhleaf* lhleaf_new(uint64_t hash, lval* k, lval* v) {
+  lhleaf* l = malloc(sizeof(lhleaf));
+  atomic_init(&l->refs, 1);
+  l->hash = hash;
+  l->key = k;
+  l->val = v;
+  return l;
+}
+
+static void lhleaf_release(lhleaf* l) {
+  if (atomic_fetch_sub_explicit(&l->refs, 1, memory_order_acq_rel) != 1)
+    return;
+  lval_del(l->key);
+  lval_del(l->val);
+  free(l);
+}
+
+static lhnode* lhnode_new(uint32_t bitmap, int count) {
+  lhnode* n = malloc(sizeof(lhnode) + sizeof(lhentry) * count);
+  atomic_init(&n->refs, 1);
+  n->bitmap = bitmap;
+  n->count = count;
+  return n;
+}
+
+static lhnode* lhnode_retain(lhnode* n) {
+  if (n)
+    atomic_fetch_add_explicit(&n->refs, 1, memory_order_relaxed);
+  return n;
+}
+
+static void lhnode_release(lhnode* n) {
+  if (!n || atomic_fetch_sub_explicit(&n->refs, 1, memory_order_acq_rel) != 1)
+    return;
+
+  for (int i = 0; i < n->count; ++i) {
+    if (n->entries[i].child)
+      lhnode_release(n->entries[i].child);
+    else
+      lhleaf_release(n->entries[i].leaf);
+  }
+  free(n);
+}
+
+static lhentry lhentry_retain(lhentry en) {
+  if (en.child)
+    lhnode_retain(en.child);
+  else
+    atomic_fetch_add_explicit(&en.leaf->refs, 1, memory_order_relaxed);
+  return en;
+}
+
+static lhentry lhentry_leaf(lhleaf* l) {
+  lhentry en = {l, NULL};
+  return en;
+}
+
+static lhentry lhentry_child(lhnode* n) {
+  lhentry en = {NULL, n};
+  return en;
+}
+
+// copies a node for modification, sharing its children and leaves; the
+// 'extra' trailing entries are left for the caller to fill in
+static lhnode* lhnode_clone(lhnode* n, int extra) {
+  lhnode* c = lhnode_new(n->bitmap, n->count + extra);
+  for (int i = 0; i < n->count; ++i)
+    c->entries[i] = lhentry_retain(n->entries[i]);
+  return c;
+}
+
+// keys
+
+int lval_is_key(lval* k) {
+  return k->type == LVAL_NUM || k->type == LVAL_SYM;
+}
+
+uint64_t lval_key_hash(lval* k) {
+  // FNV-1a over the symbol bytes or the bits of the number
+  uint64_t h = 14695981039346656037ULL;
+  if (k->type == LVAL_NUM) {
+    double x = k->num == 0 ? 0 : k->num;
+    unsigned char b[sizeof(double)];
+    memcpy(b, &x, sizeof(double));
+    for (size_t i = 0; i < sizeof(double); ++i)
+      h = (h ^ b[i]) * 1099511628211ULL;
+  } else {
+    h ^= 0x9e3779b97f4a7c15ULL;
+    for (unsigned char* s = (unsigned char*)k->sym; *s; ++s)
+      h = (h ^ *s) * 1099511628211ULL;
+  }
+  return h;
+}
+
+int lval_key_eq(lval* x, lval* y) {
+  if (x->type != y->type)
+    return 0;
+  // compare numbers exactly, doubles lose bits beyond 2^53
+  if (x->type == LVAL_NUM)
+    return lval_num_cmp(x, y) == 0;
+  return strcmp(x->sym, y->sym) == 0;
+}
+
+static int lhamt_index(uint32_t bitmap, uint32_t bit) {
+  return __builtin_popcount(bitmap & (bit - 1));
+}
+
+// trie operations
+
+static lval* lhamt_get(lhnode* n, uint64_t hash, lval* k) {
+  for (int shift = 0; n; shift += LHAMT_BITS) {
+    if (n->bitmap == 0) {
+      for (int i = 0; i < n->count; ++i)
+        if (lval_key_eq(n->entries[i].leaf->key, k))
+          return n->entries[i].leaf->val;
+      return NULL;
+    }
+
+    uint32_t bit = 1u << ((hash >> shift) & LHAMT_MASK);
+    if (!(n->bitmap & bit))
+      return NULL;
+
+    lhentry* en = &n->entries[lhamt_index(n->bitmap, bit)];
+    if (en->leaf)
+      return (en->leaf->hash == hash && lval_key_eq(en->leaf->key, k))
+                 ? en->leaf->val
+                 : NULL;
+    n = en->child;
+  }
+  return NULL;
+}
+
+// builds the smallest subtree holding two leaves with distinct keys
+static lhnode* lhamt_pair(lhleaf* a, lhleaf* b, int shift) {
+  if (shift >= LHAMT_MAX_SHIFT) {
+    lhnode* n = lhnode_new(0, 2);
+    n->entries[0] = lhentry_leaf(a);
+    n->entries[1] = lhentry_leaf(b);
+    return n;
+  }
+
+  uint32_t ia = (a->hash >> shift) & LHAMT_MASK;
+  uint32_t ib = (b->hash >> shift) & LHAMT_MASK;
+  if (ia == ib) {
+    lhnode* n = lhnode_new(1u << ia, 1);
+    n->entries[0] = lhentry_child(lhamt_pair(a, b, shift + LHAMT_BITS));
+    return n;
+  }
+
+  lhnode* n = lhnode_new((1u << ia) | (1u << ib), 2);
+  n->entries[ia < ib ? 0 : 1] = lhentry_leaf(a);
+  n->entries[ia < ib ? 1 : 0] = lhentry_leaf(b);
+  return n;
+}
+
+// returns a new node with the leaf added, replacing any leaf with an
+// equal key; takes ownership of the leaf
+static lhnode* lhamt_put(lhnode* n, lhleaf* l, int shift, int* added) {
+  if (!n) {
+    n = lhnode_new(1u << (l->hash & LHAMT_MASK), 1);
+    n->entries[0] = lhentry_leaf(l);
+    *added = 1;
+    return n;
+  }
+
+  if (n->bitmap == 0) {
+    for (int i = 0; i < n->count; ++i)
+      if (lval_key_eq(n->entries[i].leaf->key, l->key)) {
+        lhnode* c = lhnode_clone(n, 0);
+        lhleaf_release(c->entries[i].leaf);
+        c->entries[i] = lhentry_leaf(l);
+        return c;
+      }
+    lhnode* c = lhnode_clone(n, 1);
+    c->entries[n->count] = lhentry_leaf(l);
+    *added = 1;
+    return c;
+  }
+
+  uint32_t bit = 1u << ((l->hash >> shift) & LHAMT_MASK);
+  int idx = lhamt_index(n->bitmap, bit);
+
+  if (!(n->bitmap & bit)) {
+    // open a new slot, shifting the entries after it
+    lhnode* c = lhnode_new(n->bitmap | bit, n->count + 1);
+    for (int i = 0, j = 0; i < c->count; ++i)
+      if (i != idx)
+        c->entries[i] = lhentry_retain(n->entries[j++]);
+    c->entries[idx] = lhentry_leaf(l);
+    *added = 1;
+    return c;
+  }
+
+  lhnode* c = lhnode_clone(n, 0);
+  lhentry* en = &c->entries[idx];
+  if (en->child) {
+    lhnode* child = lhamt_put(en->child, l, shift + LHAMT_BITS, added);
+    lhnode_release(en->child);
+    en->child = child;
+  } else if (en->leaf->hash == l->hash && lval_key_eq(en->leaf->key, l->key)) {
+    lhleaf_release(en->leaf);
+    en->leaf = l;
+  } else {
+    // two different keys share this slot, push both one level down
+    *en = lhentry_child(lhamt_pair(en->leaf, l, shift + LHAMT_BITS));
+    *added = 1;
+  }
+  return c;
+}
+
+// returns a new node without k, NULL when it becomes empty, or 'n' itself
+// (not retained) when k is absent
+static lhnode* lhamt_del(lhnode* n, uint64_t hash, lval* k, int shift) {
+  int idx = -1;
+  uint32_t bit = 0;
+
+  if (n->bitmap == 0) {
+    for (int i = 0; i < n->count; ++i)
+      if (lval_key_eq(n->entries[i].leaf->key, k))
+        idx = i;
+    if (idx < 0)
+      return n;
+  } else {
+    bit = 1u << ((hash >> shift) & LHAMT_MASK);
+    if (!(n->bitmap & bit))
+      return n;
+    idx = lhamt_index(n->bitmap, bit);
+
+    lhentry* en = &n->entries[idx];
+    if (en->child) {
+      lhnode* child = lhamt_del(en->child, hash, k, shift + LHAMT_BITS);
+      if (child == en->child)
+        return n;
+      if (child) {
+        lhnode* c = lhnode_clone(n, 0);
+        lhnode_release(c->entries[idx].child);
+        c->entries[idx].child = child;
+        return c;
+      }
+      // the child emptied out, drop its slot below
+    } else if (en->leaf->hash != hash || !lval_key_eq(en->leaf->key, k)) {
+      return n;
+    }
+  }
+
+  if (n->count == 1)
+    return NULL;
+
+  lhnode* c = lhnode_new(n->bitmap & ~bit, n->count - 1);
+  for (int i = 0, j = 0; i < n->count; ++i)
+    if (i != idx)
+      c->entries[j++] = lhentry_retain(n->entries[i]);
+  return c;
+}
+
+typedef void (*lhamt_visit)(lval* k, lval* v, void* ctx);
+
+static void lhamt_each(lhnode* n, lhamt_visit fn, void* ctx) {
+  if (!n)
+    return;
+  for (int i = 0; i < n->count; ++i) {
+    if (n->entries[i].child)
+      lhamt_each(n->entries[i].child, fn, ctx);
+    else
+      fn(n->entries[i].leaf->key, n->entries[i].leaf->val, ctx);
+  }
+}
+
+// map values
+
+lval* lval_map(void) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_MAP;
+  v->count = 0;
+  v->map = NULL;
+  return v;
+}
+
+void lval_map_del(lval* v) {
+  lhnode_release(v->map);
+}
+
+void lval_map_copy(lval* x, lval* v) {
+  x->count = v->count;
+  x->map = lhnode_retain(v->map);
+}
+
+lval* lval_map_get(lval* m, lval* k) {
+  return lhamt_get(m->map, lval_key_hash(k), k);
+}
+
+// binds k to v in 'm' in place, takes ownership of k and v
+lval* lval_map_put(lval* m, lval* k, lval* v) {
+  int added = 0;
+  lhnode* n = lhamt_put(m->map, lhleaf_new(lval_key_hash(k), k, v), 0, &added);
+  lhnode_release(m->map);
+  m->map = n;
+  m->count += added;
+  return m;
+}
+
+lval* lval_map_remove(lval* m, lval* k) {
+  if (!m->map)
+    return m;
+  lhnode* n = lhamt_del(m->map, lval_key_hash(k), k, 0);
+  if (n != m->map) {
+    lhnode_release(m->map);
+    m->map = n;
+    m->count--;
+  }
+  return m;
+}
+
+typedef struct lmap_eq {
+  lval* other;
+  int strict;
+  int eq;
+} lmap_eq;
+
+static void lval_map_eq_entry(lval* k, lval* v, void* ctx) {
+  lmap_eq* c = ctx;
+  if (!c->eq)
+    return;
+  lval* w = lval_map_get(c->other, k);
+  c->eq = w && lval_eq(v, w, c->strict);
+}
+
+int lval_map_eq(lval* x, lval* y, int strict) {
+  if (x->count != y->count)
+    return 0;
+  if (x->map == y->map)
+    return 1;
+  lmap_eq c = {y, strict, 1};
+  lhamt_each(x->map, lval_map_eq_entry, &c);
+  return c.eq;
+}
+
+static void lval_map_hash_entry(lval* k, lval* v, void* ctx) {
+  uint64_t* h = ctx;
+  uint64_t kh = lval_hash(k);
+  *h += (kh ^ (kh >> 29)) * 0x9e3779b97f4a7c15ULL ^ lval_hash(v);
+}
+
+// the entries are summed, so the hash does not depend on trie order
+uint64_t lval_map_hash(lval* m) {
+  uint64_t h = LVAL_MAP + (uint64_t)m->count;
+  lhamt_each(m->map, lval_map_hash_entry, &h);
+  return h;
+}
+
+typedef struct lmap_printer {
+  FILE* f;
+  int first;
+} lmap_printer;
+
+static void lval_map_print_entry(lval* k, lval* v, void* ctx) {
+  lmap_printer* p = ctx;
+  if (!p->first)
+    fputc(' ', p->f);
+  p->first = 0;
+  lval_fprint(p->f, k);
+  fputc(' ', p->f);
+  lval_fprint(p->f, v);
+}
+
+void lval_map_print(FILE* f, lval* m) {
+  lmap_printer p = {f, 1};
+  fprintf(f, "#{");
+  lhamt_each(m->map, lval_map_print_entry, &p);
+  fputc('}', f);
+}
+
+static void lval_map_collect_key(lval* k, lval* v, void* ctx) {
+  UNUSED(v);
+  lval** q = ctx;
+  *q = lval_add(*q, lval_copy(k));
+}
+
+// builtins
+
+// symbols reach builtins as single-element Q-expressions, e.g. {a}
+static lval* lval_map_key_arg(lval* a, int i) {
+  lval* k = lval_unpack(a->cell[i]);
+  if (k->type == LVAL_QEXPR && k->count == 1)
+    return k->cell[0];
+  return k;
+}
+
+#define LASSERT_KEY(func, args, index)                                  \
+  LASSERT(args, lval_is_key(lval_map_key_arg(args, index)),            \
+          "Function '%s': invalid key type on %i. "                     \
+          "Got %s, Expected %s or %s.",                                  \
+          func, index, lval_t_name(lval_map_key_arg(args, index)->type), \
+          lval_t_name(LVAL_NUM), lval_t_name(LVAL_SYM))
+
+lval* builtin_hash_map(lenv* e, lval* a) {
+  UNUSED(e);
+
+  // either no arguments or an association list {{k v} {k v} ...}
+  LASSERT(a, a->count <= 1,
+          "Function 'hash-map': incorrect number of arguments. "
+          "Got %i, Expected 0 or 1.",
+          a->count);
+
+  lval* m = lval_map();
+  if (a->count == 0) {
+    lval_del(a);
+    return m;
+  }
+
+  LASSERT_TYPE("hash-map", a, 0, LVAL_QEXPR);
+  lval* q = lval_unpack(a->cell[0]);
+  lval k, v;
+  for (int i = 0; i < q->count; ++i) {
+    lval* p = q->cell[i];
+    if (p->type != LVAL_QEXPR || p->count != 2 ||
+        !lval_is_key(lval_peek(p, 0, &k))) {
+      lval_del(m);
+      lval_del(a);
+      return lval_err(
+          "Function 'hash-map': entry %i is not a {key value} pair.", i);
+    }
+    m = lval_map_put(m, lval_copy(lval_peek(p, 0, &k)),
+                     lval_copy(lval_peek(p, 1, &v)));
+  }
+
+  lval_del(a);
+  return m;
+}
+
+lval* builtin_hash_get(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT(a, a->count == 2 || a->count == 3,
+          "Function 'hash-get': incorrect number of arguments. "
+          "Got %i, Expected 2 or 3.",
+          a->count);
+  LASSERT_TYPE("hash-get", a, 0, LVAL_MAP);
+  LASSERT_KEY("hash-get", a, 1);
+
+  lval* k = lval_map_key_arg(a, 1);
+  lval* v = lval_map_get(a->cell[0], k);
+  lval* x = NULL;
+  if (v)
+    x = lval_copy(v);
+  else if (a->count == 3)
+    x = lval_pop(a, 2);
+  else
+    x = lval_err("Function 'hash-get': key not found.");
+
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_hash_put(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("hash-put", a, 3);
+  LASSERT_TYPE("hash-put", a, 0, LVAL_MAP);
+  LASSERT_KEY("hash-put", a, 1);
+
+  lval* m = lval_pop(a, 0);
+  lval* k = lval_copy(lval_map_key_arg(a, 0));
+  m = lval_map_put(m, k, lval_pop(a, 1));
+  lval_del(a);
+  return m;
+}
+
+lval* builtin_hash_del(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("hash-del", a, 2);
+  LASSERT_TYPE("hash-del", a, 0, LVAL_MAP);
+  LASSERT_KEY("hash-del", a, 1);
+
+  lval* m = lval_pop(a, 0);
+  m = lval_map_remove(m, lval_map_key_arg(a, 0));
+  lval_del(a);
+  return m;
+}
+
+lval* builtin_hash_keys(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("hash-keys", a, 1);
+  LASSERT_TYPE("hash-keys", a, 0, LVAL_MAP);
+
+  lval* q = lval_qexpr();
+  lhamt_each(a->cell[0]->map, lval_map_collect_key, &q);
+  lval_del(a);
+  return q;
+}
+
+lval* builtin_hash_len(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("hash-len", a, 1);
+  LASSERT_TYPE("hash-len", a, 0, LVAL_MAP);
+
+  lval* x = lval_int(a->cell[0]->count);
+  lval_del(a);
+  return x;
+}
@@ -0,0 +1,363 @@
+#include "lispy.h"
+
+// matrices are row-major blocks of doubles, allocated like vectors
+#define LMAT_BLOCK 64
+
+// below this many multiply-adds a matmul is not worth waking the pool
+#define LMAT_PAR_MIN (128 * 128 * 128)
+
+lval* lval_mat(int rows, int cols) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_MAT;
+  v->rows = rows;
+  v->cols = cols;
+  v->count = rows * cols;
+  v->data = lvec_alloc(v->count);
+  return v;
+}
+
+// kernels
+
+typedef struct lmatmul {
+  const double* a;
+  const double* b;
+  double* c;
+  int n;
+  int k;
+  int m;
+} lmatmul;
+
+// c[i0..i1) += a[i0..i1) * b, tiled so a block of b stays in cache
+static void lmat_mul_rows(lmatmul* mm, int i0, int i1) {
+  for (int kk = 0; kk < mm->k; kk += LMAT_BLOCK) {
+    int k1 = MIN(kk + LMAT_BLOCK, mm->k);
+    for (int jj = 0; jj < mm->m; jj += LMAT_BLOCK) {
+      int j1 = MIN(jj + LMAT_BLOCK, mm->m);
+      for (int i = i0; i < i1; ++i) {
+        double* restrict c = mm->c + (size_t)i * mm->m;
+        const double* arow = mm->a + (size_t)i * mm->k;
+        for (int k = kk; k < k1; ++k) {
+          double aik = arow[k];
+          const double* restrict b = mm->b + (size_t)k * mm->m;
+          for (int j = jj; j < j1; ++j)
+            c[j] += aik * b[j];
+        }
+      }
+    }
+  }
+}
+
+static void lmat_mul_task(void* ctx, int t) {
+  lmatmul* mm = ctx;
+  int i0 = t * LMAT_BLOCK;
+  lmat_mul_rows(mm, i0, MIN(i0 + LMAT_BLOCK, mm->n));
+}
+
+static void lmat_mul(lval* c, lval* a, lval* b) {
+  lmatmul mm = {a->data, b->data, c->data, a->rows, a->cols, b->cols};
+  memset(c->data, 0, sizeof(double) * c->count);
+
+  // each task owns a band of rows of c, so no synchronization is needed
+  int tasks = (mm.n + LMAT_BLOCK - 1) / LMAT_BLOCK;
+  if ((double)mm.n * mm.k * mm.m >= LMAT_PAR_MIN)
+    lpool_run(lpool_global(), lmat_mul_task, &mm, tasks);
+  else
+    lmat_mul_rows(&mm, 0, mm.n);
+}
+
+static void lmat_transpose(double* restrict t,
+                           const double* restrict x,
+                           int rows,
+                           int cols) {
+  for (int ii = 0; ii < rows; ii += LMAT_BLOCK)
+    for (int jj = 0; jj < cols; jj += LMAT_BLOCK)
+      for (int i = ii; i < MIN(ii + LMAT_BLOCK, rows); ++i)
+        for (int j = jj; j < MIN(jj + LMAT_BLOCK, cols); ++j)
+          t[(size_t)j * rows + i] = x[(size_t)i * cols + j];
+}
+
+// the column count implied by the first row, checked by lmat_read_rows
+static int lmat_cols(lval* rows) {
+  if (rows->count == 0 || rows->cell[0]->type != LVAL_QEXPR)
+    return 0;
+  return rows->cell[0]->count;
+}
+
+// reads the rows of a nested Q-expression into 'm', returns an error or NULL
+static lval* lmat_read_rows(lval* m, lval* rows, char* func) {
+  for (int i = 0; i < m->rows; ++i) {
+    lval* row = rows->cell[i];
+    if (row->type != LVAL_QEXPR)
+      return lval_err("Function '%s': row %i is not a Q-Expression. Got %s.",
+                      func, i, lval_t_name(row->type));
+    if (row->count != m->cols)
+      return lval_err("Function '%s': row %i has %i columns, Expected %i.",
+                      func, i, row->count, m->cols);
+
+    lval tmp;
+    for (int j = 0; j < m->cols; ++j) {
+      lval* x = lval_peek(row, j, &tmp);
+      if (x->type != LVAL_NUM)
+        return lval_err(
+            "Function '%s': invalid element type at (%i, %i). "
+            "Got %s, Expected %s.",
+            func, i, j, lval_t_name(x->type), lval_t_name(LVAL_NUM));
+      m->data[i * m->cols + j] = x->num;
+    }
+  }
+
+  return NULL;
+}
+
+// builtins
+
+lval* builtin_mat(lenv* e, lval* a) {
+  UNUSED(e);
+
+  // each argument is a row
+  lval* m = lval_mat(a->count, lmat_cols(a));
+  lval* err = lmat_read_rows(m, a, "mat");
+  lval_del(a);
+  if (err) {
+    lval_del(m);
+    return err;
+  }
+  return m;
+}
+
+lval* builtin_list_to_mat(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("list->mat", a, 1);
+  LASSERT_TYPE("list->mat", a, 0, LVAL_QEXPR);
+
+  // the rows themselves are never numbers, only their elements
+  lval* q = lval_unpack(a->cell[0]);
+  lval* m = lval_mat(q->count, lmat_cols(q));
+  lval* err = lmat_read_rows(m, q, "list->mat");
+  lval_del(a);
+  if (err) {
+    lval_del(m);
+    return err;
+  }
+  return m;
+}
+
+lval* builtin_mat_to_list(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("mat->list", a, 1);
+  LASSERT_TYPE("mat->list", a, 0, LVAL_MAT);
+
+  lval* m = lval_take(a, 0);
+  lval* q = lval_qexpr();
+  for (int i = 0; i < m->rows; ++i) {
+    lval* row = lval_qexpr();
+    for (int j = 0; j < m->cols; ++j)
+      row = lval_add(row, lval_num(m->data[i * m->cols + j]));
+    q = lval_add(q, row);
+  }
+
+  lval_del(m);
+  return q;
+}
+
+lval* builtin_mshape(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("mshape", a, 1);
+  LASSERT_TYPE("mshape", a, 0, LVAL_MAT);
+
+  lval* m = a->cell[0];
+  lval* q = lval_add(lval_qexpr(), lval_int(m->rows));
+  q = lval_add(q, lval_int(m->cols));
+  lval_del(a);
+  return q;
+}
+
+lval* builtin_matmul(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("matmul", a, 2);
+  LASSERT_TYPE("matmul", a, 0, LVAL_MAT);
+  LASSERT_TYPE("matmul", a, 1, LVAL_MAT);
+
+  lval* x = a->cell[0];
+  lval* y = a->cell[1];
+  LASSERT(a, x->cols == y->rows,
+          "Function 'matmul': shape mismatch. Got %ix%i and %ix%i.", x->rows,
+          x->cols, y->rows, y->cols);
+
+  lval* c = lval_mat(x->rows, y->cols);
+  lmat_mul(c, x, y);
+  lval_del(a);
+  return c;
+}
+
+lval* builtin_transpose(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("transpose", a, 1);
+  LASSERT_TYPE("transpose", a, 0, LVAL_MAT);
+
+  lval* m = a->cell[0];
+  lval* t = lval_mat(m->cols, m->rows);
+  lmat_transpose(t->data, m->data, m->rows, m->cols);
+  lval_del(a);
+  return t;
+}
+
+// whether a number is zero or a matrix holds one, which m/ rejects as /
+// does rather than filling the result with infinities
+static int lmat_has_zero(lval* y) {
+  if (y->type == LVAL_NUM)
+    return y->num == 0;
+  for (int i = 0; i < y->count; ++i)
+    if (y->data[i] == 0)
+      return 1;
+  return 0;
+}
+
+// elementwise operation of a matrix with a matrix of the same shape or a
+// number, computed into the first argument
+static lval* builtin_melem(lenv* e, lval* a, char* op) {
+  UNUSED(e);
+
+  LASSERT_NUM(op, a, 2);
+  LASSERT_TYPE(op, a, 0, LVAL_MAT);
+  LASSERT(a, a->cell[1]->type == LVAL_MAT || a->cell[1]->type == LVAL_NUM,
+          "Function '%s': invalid argument type on 1. "
+          "Got %s, Expected %s or %s.",
+          op, lval_t_name(a->cell[1]->type), lval_t_name(LVAL_MAT),
+          lval_t_name(LVAL_NUM));
+
+  lval* x = a->cell[0];
+  lval* y = a->cell[1];
+  if (y->type == LVAL_MAT)
+    LASSERT(a, x->rows == y->rows && x->cols == y->cols,
+            "Function '%s': shape mismatch. Got %ix%i and %ix%i.", op,
+            x->rows, x->cols, y->rows, y->cols);
+  if (strcmp(op, "m/") == 0)
+    LASSERT(a, !lmat_has_zero(y), "Division by zero");
+
+  x = lval_pop(a, 0);
+  double* restrict d = x->data;
+  int n = x->count;
+
+  if (y->type == LVAL_NUM) {
+    double k = y->num;
+    if (strcmp(op, "m+") == 0)
+      for (int i = 0; i < n; ++i)
+        d[i] += k;
+    else if (strcmp(op, "m-") == 0)
+      for (int i = 0; i < n; ++i)
+        d[i] -= k;
+    else if (strcmp(op, "m*") == 0)
+      for (int i = 0; i < n; ++i)
+        d[i] *= k;
+    else if (strcmp(op, "m/") == 0)
+      for (int i = 0; i < n; ++i)
+        d[i] /= k;
+  } else {
+    const double* restrict s = y->data;
+    if (strcmp(op, "m+") == 0)
+      for (int i = 0; i < n; ++i)
+        d[i] += s[i];
+    else if (strcmp(op, "m-") == 0)
+      for (int i = 0; i < n; ++i)
+        d[i] -= s[i];
+    else if (strcmp(op, "m*") == 0)
+      for (int i = 0; i < n; ++i)
+        d[i] *= s[i];
+    else if (strcmp(op, "m/") == 0)
+      for (int i = 0; i < n; ++i)
+        d[i] /= s[i];
+  }
+
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_madd(lenv* e, lval* a) {
+  return builtin_melem(e, a, "m+");
+}
+
+lval* builtin_msub(lenv* e, lval* a) {
+  return builtin_melem(e, a, "m-");
+}
+
+lval* builtin_mmul(lenv* e, lval* a) {
+  return builtin_melem(e, a, "m*");
+}
+
+lval* builtin_mdiv(lenv* e, lval* a) {
+  return builtin_melem(e, a, "m/");
+}
+
+lval* builtin_msum(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT(a, a->count == 1 || a->count == 2,
+          "Function 'msum': incorrect number of arguments. "
+          "Got %i, Expected 1 or 2.",
+          a->count);
+  LASSERT_TYPE("msum", a, 0, LVAL_MAT);
+
+  lval* m = a->cell[0];
+  lval* x = NULL;
+
+  if (a->count == 1) {
+    x = lval_num(lvec_sum(m->data, m->count));
+  } else {
+    // axis 0 sums down the columns, axis 1 along the rows
+    LASSERT_TYPE("msum", a, 1, LVAL_NUM);
+    double axis = a->cell[1]->num;
+    LASSERT(a, axis == 0 || axis == 1,
+            "Function 'msum': axis must be 0 or 1. Got " LNUM_DBL_FMT ".",
+            axis);
+
+    if (axis == 0) {
+      x = lval_vec(m->cols);
+      memset(x->data, 0, sizeof(double) * x->count);
+      for (int i = 0; i < m->rows; ++i) {
+        const double* restrict row = m->data + (size_t)i * m->cols;
+        double* restrict s = x->data;
+        for (int j = 0; j < m->cols; ++j)
+          s[j] += row[j];
+      }
+    } else {
+      x = lval_vec(m->rows);
+      for (int i = 0; i < m->rows; ++i)
+        x->data[i] = lvec_sum(m->data + (size_t)i * m->cols, m->cols);
+    }
+  }
+
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_mmin(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("mmin", a, 1);
+  LASSERT_TYPE("mmin", a, 0, LVAL_MAT);
+  LASSERT_NOT_EMPTY("mmin", a, 0);
+
+  lval* m = a->cell[0];
+  lval* x = lval_num(lvec_min(m->data, m->count));
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_mmax(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("mmax", a, 1);
+  LASSERT_TYPE("mmax", a, 0, LVAL_MAT);
+  LASSERT_NOT_EMPTY("mmax", a, 0);
+
+  lval* m = a->cell[0];
+  lval* x = lval_num(lvec_max(m->data, m->count));
+  lval_del(a);
+  return x;
+}
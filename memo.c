@@ -0,0 +1,247 @@
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "lispy.h"
+
+// Memoized lambdas carry a cache from argument lists to results, looked up
+// by lval_call before any formals are bound. Entries are found by the
+// structural hash of the arguments and compared with equal?, and the least
+// recently used one is evicted once the cache is full. Copies of a
+// memoized lambda share its cache.
+
+#define LMEMO_CAPACITY 1024
+
+typedef struct lmemo_entry lmemo_entry;
+
+struct lmemo_entry {
+  uint64_t hash;
+  lval* args;
+  lval* result;
+  // bucket chain
+  lmemo_entry* next;
+  // recency list, most recently used first
+  lmemo_entry* newer;
+  lmemo_entry* older;
+};
+
+struct lmemo {
+  atomic_int refs;
+  pthread_mutex_t lock;
+  int capacity;
+  int count;
+  int size;
+  lmemo_entry** buckets;
+  lmemo_entry* newest;
+  lmemo_entry* oldest;
+  long hits;
+  long misses;
+  long evictions;
+};
+
+lmemo* lmemo_new(int capacity) {
+  lmemo* m = malloc(sizeof(lmemo));
+  atomic_init(&m->refs, 1);
+  pthread_mutex_init(&m->lock, NULL);
+  m->capacity = capacity;
+  m->count = 0;
+  m->size = 0;
+  m->buckets = NULL;
+  m->newest = NULL;
+  m->oldest = NULL;
+  m->hits = 0;
+  m->misses = 0;
+  m->evictions = 0;
+  return m;
+}
+
+lmemo* lmemo_retain(lmemo* m) {
+  if (m)
+    atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+  return m;
+}
+
+void lmemo_release(lmemo* m) {
+  if (!m || atomic_fetch_sub_explicit(&m->refs, 1, memory_order_acq_rel) != 1)
+    return;
+
+  for (lmemo_entry* en = m->newest; en;) {
+    lmemo_entry* older = en->older;
+    lval_del(en->args);
+    lval_del(en->result);
+    free(en);
+    en = older;
+  }
+  free(m->buckets);
+  pthread_mutex_destroy(&m->lock);
+  free(m);
+}
+
+static void lmemo_unlink(lmemo* m, lmemo_entry* en) {
+  if (en->newer)
+    en->newer->older = en->older;
+  else
+    m->newest = en->older;
+  if (en->older)
+    en->older->newer = en->newer;
+  else
+    m->oldest = en->newer;
+}
+
+static void lmemo_push(lmemo* m, lmemo_entry* en) {
+  en->newer = NULL;
+  en->older = m->newest;
+  if (m->newest)
+    m->newest->newer = en;
+  else
+    m->oldest = en;
+  m->newest = en;
+}
+
+static void lmemo_grow(lmemo* m) {
+  int size = m->size ? m->size * 2 : 64;
+  lmemo_entry** buckets = calloc(size, sizeof(lmemo_entry*));
+  for (lmemo_entry* en = m->newest; en; en = en->older) {
+    en->next = buckets[en->hash & (size - 1)];
+    buckets[en->hash & (size - 1)] = en;
+  }
+  free(m->buckets);
+  m->buckets = buckets;
+  m->size = size;
+}
+
+static void lmemo_evict(lmemo* m) {
+  lmemo_entry* en = m->oldest;
+  lmemo_entry** p = &m->buckets[en->hash & (m->size - 1)];
+  while (*p != en)
+    p = &(*p)->next;
+  *p = en->next;
+  lmemo_unlink(m, en);
+  m->count--;
+  m->evictions++;
+
+  lval_del(en->args);
+  lval_del(en->result);
+  free(en);
+}
+
+// a copy of the result cached for 'args', or NULL
+lval* lmemo_get(lmemo* m, lval* args) {
+  uint64_t h = lval_hash(args);
+  lval* result = NULL;
+
+  pthread_mutex_lock(&m->lock);
+  if (m->size)
+    for (lmemo_entry* en = m->buckets[h & (m->size - 1)]; en; en = en->next)
+      if (en->hash == h && lval_eq(en->args, args, 1)) {
+        lmemo_unlink(m, en);
+        lmemo_push(m, en);
+        result = lval_copy(en->result);
+        break;
+      }
+  if (result)
+    m->hits++;
+  else
+    m->misses++;
+  pthread_mutex_unlock(&m->lock);
+  return result;
+}
+
+// caches a copy of 'result' for 'args', takes ownership of args
+void lmemo_put(lmemo* m, lval* args, lval* result) {
+  // errors are not remembered, the next call may succeed
+  if (result->type == LVAL_ERR) {
+    lval_del(args);
+    return;
+  }
+
+  uint64_t h = lval_hash(args);
+  pthread_mutex_lock(&m->lock);
+  // calls made at once on several threads all miss, the first one in
+  // keeps its entry
+  if (m->size)
+    for (lmemo_entry* en = m->buckets[h & (m->size - 1)]; en; en = en->next)
+      if (en->hash == h && lval_eq(en->args, args, 1)) {
+        pthread_mutex_unlock(&m->lock);
+        lval_del(args);
+        return;
+      }
+
+  lmemo_entry* en = malloc(sizeof(lmemo_entry));
+  en->hash = h;
+  en->args = args;
+  en->result = lval_copy(result);
+
+  if (m->count >= m->capacity)
+    lmemo_evict(m);
+  if (m->count >= m->size)
+    lmemo_grow(m);
+
+  en->next = m->buckets[en->hash & (m->size - 1)];
+  m->buckets[en->hash & (m->size - 1)] = en;
+  lmemo_push(m, en);
+  m->count++;
+  pthread_mutex_unlock(&m->lock);
+}
+
+// builtins
+
+lval* builtin_memo(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT(a, a->count == 1 || a->count == 2,
+          "Function 'memo': incorrect number of arguments. "
+          "Got %i, Expected 1 or 2.",
+          a->count);
+  LASSERT_TYPE("memo", a, 0, LVAL_FUN);
+  LASSERT(a, !a->cell[0]->builtin,
+          "Function 'memo': cannot memoize a builtin function.");
+
+  int capacity = LMEMO_CAPACITY;
+  if (a->count == 2) {
+    LASSERT_TYPE("memo", a, 1, LVAL_NUM);
+    lval* n = a->cell[1];
+    LASSERT(a, n->numt != LNUM_DBL,
+            "Function 'memo': capacity must be an integer.");
+    LASSERT(a, n->numt == LNUM_INT && n->inum >= 1 && n->inum <= INT32_MAX,
+            "Function 'memo': capacity must be from 1 to %i.", INT32_MAX);
+    capacity = n->inum;
+  }
+
+  // a fresh cache, the lambda itself is not changed
+  lval* f = lval_pop(a, 0);
+  lmemo_release(f->memo);
+  f->memo = lmemo_new(capacity);
+  lval_del(a);
+  return f;
+}
+
+static lval* lmemo_stat(lval* m, char* name, long n) {
+  return lval_map_put(m, lval_sym(name), lval_int(n));
+}
+
+lval* builtin_memo_stats(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("memo-stats", a, 1);
+  LASSERT_TYPE("memo-stats", a, 0, LVAL_FUN);
+
+  lmemo* memo = a->cell[0]->builtin ? NULL : a->cell[0]->memo;
+  LASSERT(a, memo, "Function 'memo-stats': function is not memoized.");
+
+  pthread_mutex_lock(&memo->lock);
+  long capacity = memo->capacity;
+  long count = memo->count;
+  long hits = memo->hits;
+  long misses = memo->misses;
+  long evictions = memo->evictions;
+  pthread_mutex_unlock(&memo->lock);
+
+  lval* m = lval_map();
+  m = lmemo_stat(m, "capacity", capacity);
+  m = lmemo_stat(m, "entries", count);
+  m = lmemo_stat(m, "hits", hits);
+  m = lmemo_stat(m, "misses", misses);
+  m = lmemo_stat(m, "evictions", evictions);
+  lval_del(a);
+  return m;
+}
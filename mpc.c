@@ -601,7 +601,7 @@ static void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
+static _Thread_local char char_unescape_buffer[4];
 
 static const char *mpc_err_char_unescape(char c) {
 
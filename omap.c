@@ -0,0 +1,560 @@
+#include <stdatomic.h>
+
+#include "lispy.h"
+
+// Ordered maps are persistent B+ trees keyed by numbers. Keys sit in one
+// contiguous array per node so a search touches a few cache lines per
+// level, and values only live in the leaves. Updates copy the path from the
+// root and share every other node, like hash maps.
+//
+// A key keeps its exact value next to its double, as ints beyond 2^53 and
+// bignums round to doubles they share with their neighbours. Searches
+// compare the doubles and only look at the exact values when those tie.
+
+#define LBT_MAX 32
+
+typedef struct lbkey {
+  double num;
+  lnum_t numt;
+  int64_t inum;
+  lbig* big;
+} lbkey;
+
+struct lbnode {
+  atomic_int refs;
+  int leaf;
+  int count;
+  // one spare slot so a node can overflow before it is split
+  lbkey keys[LBT_MAX + 1];
+  union {
+    lval* vals[LBT_MAX + 1];
+    lbnode* kids[LBT_MAX + 2];
+  };
+};
+
+static lbkey lbkey_of(lval* k) {
+  return (lbkey){k->num, k->numt, k->inum, lbig_retain(k->big)};
+}
+
+static lbkey lbkey_retain(lbkey k) {
+  lbig_retain(k.big);
+  return k;
+}
+
+// the key as a number value backed by 'tmp', which must not be freed
+static lval* lbkey_peek(lbkey* k, lval* tmp) {
+  tmp->type = LVAL_NUM;
+  tmp->numt = k->numt;
+  tmp->inum = k->inum;
+  tmp->big = k->big;
+  tmp->num = k->num;
+  return tmp;
+}
+
+// orders a stored key against the number k
+static int lbkey_cmp(lbkey* a, lval* k) {
+  if (a->num != k->num)
+    return a->num < k->num ? -1 : 1;
+  if (a->numt == LNUM_DBL && k->numt == LNUM_DBL)
+    return 0;
+  lval tmp;
+  return lval_num_cmp(lbkey_peek(a, &tmp), k);
+}
+
+static lbnode* lbnode_new(int leaf) {
+  lbnode* n = malloc(sizeof(lbnode));
+  atomic_init(&n->refs, 1);
+  n->leaf = leaf;
+  n->count = 0;
+  return n;
+}
+
+static lbnode* lbnode_retain(lbnode* n) {
+  if (n)
+    atomic_fetch_add_explicit(&n->refs, 1, memory_order_relaxed);
+  return n;
+}
+
+static void lbnode_release(lbnode* n) {
+  if (!n || atomic_fetch_sub_explicit(&n->refs, 1, memory_order_acq_rel) != 1)
+    return;
+
+  for (int i = 0; i < n->count; ++i)
+    lbig_release(n->keys[i].big);
+  if (n->leaf)
+    for (int i = 0; i < n->count; ++i)
+      lval_del(n->vals[i]);
+  else
+    for (int i = 0; i <= n->count; ++i)
+      lbnode_release(n->kids[i]);
+  free(n);
+}
+
+static lbnode* lbnode_clone(lbnode* n) {
+  lbnode* c = lbnode_new(n->leaf);
+  c->count = n->count;
+  for (int i = 0; i < n->count; ++i)
+    c->keys[i] = lbkey_retain(n->keys[i]);
+  if (n->leaf)
+    for (int i = 0; i < n->count; ++i)
+      c->vals[i] = lval_copy(n->vals[i]);
+  else
+    for (int i = 0; i <= n->count; ++i)
+      c->kids[i] = lbnode_retain(n->kids[i]);
+  return c;
+}
+
+// index of the first key >= k
+static int lbt_lower(lbnode* n, lval* k) {
+  int lo = 0, hi = n->count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (lbkey_cmp(&n->keys[mid], k) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// index of the first key > k, which is also the child to descend into
+static int lbt_upper(lbnode* n, lval* k) {
+  int lo = 0, hi = n->count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (lbkey_cmp(&n->keys[mid], k) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// moves the upper half of an overfull node into a new right sibling and
+// returns the separator key for the parent
+static lbkey lbt_split(lbnode* n, lbnode** right) {
+  lbnode* r = lbnode_new(n->leaf);
+  int half = n->count / 2;
+  lbkey sep;
+
+  if (n->leaf) {
+    // leaves keep every key, the separator is copied up
+    r->count = n->count - half;
+    memcpy(r->keys, n->keys + half, sizeof(lbkey) * r->count);
+    memcpy(r->vals, n->vals + half, sizeof(lval*) * r->count);
+    n->count = half;
+    sep = lbkey_retain(r->keys[0]);
+  } else {
+    // the middle key of an inner node moves up to the parent
+    sep = n->keys[half];
+    r->count = n->count - half - 1;
+    memcpy(r->keys, n->keys + half + 1, sizeof(lbkey) * r->count);
+    memcpy(r->kids, n->kids + half + 1, sizeof(lbnode*) * (r->count + 1));
+    n->count = half;
+  }
+
+  *right = r;
+  return sep;
+}
+
+// returns a new node with k bound to v, takes ownership of v; when the new
+// node had to be split its right half is returned through 'right'
+static lbnode* lbt_put(lbnode* n,
+                       lval* k,
+                       lval* v,
+                       lbnode** right,
+                       lbkey* sep,
+                       int* added) {
+  lbnode* c = lbnode_clone(n);
+  *right = NULL;
+
+  if (c->leaf) {
+    int i = lbt_lower(c, k);
+    if (i < c->count && lbkey_cmp(&c->keys[i], k) == 0) {
+      lval_del(c->vals[i]);
+      c->vals[i] = v;
+      return c;
+    }
+
+    memmove(c->keys + i + 1, c->keys + i, sizeof(lbkey) * (c->count - i));
+    memmove(c->vals + i + 1, c->vals + i, sizeof(lval*) * (c->count - i));
+    c->keys[i] = lbkey_of(k);
+    c->vals[i] = v;
+    c->count++;
+    *added = 1;
+  } else {
+    int i = lbt_upper(c, k);
+    lbnode* kid_right;
+    lbkey kid_sep;
+    lbnode* kid = lbt_put(c->kids[i], k, v, &kid_right, &kid_sep, added);
+    lbnode_release(c->kids[i]);
+    c->kids[i] = kid;
+
+    if (kid_right) {
+      memmove(c->keys + i + 1, c->keys + i, sizeof(lbkey) * (c->count - i));
+      memmove(c->kids + i + 2, c->kids + i + 1,
+              sizeof(lbnode*) * (c->count - i));
+      c->keys[i] = kid_sep;
+      c->kids[i + 1] = kid_right;
+      c->count++;
+    }
+  }
+
+  if (c->count > LBT_MAX)
+    *sep = lbt_split(c, right);
+  return c;
+}
+
+static lbnode* lbt_first_leaf(lbnode* n) {
+  while (!n->leaf)
+    n = n->kids[0];
+  return n;
+}
+
+static lbnode* lbt_last_leaf(lbnode* n) {
+  while (!n->leaf)
+    n = n->kids[n->count];
+  return n;
+}
+
+// largest key <= k, returns the leaf and sets the index or returns NULL
+static lbnode* lbt_floor(lbnode* n, lval* k, int* at) {
+  if (n->leaf) {
+    *at = lbt_upper(n, k) - 1;
+    return *at >= 0 ? n : NULL;
+  }
+
+  int i = lbt_upper(n, k);
+  lbnode* leaf = lbt_floor(n->kids[i], k, at);
+  if (!leaf && i > 0) {
+    leaf = lbt_last_leaf(n->kids[i - 1]);
+    *at = leaf->count - 1;
+  }
+  return leaf;
+}
+
+// smallest key >= k, returns the leaf and sets the index or returns NULL
+static lbnode* lbt_ceil(lbnode* n, lval* k, int* at) {
+  if (n->leaf) {
+    *at = lbt_lower(n, k);
+    return *at < n->count ? n : NULL;
+  }
+
+  int i = lbt_upper(n, k);
+  lbnode* leaf = lbt_ceil(n->kids[i], k, at);
+  if (!leaf && i < n->count) {
+    leaf = lbt_first_leaf(n->kids[i + 1]);
+    *at = 0;
+  }
+  return leaf;
+}
+
+static lval* lbt_pair(lbnode* leaf, int i) {
+  lval tmp;
+  lval* p = lval_add(lval_qexpr(), lval_copy(lbkey_peek(&leaf->keys[i], &tmp)));
+  return lval_add(p, lval_copy(leaf->vals[i]));
+}
+
+// appends {k v} pairs with lo <= k <= hi to 'q' in key order
+static lval* lbt_range(lbnode* n, lval* lo, lval* hi, lval* q) {
+  if (n->leaf) {
+    for (int i = lbt_lower(n, lo);
+         i < n->count && lbkey_cmp(&n->keys[i], hi) <= 0; ++i)
+      q = lval_add(q, lbt_pair(n, i));
+    return q;
+  }
+
+  for (int i = lbt_upper(n, lo); i <= n->count; ++i) {
+    if (i > 0 && lbkey_cmp(&n->keys[i - 1], hi) > 0)
+      break;
+    q = lbt_range(n->kids[i], lo, hi, q);
+  }
+  return q;
+}
+
+// ordered map values
+
+lval* lval_omap(void) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_OMAP;
+  v->count = 0;
+  v->omap = NULL;
+  return v;
+}
+
+void lval_omap_del(lval* v) {
+  lbnode_release(v->omap);
+}
+
+void lval_omap_copy(lval* x, lval* v) {
+  x->count = v->count;
+  x->omap = lbnode_retain(v->omap);
+}
+
+lval* lval_omap_get(lval* m, lval* k) {
+  if (!m->omap)
+    return NULL;
+
+  lbnode* n = m->omap;
+  while (!n->leaf)
+    n = n->kids[lbt_upper(n, k)];
+
+  int i = lbt_lower(n, k);
+  return (i < n->count && lbkey_cmp(&n->keys[i], k) == 0) ? n->vals[i] : NULL;
+}
+
+// binds k to v in 'm' in place, takes ownership of v but not of k
+lval* lval_omap_put(lval* m, lval* k, lval* v) {
+  if (!m->omap) {
+    m->omap = lbnode_new(1);
+    m->omap->keys[0] = lbkey_of(k);
+    m->omap->vals[0] = v;
+    m->omap->count = 1;
+    m->count = 1;
+    return m;
+  }
+
+  int added = 0;
+  lbnode* right;
+  lbkey sep;
+  lbnode* n = lbt_put(m->omap, k, v, &right, &sep, &added);
+
+  if (right) {
+    // the root split, grow the tree by one level
+    lbnode* root = lbnode_new(0);
+    root->count = 1;
+    root->keys[0] = sep;
+    root->kids[0] = n;
+    root->kids[1] = right;
+    n = root;
+  }
+
+  lbnode_release(m->omap);
+  m->omap = n;
+  m->count += added;
+  return m;
+}
+
+typedef void (*lbt_visit)(lval* k, lval* v, void* ctx);
+
+static void lbt_each(lbnode* n, lbt_visit fn, void* ctx) {
+  if (!n)
+    return;
+  if (!n->leaf) {
+    for (int i = 0; i <= n->count; ++i)
+      lbt_each(n->kids[i], fn, ctx);
+    return;
+  }
+  lval tmp;
+  for (int i = 0; i < n->count; ++i)
+    fn(lbkey_peek(&n->keys[i], &tmp), n->vals[i], ctx);
+}
+
+typedef struct lomap_eq {
+  lval* other;
+  int strict;
+  int eq;
+} lomap_eq;
+
+static void lval_omap_eq_entry(lval* k, lval* v, void* ctx) {
+  lomap_eq* c = ctx;
+  if (!c->eq)
+    return;
+  lval* w = lval_omap_get(c->other, k);
+  c->eq = w && lval_eq(v, w, c->strict);
+}
+
+int lval_omap_eq(lval* x, lval* y, int strict) {
+  if (x->count != y->count)
+    return 0;
+  if (x->omap == y->omap)
+    return 1;
+  lomap_eq c = {y, strict, 1};
+  lbt_each(x->omap, lval_omap_eq_entry, &c);
+  return c.eq;
+}
+
+static void lval_omap_hash_entry(lval* k, lval* v, void* ctx) {
+  uint64_t* h = ctx;
+  *h = (*h ^ lval_hash(k)) * 0x9e3779b97f4a7c15ULL;
+  *h = (*h ^ lval_hash(v)) * 0x9e3779b97f4a7c15ULL;
+  *h ^= *h >> 32;
+}
+
+// entries are visited in key order
+uint64_t lval_omap_hash(lval* m) {
+  uint64_t h = LVAL_OMAP + (uint64_t)m->count;
+  lbt_each(m->omap, lval_omap_hash_entry, &h);
+  return h;
+}
+
+static void lbt_print(FILE* f, lbnode* n, int* first) {
+  if (!n->leaf) {
+    for (int i = 0; i <= n->count; ++i)
+      lbt_print(f, n->kids[i], first);
+    return;
+  }
+
+  for (int i = 0; i < n->count; ++i) {
+    if (!*first)
+      fputc(' ', f);
+    *first = 0;
+    lval tmp;
+    lval_fprint(f, lbkey_peek(&n->keys[i], &tmp));
+    fputc(' ', f);
+    lval_fprint(f, n->vals[i]);
+  }
+}
+
+void lval_omap_print(FILE* f, lval* m) {
+  int first = 1;
+  fprintf(f, "#<");
+  if (m->omap)
+    lbt_print(f, m->omap, &first);
+  fputc('>', f);
+}
+
+// builtins
+
+lval* builtin_omap(lenv* e, lval* a) {
+  UNUSED(e);
+
+  // built from an association list {{k v} {k v} ...}
+  LASSERT_NUM("omap", a, 1);
+  LASSERT_TYPE("omap", a, 0, LVAL_QEXPR);
+
+  lval* m = lval_omap();
+  lval* q = lval_unpack(a->cell[0]);
+  lval k, v;
+  for (int i = 0; i < q->count; ++i) {
+    lval* p = q->cell[i];
+    lval* key =
+        p->type == LVAL_QEXPR && p->count == 2 ? lval_peek(p, 0, &k) : NULL;
+    if (!key || key->type != LVAL_NUM || isnan(key->num)) {
+      lval_del(m);
+      lval_del(a);
+      return lval_err("Function 'omap': entry %i is not a {number value} pair.",
+                      i);
+    }
+    m = lval_omap_put(m, key, lval_copy(lval_peek(p, 1, &v)));
+  }
+
+  lval_del(a);
+  return m;
+}
+
+lval* builtin_omap_put(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("omap-put", a, 3);
+  LASSERT_TYPE("omap-put", a, 0, LVAL_OMAP);
+  LASSERT_TYPE("omap-put", a, 1, LVAL_NUM);
+  LASSERT(a, !isnan(a->cell[1]->num), "Function 'omap-put': key is NaN.");
+
+  lval* m = lval_pop(a, 0);
+  m = lval_omap_put(m, a->cell[0], lval_pop(a, 1));
+  lval_del(a);
+  return m;
+}
+
+lval* builtin_omap_get(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT(a, a->count == 2 || a->count == 3,
+          "Function 'omap-get': incorrect number of arguments. "
+          "Got %i, Expected 2 or 3.",
+          a->count);
+  LASSERT_TYPE("omap-get", a, 0, LVAL_OMAP);
+  LASSERT_TYPE("omap-get", a, 1, LVAL_NUM);
+
+  lval* v = lval_omap_get(a->cell[0], a->cell[1]);
+  lval* x = NULL;
+  if (v)
+    x = lval_copy(v);
+  else if (a->count == 3)
+    x = lval_pop(a, 2);
+  else
+    x = lval_err("Function 'omap-get': key not found.");
+
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_omap_range(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("omap-range", a, 3);
+  LASSERT_TYPE("omap-range", a, 0, LVAL_OMAP);
+  LASSERT_TYPE("omap-range", a, 1, LVAL_NUM);
+  LASSERT_TYPE("omap-range", a, 2, LVAL_NUM);
+
+  lval* m = a->cell[0];
+  lval* q = lval_qexpr();
+  if (m->omap)
+    q = lbt_range(m->omap, a->cell[1], a->cell[2], q);
+
+  lval_del(a);
+  return q;
+}
+
+// shared by the lookups that answer with a {k v} pair or {} when missing
+static lval* builtin_omap_find(lval* a, char* func) {
+  int bound = strcmp(func, "omap-floor") == 0 || strcmp(func, "omap-ceil") == 0;
+  int want = bound ? 2 : 1;
+  LASSERT_NUM(func, a, want);
+  LASSERT_TYPE(func, a, 0, LVAL_OMAP);
+  if (bound)
+    LASSERT_TYPE(func, a, 1, LVAL_NUM);
+
+  lbnode* root = a->cell[0]->omap;
+  lbnode* leaf = NULL;
+  int at = 0;
+
+  if (root) {
+    if (strcmp(func, "omap-min") == 0) {
+      leaf = lbt_first_leaf(root);
+    } else if (strcmp(func, "omap-max") == 0) {
+      leaf = lbt_last_leaf(root);
+      at = leaf->count - 1;
+    } else if (strcmp(func, "omap-floor") == 0) {
+      leaf = lbt_floor(root, a->cell[1], &at);
+    } else if (strcmp(func, "omap-ceil") == 0) {
+      leaf = lbt_ceil(root, a->cell[1], &at);
+    }
+  }
+
+  lval* x = leaf ? lbt_pair(leaf, at) : lval_qexpr();
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_omap_min(lenv* e, lval* a) {
+  UNUSED(e);
+  return builtin_omap_find(a, "omap-min");
+}
+
+lval* builtin_omap_max(lenv* e, lval* a) {
+  UNUSED(e);
+  return builtin_omap_find(a, "omap-max");
+}
+
+lval* builtin_omap_floor(lenv* e, lval* a) {
+  UNUSED(e);
+  return builtin_omap_find(a, "omap-floor");
+}
+
+lval* builtin_omap_ceil(lenv* e, lval* a) {
+  UNUSED(e);
+  return builtin_omap_find(a, "omap-ceil");
+}
+
+lval* builtin_omap_len(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("omap-len", a, 1);
+  LASSERT_TYPE("omap-len", a, 0, LVAL_OMAP);
+
+  lval* x = lval_int(a->cell[0]->count);
+  lval_del(a);
+  return x;
+}
@@ -0,0 +1,469 @@
+#include <stdatomic.h>
+
+#include "lispy.h"
+
+// Optimization pass over expressions, run on top-level forms before they
+// are evaluated and on lambda bodies when the lambda is created.
+//
+// Calls of pure builtins whose arguments are all literals are folded into
+// their result, innermost first, so (* 60 60 24) in a body is computed
+// once. Chains of list builtins that would build a Q-expression only for
+// the next stage to take apart are rewritten into fused builtins doing the
+// work in one pass:
+//
+//   (tail (tail ... x))            drops k elements with one move
+//   (head (tail (tail ... x)))     picks the element after the dropped ones
+//   (join (tail a) (tail b) ...)   copies the kept elements once
+//
+// Both rely on symbols being bound to the builtins in the global
+// environment. A form is walked in evaluation order and nothing is
+// rewritten after the first call that might def. Redefining a builtin's
+// name, or creating a lambda with a formal that shadows one, bumps the
+// version, and lambdas use their optimized body only under the version it
+// was made for. Once a formal has shadowed a builtin, dynamic scoping makes
+// lookups in bodies unpredictable and bodies are no longer optimized.
+// Fused calls raise the same errors the chain would.
+//
+// The version and the rest of the state belong to the interpreter owning
+// the environment, nothing is optimized outside of one.
+
+struct lopt_state {
+  atomic_int debug;
+  atomic_ulong version;
+  // set once a local binding has shadowed a builtin
+  atomic_int shadowed;
+};
+
+lopt_state* lopt_state_new(void) {
+  lopt_state* st = malloc(sizeof(lopt_state));
+  atomic_init(&st->debug, 0);
+  atomic_init(&st->version, 0);
+  atomic_init(&st->shadowed, 0);
+  return st;
+}
+
+void lopt_state_del(lopt_state* st) {
+  free(st);
+}
+
+void lopt_state_save(lopt_state* st, lispy_vm_flags_t* f) {
+  f->fuse_debug = atomic_load(&st->debug);
+  f->opt_shadowed = atomic_load(&st->shadowed);
+}
+
+void lopt_state_restore(lopt_state* st, const lispy_vm_flags_t* f) {
+  atomic_store(&st->debug, f->fuse_debug);
+  atomic_store(&st->shadowed, f->opt_shadowed);
+}
+
+static lopt_state* lopt_state_of(lenv* e) {
+  return e->vm ? lispy_vm_opt(e->vm) : NULL;
+}
+
+// the builtin a symbol is bound to in the global environment, or NULL
+static lbuiltin lopt_builtin(lenv* e, lval* v) {
+  if (v->type != LVAL_SYM)
+    return NULL;
+  while (e->par)
+    e = e->par;
+  lrcu_read_lock();
+  lbind* b = lenv_find(e, v->sym);
+  lval* x = b ? atomic_load(&b->val) : NULL;
+  lbuiltin f = x && x->type == LVAL_FUN ? x->builtin : NULL;
+  lrcu_read_unlock();
+  return f;
+}
+
+// detaches the expression under k tails of v and deletes the tails
+static lval* lopt_untail(lval* v, int k) {
+  for (int i = 0; i < k; ++i)
+    v = lval_take(v, 1);
+  return v;
+}
+
+static void lopt_report(lopt_state* st, char* fmt, ...) {
+  if (!atomic_load_explicit(&st->debug, memory_order_relaxed))
+    return;
+  va_list va;
+  va_start(va, fmt);
+  fputs("fuse: ", stderr);
+  vfprintf(stderr, fmt, va);
+  fputc('\n', stderr);
+  va_end(va);
+}
+
+// fused builtins
+
+// drops the first k elements of a list with one move
+static lval* lval_drop(lval* v, int k) {
+  lval_thaw(v);
+  v->hash = 0;
+  if (lval_packed(v)) {
+    v->count -= k;
+    if (v->ints)
+      memmove(v->ints, v->ints + k, sizeof(int64_t) * v->count);
+    else
+      memmove(v->dbls, v->dbls + k, sizeof(double) * v->count);
+    if (v->count == 0) {
+      free(v->ints);
+      free(v->dbls);
+      v->ints = NULL;
+      v->dbls = NULL;
+    }
+    return v;
+  }
+
+  for (int i = 0; i < k; ++i)
+    lval_del(v->cell[i]);
+  v->count -= k;
+  memmove(v->cell, v->cell + k, sizeof(lval*) * v->count);
+  return v;
+}
+
+// checks that k tails can be taken of argument i, as the chain would
+#define LASSERT_TAILS(args, index, k)                       \
+  if ((k) > 0) {                                            \
+    LASSERT(args, args->cell[index]->type == LVAL_QEXPR,    \
+            "Function 'tail': invalid argument type on 0. " \
+            "Got %s, Expected %s.",                         \
+            lval_t_name(args->cell[index]->type),           \
+            lval_t_name(LVAL_QEXPR));                       \
+    LASSERT(args, args->cell[index]->count >= (k),          \
+            "Function 'tail': passed {} for argument 0.");  \
+  }
+
+// (drop k x)
+static lval* builtin_fused_drop(lenv* e, lval* a) {
+  UNUSED(e);
+
+  int k = a->cell[0]->num;
+  LASSERT_TAILS(a, 1, k);
+
+  lval* v = lval_take(a, 1);
+  return lval_drop(v, k);
+}
+
+// (pick k x)
+static lval* builtin_fused_pick(lenv* e, lval* a) {
+  int k = a->cell[0]->num;
+  LASSERT_TAILS(a, 1, k);
+
+  lval* v = lval_take(a, 1);
+  return builtin_head(e, lval_add(lval_sexpr(), lval_drop(v, k)));
+}
+
+// (join k0 x0 k1 x1 ...)
+static lval* builtin_fused_join(lenv* e, lval* a) {
+  UNUSED(e);
+
+  for (int i = 0; i < a->count; i += 2)
+    LASSERT_TAILS(a, i + 1, (int)a->cell[i]->num);
+  for (int i = 1; i < a->count; i += 2)
+    LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
+            "Function 'join': invalid argument type on %i. "
+            "Got %s, Expected %s.",
+            i / 2, lval_t_name(a->cell[i]->type), lval_t_name(LVAL_QEXPR));
+
+  // the kept elements stay packed when every part holds the same kind
+  int total = 0;
+  int ints = 1;
+  int dbls = 1;
+  for (int i = 0; i < a->count; i += 2) {
+    lval* x = a->cell[i + 1];
+    int n = x->count - (int)a->cell[i]->num;
+    total += n;
+    ints &= n == 0 || x->ints != NULL;
+    dbls &= n == 0 || x->dbls != NULL;
+  }
+
+  lval* r = lval_qexpr();
+  r->count = total;
+  if (total && ints)
+    r->ints = malloc(sizeof(int64_t) * total);
+  else if (total && dbls)
+    r->dbls = malloc(sizeof(double) * total);
+  else
+    r->cell = malloc(sizeof(lval*) * MAX(total, 1));
+
+  int at = 0;
+  for (int i = 0; i < a->count; i += 2) {
+    int k = a->cell[i]->num;
+    lval* x = lval_thaw(a->cell[i + 1]);
+    int n = x->count - k;
+    lval tmp;
+    if (n == 0)
+      continue;
+    if (r->ints) {
+      memcpy(r->ints + at, x->ints + k, sizeof(int64_t) * n);
+    } else if (r->dbls) {
+      memcpy(r->dbls + at, x->dbls + k, sizeof(double) * n);
+    } else if (lval_packed(x)) {
+      for (int j = 0; j < n; ++j)
+        r->cell[at + j] = lval_copy(lval_peek(x, k + j, &tmp));
+    } else {
+      // the kept cells move over, the dropped ones are deleted
+      for (int j = 0; j < k; ++j)
+        lval_del(x->cell[j]);
+      memcpy(r->cell + at, x->cell + k, sizeof(lval*) * n);
+      x->count = 0;
+    }
+    at += n;
+  }
+
+  lval_del(a);
+  return r;
+}
+
+// rewriting
+
+typedef struct lopt {
+  lopt_state* st;
+  lenv* env;
+  // formals of the lambda being optimized, NULL at the top level
+  lval* formals;
+  // set once a call that might def has been passed
+  int impure;
+  int changed;
+} lopt;
+
+// whether f only computes its result from its arguments
+int lopt_pure(lbuiltin f) {
+  static const lbuiltin pure[] = {
+      builtin_add,     builtin_sub,     builtin_mul,     builtin_div,
+      builtin_gt,      builtin_lt,      builtin_ge,      builtin_le,
+      builtin_eq,      builtin_ne,      builtin_equal,   builtin_hash,
+      builtin_head,    builtin_tail,    builtin_list,    builtin_join,
+      builtin_cons,    builtin_str_len, builtin_str_cat, builtin_str_sub,
+      builtin_str_build, builtin_fused_drop, builtin_fused_pick,
+      builtin_fused_join};
+  for (size_t i = 0; i < sizeof(pure) / sizeof(pure[0]); ++i)
+    if (pure[i] == f)
+      return 1;
+  return 0;
+}
+
+static int lopt_literal(lval* v) {
+  return v->type == LVAL_NUM || v->type == LVAL_STR || v->type == LVAL_QEXPR;
+}
+
+// the builtin called by v, NULL when v is not a call of a builtin or the
+// lambda being optimized binds its name
+static lbuiltin lopt_callee(lopt* o, lval* v) {
+  if (v->type != LVAL_SEXPR || v->count < 2)
+    return NULL;
+  lval* f = v->cell[0];
+  if (f->type == LVAL_FUN)
+    return f->builtin;
+  if (f->type != LVAL_SYM)
+    return NULL;
+  if (o->formals)
+    for (int i = 0; i < o->formals->count; ++i)
+      if (strcmp(o->formals->cell[i]->sym, f->sym) == 0)
+        return NULL;
+  return lopt_builtin(o->env, f);
+}
+
+// whether v calls fun with n arguments
+static int lopt_is_call(lopt* o, lval* v, lbuiltin fun, int n) {
+  return v->type == LVAL_SEXPR && v->count == n + 1 &&
+         lopt_callee(o, v) == fun;
+}
+
+// counts the tails wrapped around an expression
+static int lopt_tails(lopt* o, lval* v) {
+  int k = 0;
+  while (lopt_is_call(o, v, builtin_tail, 1)) {
+    v = v->cell[1];
+    k++;
+  }
+  return k;
+}
+
+static lval* lopt_walk(lopt* o, lval* v);
+
+// (fun k x), optimizing what lies inside x
+static lval* lopt_fused(lopt* o, lbuiltin fun, int k, lval* x) {
+  o->changed = 1;
+  lval* f = lval_add(lval_sexpr(), lval_fun(fun));
+  f = lval_add(f, lval_int(k));
+  return lval_add(f, lopt_walk(o, x));
+}
+
+static lval* lopt_fuse_join(lopt* o, lval* v) {
+  int tails = 0;
+  for (int i = 1; i < v->count; ++i)
+    tails += lopt_tails(o, v->cell[i]) > 0;
+  if (tails == 0)
+    return NULL;
+
+  lopt_report(o->st, "join of %i lists, %i of them tails, in one pass",
+              v->count - 1, tails);
+  o->changed = 1;
+  lval* f = lval_add(lval_sexpr(), lval_fun(builtin_fused_join));
+  lval_del(lval_pop(v, 0));
+  while (v->count) {
+    lval* x = lval_pop(v, 0);
+    int k = lopt_tails(o, x);
+    f = lval_add(f, lval_int(k));
+    f = lval_add(f, lopt_walk(o, lopt_untail(x, k)));
+  }
+  lval_del(v);
+  return f;
+}
+
+// rewrites a chain of list builtins starting at v, or returns NULL
+static lval* lopt_fuse(lopt* o, lval* v) {
+  if (lopt_is_call(o, v, builtin_head, 1)) {
+    int k = lopt_tails(o, v->cell[1]);
+    if (k > 0) {
+      lopt_report(o->st, "(head (tail ...)) of depth %i into pick", k);
+      return lopt_fused(o, builtin_fused_pick, k,
+                        lopt_untail(lval_take(v, 1), k));
+    }
+  }
+
+  if (lopt_is_call(o, v, builtin_tail, 1)) {
+    int k = lopt_tails(o, v);
+    if (k > 1) {
+      lopt_report(o->st, "(tail (tail ...)) of depth %i into drop", k);
+      return lopt_fused(o, builtin_fused_drop, k, lopt_untail(v, k));
+    }
+  }
+
+  if (lopt_callee(o, v) == builtin_join)
+    return lopt_fuse_join(o, v);
+  return NULL;
+}
+
+// computes a call of a pure builtin on literals, or returns NULL
+static lval* lopt_fold(lopt* o, lval* v, lbuiltin f) {
+  for (int i = 1; i < v->count; ++i)
+    if (!lopt_literal(v->cell[i]))
+      return NULL;
+
+  lval* a = lval_copy(v);
+  lval_del(lval_pop(a, 0));
+  lval* r = f(o->env, a);
+  // errors are left to be raised if the call is ever evaluated
+  if (r->type == LVAL_ERR) {
+    lval_del(r);
+    return NULL;
+  }
+
+  if (atomic_load_explicit(&o->st->debug, memory_order_relaxed)) {
+    fputs("fold: ", stderr);
+    lval_fprint(stderr, v);
+    fputs(" into ", stderr);
+    lval_fprint(stderr, r);
+    fputc('\n', stderr);
+  }
+  o->changed = 1;
+  lval_del(v);
+  return r;
+}
+
+// optimizes v, visiting calls in the order they are evaluated
+static lval* lopt_walk(lopt* o, lval* v) {
+  // Q-expressions are data until evaluated, leave them alone
+  if (v->type != LVAL_SEXPR)
+    return v;
+
+  if (!o->impure) {
+    lval* f = lopt_fuse(o, v);
+    if (f)
+      return f;
+  }
+
+  // the function is looked up before its arguments are evaluated
+  int impure = o->impure;
+  for (int i = 0; i < v->count; ++i)
+    v->cell[i] = lopt_walk(o, v->cell[i]);
+
+  lbuiltin f = lopt_callee(o, v);
+  int pure = f && lopt_pure(f);
+  if (pure && !impure) {
+    lval* r = lopt_fold(o, v, f);
+    if (r)
+      return r;
+  }
+
+  // a call of anything else might redefine what later calls see
+  if (v->count > 1 && !pure)
+    o->impure = 1;
+  return v;
+}
+
+// rewrites an expression read at the top level before it is evaluated
+lval* lval_optimize(lenv* e, lval* v) {
+  lopt o = {lopt_state_of(e), e, NULL, 0, 0};
+  return o.st ? lopt_walk(&o, v) : v;
+}
+
+// an optimized copy of a lambda body, or NULL when nothing changed
+lval* lval_optimize_body(lenv* e, lval* formals, lval* body) {
+  lopt_state* st = lopt_state_of(e);
+  if (!st || atomic_load_explicit(&st->shadowed, memory_order_relaxed))
+    return NULL;
+
+  // the body is evaluated as an S-expression
+  lval* v = lval_unpack(lval_thaw(lval_copy(body)));
+  v->type = LVAL_SEXPR;
+  v->hash = 0;
+
+  lopt o = {st, e, formals, 0, 0};
+  v = lopt_walk(&o, v);
+  if (!o.changed) {
+    lval_del(v);
+    return NULL;
+  }
+
+  // a body folded down to one value evaluates to that value
+  if (v->type == LVAL_SEXPR) {
+    v->type = LVAL_QEXPR;
+    return v;
+  }
+  return lval_add(lval_qexpr(), v);
+}
+
+unsigned long lopt_version(lenv* e) {
+  lopt_state* st = lopt_state_of(e);
+  return st ? atomic_load_explicit(&st->version, memory_order_acquire) : 0;
+}
+
+// called before k is bound in e
+void lopt_rebind(lenv* e, lval* k) {
+  lopt_state* st = lopt_state_of(e);
+  if (!st || !lopt_builtin(e, k))
+    return;
+  // a local binding shadows the builtin in everything called from e
+  if (e->par)
+    atomic_store_explicit(&st->shadowed, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&st->version, 1, memory_order_release);
+}
+
+// called when a lambda with these formals is created in e
+void lopt_bind_formals(lenv* e, lval* formals) {
+  lopt_state* st = lopt_state_of(e);
+  if (!st)
+    return;
+  for (int i = 0; i < formals->count; ++i)
+    if (lopt_builtin(e, formals->cell[i])) {
+      atomic_store_explicit(&st->shadowed, 1, memory_order_relaxed);
+      atomic_fetch_add_explicit(&st->version, 1, memory_order_release);
+      return;
+    }
+}
+
+// builtins
+
+lval* builtin_fuse_debug(lenv* e, lval* a) {
+  LASSERT_NUM("fuse-debug", a, 1);
+  LASSERT_TYPE("fuse-debug", a, 0, LVAL_NUM);
+
+  lopt_state* st = lopt_state_of(e);
+  LASSERT(a, st, "Function 'fuse-debug': not running in an interpreter.");
+
+  atomic_store(&st->debug, a->cell[0]->num != 0);
+  lval_del(a);
+  return lval_sexpr();
+}
@@ -0,0 +1,655 @@
+#include <sched.h>
+#include <time.h>
+
+#include "lispy.h"
+
+// Parallel builtins over the global pool. Values are deep copies, so each
+// task works on its own arguments and results; what tasks share is the
+// function and the environment, which are only read while the builtin
+// runs. Every task evaluates in an isolated child environment, so a def
+// inside the function stays local to that task.
+
+// tasks per thread, so stealing can even out uneven elements
+#define LPAR_SPLIT 4
+
+// below this many elements a native reduction is not worth a task
+#define LPAR_NATIVE_GRAIN 4096
+
+// an environment for evaluating on a worker, discarded afterwards
+static lenv* lpar_env(lenv* e) {
+  lenv* w = lenv_new();
+  w->par = e;
+  w->vm = e->vm;
+  w->isolated = 1;
+  return w;
+}
+
+// builtins
+
+typedef struct lpmap {
+  lenv* env;
+  lval* f;
+  lval* in;
+  lval** out;
+  int n;
+  int chunk;
+} lpmap;
+
+static void lpmap_task(void* ctx, int t) {
+  lpmap* m = ctx;
+  lenv* w = lpar_env(m->env);
+  int hi = MIN(m->n, (t + 1) * m->chunk);
+  lval tmp;
+  for (int i = t * m->chunk; i < hi; ++i) {
+    lval* x = lval_copy(lval_peek(m->in, i, &tmp));
+    m->out[i] = lval_call(w, m->f, lval_add(lval_sexpr(), x));
+  }
+  lenv_del(w);
+}
+
+lval* builtin_pmap(lenv* e, lval* a) {
+  LASSERT_NUM("pmap", a, 2);
+  LASSERT_TYPE("pmap", a, 0, LVAL_FUN);
+  LASSERT_TYPE("pmap", a, 1, LVAL_QEXPR);
+
+  lval* f = a->cell[0];
+  lval* in = a->cell[1];
+  int n = in->count;
+
+  lpool* p = lpool_global();
+  int tasks = MIN(n, lpool_size(p) * LPAR_SPLIT);
+  lpmap m = {e, f, in, malloc(sizeof(lval*) * MAX(n, 1)), n, 0};
+  m.chunk = tasks ? (n + tasks - 1) / tasks : 0;
+  lpool_run(p, lpmap_task, &m, tasks);
+
+  // results are stitched back in order, the first error wins
+  lval* r = lval_qexpr();
+  for (int i = 0; i < n; ++i) {
+    if (r->type != LVAL_ERR && m.out[i]->type == LVAL_ERR) {
+      lval_del(r);
+      r = m.out[i];
+    } else if (r->type == LVAL_ERR) {
+      lval_del(m.out[i]);
+    } else {
+      r = lval_add(r, m.out[i]);
+    }
+  }
+
+  free(m.out);
+  lval_del(a);
+  return r;
+}
+
+// reductions, each task folds a chunk from the left and the partial
+// results are combined in order, so the reducer has to be associative but
+// not commutative
+
+typedef struct lpreduce {
+  lenv* env;
+  lval* f;
+  lval* in;
+  lval** out;
+  // elements [lo, lo + n) are reduced
+  int lo;
+  int n;
+  int chunk;
+  // arithmetic operator of a builtin reducer, 0 for anything else
+  char op;
+} lpreduce;
+
+// folds in[lo, hi) with op, on the unboxed elements while they allow it
+static lval* lpar_fold_op(lval* in, int lo, int hi, char op) {
+  lval tmp;
+  for (int i = lo; i < hi; ++i)
+    if (lval_peek(in, i, &tmp)->type != LVAL_NUM)
+      return lval_err("Cannot operate on a non-number. Got %s, Expected %s",
+                      lval_t_name(lval_peek(in, i, &tmp)->type),
+                      lval_t_name(LVAL_NUM));
+
+  int i = lo + 1;
+  lval* x;
+  if (in->ints) {
+    // exact until the running result would overflow
+    int64_t s = in->ints[lo];
+    int64_t r;
+    while (i < hi && !(op == '+'
+                           ? __builtin_add_overflow(s, in->ints[i], &r)
+                           : __builtin_mul_overflow(s, in->ints[i], &r))) {
+      s = r;
+      ++i;
+    }
+    x = lval_int(s);
+  } else if (in->dbls) {
+    double s = in->dbls[lo];
+    if (op == '+')
+      for (; i < hi; ++i)
+        s += in->dbls[i];
+    else
+      for (; i < hi; ++i)
+        s *= in->dbls[i];
+    x = lval_num(s);
+  } else {
+    x = lval_copy(in->cell[lo]);
+  }
+
+  for (; i < hi; ++i)
+    lval_num_apply(x, lval_peek(in, i, &tmp), op);
+  return x;
+}
+
+static lval* lpar_fold_fun(lenv* e, lval* f, lval* in, int lo, int hi) {
+  lval tmp;
+  lval* x = lval_copy(lval_peek(in, lo, &tmp));
+  for (int i = lo + 1; i < hi && x->type != LVAL_ERR; ++i) {
+    lval* y = lval_copy(lval_peek(in, i, &tmp));
+    x = lval_call(e, f, lval_add(lval_add(lval_sexpr(), x), y));
+  }
+  return x;
+}
+
+static void lpreduce_task(void* ctx, int t) {
+  lpreduce* r = ctx;
+  int lo = r->lo + t * r->chunk;
+  int hi = MIN(r->lo + r->n, lo + r->chunk);
+  if (r->op) {
+    r->out[t] = lpar_fold_op(r->in, lo, hi, r->op);
+    return;
+  }
+  lenv* w = lpar_env(r->env);
+  r->out[t] = lpar_fold_fun(w, r->f, r->in, lo, hi);
+  lenv_del(w);
+}
+
+// the operator a builtin reducer applies, 0 when there is no kernel for it
+static char lpar_op(lval* f) {
+  if (f->builtin == builtin_add)
+    return '+';
+  if (f->builtin == builtin_mul)
+    return '*';
+  return 0;
+}
+
+// reduces in[lo, lo + n) with f, or with op when it is not 0
+static lval* lpar_reduce(lenv* e, lval* f, char op, lval* in, int lo, int n) {
+  lpool* p = lpool_global();
+  // a call of a lambda is worth a task, a native add is not
+  int grain = op ? LPAR_NATIVE_GRAIN : 1;
+  int tasks = MIN((n + grain - 1) / grain, lpool_size(p) * LPAR_SPLIT);
+  tasks = MAX(tasks, 1);
+
+  lpreduce r = {e, f, in, malloc(sizeof(lval*) * tasks), lo, n, 0, op};
+  r.chunk = (n + tasks - 1) / tasks;
+  tasks = (n + r.chunk - 1) / r.chunk;
+  lpool_run(p, lpreduce_task, &r, tasks);
+
+  lval* x = r.out[0];
+  lenv* w = op ? NULL : lpar_env(e);
+  for (int t = 1; t < tasks; ++t) {
+    if (x->type == LVAL_ERR) {
+      lval_del(r.out[t]);
+    } else if (r.out[t]->type == LVAL_ERR) {
+      lval_del(x);
+      x = r.out[t];
+    } else if (op) {
+      lval_num_apply(x, r.out[t], op);
+      lval_del(r.out[t]);
+    } else {
+      x = lval_call(w, f, lval_add(lval_add(lval_sexpr(), x), r.out[t]));
+    }
+  }
+  if (w)
+    lenv_del(w);
+  free(r.out);
+  return x;
+}
+
+// the elements of a list as the arguments of a call
+static lval* lpar_call_args(lval* in) {
+  lval* a = lval_unpack(lval_thaw(lval_copy(in)));
+  a->type = LVAL_SEXPR;
+  a->hash = 0;
+  return a;
+}
+
+lval* builtin_preduce(lenv* e, lval* a) {
+  LASSERT_NUM("preduce", a, 2);
+  LASSERT_TYPE("preduce", a, 0, LVAL_FUN);
+  LASSERT_TYPE("preduce", a, 1, LVAL_QEXPR);
+  LASSERT(a, a->cell[1]->count > 0, "Function 'preduce' passed {}.");
+
+  lval* f = a->cell[0];
+  lval* in = a->cell[1];
+  lval* x;
+  if (f->builtin == builtin_sub && in->count > 1) {
+    // x0 - x1 - ... - xn is x0 - (x1 + ... + xn)
+    lval* s = lpar_reduce(e, f, '+', in, 1, in->count - 1);
+    x = lpar_reduce(e, f, '+', in, 0, 1);
+    if (x->type == LVAL_ERR) {
+      lval_del(s);
+    } else if (s->type == LVAL_ERR) {
+      lval_del(x);
+      x = s;
+    } else {
+      lval_num_apply(x, s, '-');
+      lval_del(s);
+    }
+  } else if (f->builtin == builtin_div) {
+    // not associative, divided out in order by the builtin itself
+    x = in->count > 1 ? builtin_div(e, lpar_call_args(in))
+                      : lpar_reduce(e, f, '+', in, 0, 1);
+  } else {
+    x = lpar_reduce(e, f, lpar_op(f), in, 0, in->count);
+  }
+
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_psum(lenv* e, lval* a) {
+  LASSERT_NUM("psum", a, 1);
+  LASSERT_TYPE("psum", a, 0, LVAL_QEXPR);
+
+  lval* in = a->cell[0];
+  lval* x = in->count ? lpar_reduce(e, NULL, '+', in, 0, in->count)
+                      : lval_int(0);
+  lval_del(a);
+  return x;
+}
+
+// parallel argument evaluation
+//
+// With (par-args 1) the arguments of an S-expression are not always
+// evaluated one after another. A call of a lambda whose calls have been
+// taking long is handed to the pool while it has room, provided nothing it
+// can reach has an effect: every lambda it may call, and every expression
+// in their bodies, only uses builtins that compute a result. An argument
+// with effects is a barrier, it waits for everything handed out before it,
+// and nothing after it is handed out before it is done. Results keep their
+// places, so the first error is still the one returned.
+//
+// The time a call takes is learned from the calls made while the mode is
+// on, so the first calls of a lambda run in order. Whether a lambda is free
+// of effects is remembered until the next global def, and not at all once
+// a local binding has shadowed a global function, since dynamic scoping
+// then lets a body reach something different depending on its caller.
+
+// calls taking less than this many nanoseconds are not worth a task
+#define LPAR_ARG_COST 20000
+
+// lambdas walked at most to decide about one argument
+#define LPAR_WALK_BUDGET 256
+
+struct lpar_state {
+  atomic_int on;
+  // bumped by every global def, what is known of lambdas holds for one
+  atomic_ulong version;
+  // set once a local binding has shadowed a global function
+  atomic_int shadowed;
+};
+
+lpar_state* lpar_state_new(void) {
+  lpar_state* st = malloc(sizeof(lpar_state));
+  atomic_init(&st->on, 0);
+  atomic_init(&st->version, 0);
+  atomic_init(&st->shadowed, 0);
+  return st;
+}
+
+void lpar_state_del(lpar_state* st) {
+  free(st);
+}
+
+void lpar_state_save(lpar_state* st, lispy_vm_flags_t* f) {
+  f->par_args = atomic_load(&st->on);
+  f->par_shadowed = atomic_load(&st->shadowed);
+}
+
+void lpar_state_restore(lpar_state* st, const lispy_vm_flags_t* f) {
+  atomic_store(&st->on, f->par_args);
+  atomic_store(&st->shadowed, f->par_shadowed);
+}
+
+static lpar_state* lpar_state_of(lenv* e) {
+  return e->vm ? lispy_vm_par(e->vm) : NULL;
+}
+
+int lpar_on(lenv* e) {
+  lpar_state* st = lpar_state_of(e);
+  return st && atomic_load_explicit(&st->on, memory_order_relaxed);
+}
+
+// the value bound to sym as seen from e, NULL when unbound, local is set
+// when the binding is not a global one, good inside a read section
+static lval* lpar_lookup(lenv* e, char* sym, int* local) {
+  for (; e; e = e->par) {
+    lbind* b = lenv_find(e, sym);
+    if (b) {
+      *local = e->par != NULL;
+      return atomic_load(&b->val);
+    }
+  }
+  return NULL;
+}
+
+// whether k is bound to a function in the global environment
+static int lpar_global_fun(lenv* e, lval* k) {
+  while (e->par)
+    e = e->par;
+  int local;
+  lrcu_read_lock();
+  lval* x = lpar_lookup(e, k->sym, &local);
+  int r = x && x->type == LVAL_FUN;
+  lrcu_read_unlock();
+  return r;
+}
+
+// timing
+
+static uint64_t lpar_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// the start of a call to profile, 0 when calls are not profiled
+uint64_t lpar_clock(lenv* e) {
+  return lpar_on(e) ? lpar_now() : 0;
+}
+
+void lpar_profile(llambda* l, uint64_t start) {
+  uint64_t t = lpar_now() - start;
+  // a lost update between threads only skips a sample
+  uint64_t c = atomic_load_explicit(&l->cost, memory_order_relaxed);
+  c = c ? c - c / 8 + t / 8 : t;
+  atomic_store_explicit(&l->cost, c, memory_order_relaxed);
+}
+
+// effects
+
+typedef struct lpar_walk {
+  lpar_state* st;
+  lenv* env;
+  // formals of the lambdas being walked, bound to values not known here
+  lval* scope;
+  // lambdas being walked, a recursive call adds nothing new
+  llambda** open;
+  int nopen;
+  int budget;
+  // set when a symbol was found in a local environment
+  int local;
+} lpar_walk;
+
+// builtins that may be reached from an argument evaluated on the pool
+static int lpar_pure_builtin(lbuiltin f) {
+  return lopt_pure(f) || f == builtin_if || f == builtin_lambda;
+}
+
+static int lpar_in_scope(lpar_walk* w, lval* s) {
+  for (int i = 0; i < w->scope->count; ++i)
+    if (strcmp(w->scope->cell[i]->sym, s->sym) == 0)
+      return 1;
+  return 0;
+}
+
+static void lpar_scope_drop(lpar_walk* w, int n) {
+  while (w->scope->count > n)
+    lval_del(lval_pop(w->scope, w->scope->count - 1));
+}
+
+static void lpar_scope_add(lpar_walk* w, lval* formals) {
+  for (int i = 0; i < formals->count; ++i)
+    w->scope = lval_add(w->scope, lval_copy(formals->cell[i]));
+}
+
+static int lpar_walk_expr(lpar_walk* w, lval* v, int head);
+
+// whether v makes a lambda, (\ {formals} {body})
+static int lpar_makes_lambda(lpar_walk* w, lval* v) {
+  if (v->count != 3 || v->cell[1]->type != LVAL_QEXPR ||
+      lval_packed(v->cell[1]))
+    return 0;
+  for (int i = 0; i < v->cell[1]->count; ++i)
+    if (v->cell[1]->cell[i]->type != LVAL_SYM)
+      return 0;
+
+  lval* f = v->cell[0];
+  int local = 0;
+  if (f->type == LVAL_SYM && !lpar_in_scope(w, f))
+    f = lpar_lookup(w->env, f->sym, &local);
+  return f && f->type == LVAL_FUN && f->builtin == builtin_lambda;
+}
+
+// an S- or Q-expression, the contents of a Q-expression may be evaluated
+// as well
+static int lpar_walk_list(lpar_walk* w, lval* v) {
+  if (lval_packed(v))
+    return 1;
+
+  int n = w->scope->count;
+  int lambda = lpar_makes_lambda(w, v);
+  if (lambda)
+    lpar_scope_add(w, v->cell[1]);
+
+  int r = 1;
+  for (int i = 0; i < v->count && r; ++i)
+    if (!(lambda && i == 1))
+      r = lpar_walk_expr(w, v->cell[i], i == 0 && v->count > 1);
+  lpar_scope_drop(w, n);
+  return r;
+}
+
+static int lpar_walk_fun(lpar_walk* w, lval* f) {
+  if (f->builtin)
+    return lpar_pure_builtin(f->builtin);
+
+  llambda* l = f->lambda;
+  for (int i = 0; i < w->nopen; ++i)
+    if (w->open[i] == l)
+      return 1;
+  if (--w->budget < 0)
+    return 0;
+
+  // called from the argument itself the body is walked the same way from
+  // anywhere, so the verdict can be kept
+  unsigned long version =
+      atomic_load_explicit(&w->st->version, memory_order_acquire);
+  int keep = w->scope->count == 0 &&
+             !atomic_load_explicit(&w->st->shadowed, memory_order_relaxed);
+  if (keep) {
+    unsigned long p = atomic_load_explicit(&l->pure, memory_order_relaxed);
+    if (p >> 1 == version + 1)
+      return p & 1;
+  }
+
+  w->open = realloc(w->open, sizeof(llambda*) * (w->nopen + 1));
+  w->open[w->nopen++] = l;
+  int local = w->local;
+  w->local = 0;
+  int n = w->scope->count;
+
+  int r = 1;
+  lval tmp;
+  if (f->bound)
+    for (int i = 0; i < f->bound->count && r; ++i)
+      r = lpar_walk_expr(w, lval_peek(f->bound, i, &tmp), 0);
+  // formals stay bound for everything called from the body
+  lpar_scope_add(w, l->formals);
+  if (r)
+    r = lpar_walk_list(w, l->body);
+
+  lpar_scope_drop(w, n);
+  w->nopen--;
+  if (keep && !w->local)
+    atomic_store_explicit(&l->pure, ((version + 1) << 1) | r,
+                          memory_order_relaxed);
+  w->local |= local;
+  return r;
+}
+
+// whether evaluating v has no effects, head is set when v is called
+static int lpar_walk_expr(lpar_walk* w, lval* v, int head) {
+  switch (v->type) {
+    case LVAL_SYM: {
+      // a formal may be bound to any function
+      if (lpar_in_scope(w, v))
+        return !head;
+      int local = 0;
+      lval* x = lpar_lookup(w->env, v->sym, &local);
+      w->local |= local;
+      if (!x)
+        return !head;
+      return x->type != LVAL_FUN || lpar_walk_fun(w, x);
+    }
+
+    case LVAL_FUN:
+      return lpar_walk_fun(w, v);
+
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      return lpar_walk_list(w, v);
+
+    default:
+      return 1;
+  }
+}
+
+// whether evaluating the argument v in e has no effects
+static int lpar_pure(lenv* e, lval* v) {
+  // looking a symbol up or taking a value is always safe
+  if (v->type != LVAL_SEXPR)
+    return 1;
+
+  lpar_walk w = {lpar_state_of(e), e, lval_qexpr(), NULL, 0,
+                 LPAR_WALK_BUDGET, 0};
+  lrcu_read_lock();
+  int r = lpar_walk_expr(&w, v, 0);
+  lrcu_read_unlock();
+  lval_del(w.scope);
+  free(w.open);
+  return r;
+}
+
+// called before k is bound in e
+void lpar_rebind(lenv* e, lval* k) {
+  lpar_state* st = lpar_state_of(e);
+  if (!st)
+    return;
+  if (!e->par)
+    atomic_fetch_add_explicit(&st->version, 1, memory_order_release);
+  else if (lpar_global_fun(e, k))
+    atomic_store_explicit(&st->shadowed, 1, memory_order_relaxed);
+}
+
+// called when a lambda with these formals is created in e
+void lpar_bind_formals(lenv* e, lval* formals) {
+  lpar_state* st = lpar_state_of(e);
+  if (!st)
+    return;
+  for (int i = 0; i < formals->count; ++i)
+    if (lpar_global_fun(e, formals->cell[i])) {
+      atomic_store_explicit(&st->shadowed, 1, memory_order_relaxed);
+      return;
+    }
+}
+
+// evaluation
+
+typedef struct lpar_args {
+  lenv* env;
+  lval* v;
+  // arguments handed out and not yet evaluated
+  atomic_int left;
+} lpar_args;
+
+typedef struct lpar_arg {
+  lpar_args* args;
+  int i;
+} lpar_arg;
+
+static void lpar_arg_task(void* ctx, int t) {
+  UNUSED(t);
+  lpar_arg* a = ctx;
+  lpar_args* args = a->args;
+  lenv* w = lpar_env(args->env);
+  args->v->cell[a->i] = lval_eval(w, args->v->cell[a->i]);
+  lenv_del(w);
+  atomic_fetch_sub_explicit(&args->left, 1, memory_order_release);
+}
+
+static void lpar_join(lpool* p, lpar_args* args) {
+  while (atomic_load_explicit(&args->left, memory_order_acquire) > 0)
+    if (!lpool_help(p))
+      sched_yield();
+}
+
+// whether v calls a lambda whose calls have been worth a task
+static int lpar_heavy(lenv* e, lval* v) {
+  if (v->type != LVAL_SEXPR || v->count < 2 || v->cell[0]->type != LVAL_SYM)
+    return 0;
+  int local;
+  lrcu_read_lock();
+  lval* f = lpar_lookup(e, v->cell[0]->sym, &local);
+  int r = f && f->type == LVAL_FUN && !f->builtin &&
+          atomic_load_explicit(&f->lambda->cost, memory_order_relaxed) >=
+              LPAR_ARG_COST;
+  lrcu_read_unlock();
+  return r;
+}
+
+// evaluates every element of v in place, the expensive ones free of
+// effects on the pool
+void lpar_eval_args(lenv* e, lval* v) {
+  lpool* p = lpool_global();
+
+  // it takes two expensive arguments, the last is evaluated here while
+  // the others run elsewhere
+  int heavy = 0;
+  int last = 0;
+  for (int i = 1; i < v->count && lpool_size(p) > 1; ++i)
+    if (lpar_heavy(e, v->cell[i])) {
+      heavy++;
+      last = i;
+    }
+  if (heavy < 2) {
+    for (int i = 0; i < v->count; ++i)
+      v->cell[i] = lval_eval(e, v->cell[i]);
+    return;
+  }
+
+  lpar_args args = {e, v, 0};
+  lpar_arg* tasks = malloc(sizeof(lpar_arg) * v->count);
+  for (int i = 0; i < v->count; ++i) {
+    lval* x = v->cell[i];
+    int out = i != last && lpar_heavy(e, x) && lpool_hungry(p);
+    int busy = atomic_load_explicit(&args.left, memory_order_acquire) > 0;
+    int pure = out || busy ? lpar_pure(e, x) : 1;
+
+    if (out && pure) {
+      tasks[i] = (lpar_arg){&args, i};
+      atomic_fetch_add_explicit(&args.left, 1, memory_order_relaxed);
+      lpool_submit(p, lpar_arg_task, &tasks[i]);
+      continue;
+    }
+
+    // effects wait for everything handed out before them
+    if (!pure)
+      lpar_join(p, &args);
+    v->cell[i] = lval_eval(e, x);
+  }
+  lpar_join(p, &args);
+  free(tasks);
+}
+
+// builtins
+
+lval* builtin_par_args(lenv* e, lval* a) {
+  LASSERT_NUM("par-args", a, 1);
+  LASSERT_TYPE("par-args", a, 0, LVAL_NUM);
+
+  lpar_state* st = lpar_state_of(e);
+  LASSERT(a, st, "Function 'par-args': not running in an interpreter.");
+
+  atomic_store(&st->on, a->cell[0]->num != 0);
+  lval_del(a);
+  return lval_sexpr();
+}
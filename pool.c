@@ -0,0 +1,470 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "lispy.h"
+
+// A work-stealing pool. Every worker owns a Chase-Lev deque: the owner
+// pushes and takes work at the bottom, idle workers steal from the top of
+// the others'. Threads outside the pool hand work over through a shared
+// queue and steal alongside the workers while they wait for it.
+//
+// A parallel loop starts as one task over the whole range that keeps
+// splitting itself in halves, leaving one half for others to steal, until
+// what is left is small enough to run. Loops started from inside a task
+// push onto the worker's own deque, so nested loops run in parallel too.
+// Single tasks are pushed the same way, and a thread waiting for one can
+// run other pending work in the meantime with lpool_help.
+
+typedef struct lwork lwork;
+
+struct lwork {
+  void (*run)(lpool* p, lwork* w);
+  // link in the shared queue
+  lwork* next;
+};
+
+// growable circular array, replaced buffers are kept until the deque is
+// deleted since a thief may still be reading one
+typedef struct ldeque_buf ldeque_buf;
+
+struct ldeque_buf {
+  long size;
+  ldeque_buf* prev;
+  _Atomic(lwork*) items[];
+};
+
+typedef struct ldeque {
+  atomic_long top;
+  atomic_long bottom;
+  _Atomic(ldeque_buf*) buf;
+} ldeque;
+
+// returned by a steal that lost a race, there may be more work
+#define LDEQUE_ABORT ((lwork*)1)
+
+typedef struct lworker {
+  lpool* pool;
+  int index;
+  unsigned rng;
+  pthread_t thread;
+  ldeque deque;
+} lworker;
+
+struct lpool {
+  int size;
+  lworker* workers;
+
+  // work handed in from outside the pool
+  pthread_mutex_t inject_lock;
+  lwork* inject_head;
+  lwork* inject_tail;
+  atomic_int injected;
+
+  // bumped whenever work is made available, sleepers wait for a change
+  atomic_ulong epoch;
+  atomic_int sleepers;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int quit;
+};
+
+// the worker the current thread is, NULL outside of any pool
+static _Thread_local lworker* lpool_self;
+
+// deque
+
+static ldeque_buf* ldeque_buf_new(long size) {
+  ldeque_buf* a = malloc(sizeof(ldeque_buf) + sizeof(lwork*) * size);
+  a->size = size;
+  a->prev = NULL;
+  return a;
+}
+
+static void ldeque_init(ldeque* d) {
+  atomic_init(&d->top, 0);
+  atomic_init(&d->bottom, 0);
+  atomic_init(&d->buf, ldeque_buf_new(64));
+}
+
+static void ldeque_free(ldeque* d) {
+  ldeque_buf* a = atomic_load_explicit(&d->buf, memory_order_relaxed);
+  while (a) {
+    ldeque_buf* prev = a->prev;
+    free(a);
+    a = prev;
+  }
+}
+
+static ldeque_buf* ldeque_grow(ldeque* d, ldeque_buf* a, long t, long b) {
+  ldeque_buf* n = ldeque_buf_new(a->size * 2);
+  for (long i = t; i < b; ++i)
+    atomic_store_explicit(
+        &n->items[i % n->size],
+        atomic_load_explicit(&a->items[i % a->size], memory_order_relaxed),
+        memory_order_relaxed);
+  n->prev = a;
+  atomic_store_explicit(&d->buf, n, memory_order_release);
+  return n;
+}
+
+// owner only
+static void ldeque_push(ldeque* d, lwork* w) {
+  long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+  long t = atomic_load_explicit(&d->top, memory_order_acquire);
+  ldeque_buf* a = atomic_load_explicit(&d->buf, memory_order_relaxed);
+  if (b - t > a->size - 1)
+    a = ldeque_grow(d, a, t, b);
+  atomic_store_explicit(&a->items[b % a->size], w, memory_order_relaxed);
+  atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+}
+
+// owner only, NULL when empty
+static lwork* ldeque_take(ldeque* d) {
+  long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+  ldeque_buf* a = atomic_load_explicit(&d->buf, memory_order_relaxed);
+  atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+  if (t > b) {
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return NULL;
+  }
+
+  lwork* w = atomic_load_explicit(&a->items[b % a->size], memory_order_relaxed);
+  if (t == b) {
+    // the last item, race the thieves for it
+    if (!atomic_compare_exchange_strong_explicit(
+            &d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+      w = NULL;
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+  }
+  return w;
+}
+
+// any thread, NULL when empty
+static lwork* ldeque_steal(ldeque* d) {
+  long t = atomic_load_explicit(&d->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+  if (t >= b)
+    return NULL;
+
+  ldeque_buf* a = atomic_load_explicit(&d->buf, memory_order_acquire);
+  lwork* w = atomic_load_explicit(&a->items[t % a->size], memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(
+          &d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+    return LDEQUE_ABORT;
+  return w;
+}
+
+// scheduling
+
+static void lpool_notify(lpool* p) {
+  atomic_fetch_add(&p->epoch, 1);
+  if (atomic_load(&p->sleepers) > 0) {
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+static void lpool_push(lpool* p, lwork* w) {
+  lworker* self = lpool_self;
+  if (self && self->pool == p) {
+    ldeque_push(&self->deque, w);
+  } else {
+    w->next = NULL;
+    pthread_mutex_lock(&p->inject_lock);
+    if (p->inject_tail)
+      p->inject_tail->next = w;
+    else
+      p->inject_head = w;
+    p->inject_tail = w;
+    atomic_fetch_add_explicit(&p->injected, 1, memory_order_release);
+    pthread_mutex_unlock(&p->inject_lock);
+  }
+  lpool_notify(p);
+}
+
+static lwork* lpool_pop_injected(lpool* p) {
+  if (atomic_load_explicit(&p->injected, memory_order_acquire) == 0)
+    return NULL;
+
+  pthread_mutex_lock(&p->inject_lock);
+  lwork* w = p->inject_head;
+  if (w) {
+    p->inject_head = w->next;
+    if (!p->inject_head)
+      p->inject_tail = NULL;
+    atomic_fetch_sub_explicit(&p->injected, 1, memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&p->inject_lock);
+  return w;
+}
+
+// work for self (NULL when outside the pool): its own first, then handed
+// in, then stolen from a worker picked at random
+static lwork* lpool_find(lpool* p, lworker* self) {
+  lwork* w;
+  if (self && (w = ldeque_take(&self->deque)))
+    return w;
+  if ((w = lpool_pop_injected(p)))
+    return w;
+
+  unsigned start = 0;
+  if (self) {
+    self->rng ^= self->rng << 13;
+    self->rng ^= self->rng >> 17;
+    self->rng ^= self->rng << 5;
+    start = self->rng;
+  }
+  int retry;
+  do {
+    retry = 0;
+    for (int i = 0; i < p->size; ++i) {
+      lworker* v = &p->workers[(start + i) % p->size];
+      if (v == self)
+        continue;
+      w = ldeque_steal(&v->deque);
+      if (w == LDEQUE_ABORT)
+        retry = 1;
+      else if (w)
+        return w;
+    }
+  } while (retry);
+  return NULL;
+}
+
+static void* lpool_worker(void* arg) {
+  lworker* self = arg;
+  lpool* p = self->pool;
+  lpool_self = self;
+
+  while (1) {
+    unsigned long epoch = atomic_load(&p->epoch);
+    lwork* w = lpool_find(p, self);
+    if (w) {
+      w->run(p, w);
+      continue;
+    }
+
+    // nothing anywhere, sleep until more work is made available
+    pthread_mutex_lock(&p->lock);
+    atomic_fetch_add(&p->sleepers, 1);
+    while (!p->quit && atomic_load(&p->epoch) == epoch)
+      pthread_cond_wait(&p->wake, &p->lock);
+    atomic_fetch_sub(&p->sleepers, 1);
+    int quit = p->quit;
+    pthread_mutex_unlock(&p->lock);
+    if (quit)
+      break;
+  }
+
+  return NULL;
+}
+
+lpool* lpool_new(int nthreads) {
+  lpool* p = malloc(sizeof(lpool));
+  p->size = MAX(nthreads, 0);
+  p->workers = calloc(MAX(p->size, 1), sizeof(lworker));
+  p->inject_head = NULL;
+  p->inject_tail = NULL;
+  atomic_init(&p->injected, 0);
+  atomic_init(&p->epoch, 0);
+  atomic_init(&p->sleepers, 0);
+  p->quit = 0;
+  pthread_mutex_init(&p->inject_lock, NULL);
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->wake, NULL);
+
+  for (int i = 0; i < p->size; ++i) {
+    lworker* w = &p->workers[i];
+    w->pool = p;
+    w->index = i;
+    w->rng = 2654435761u * (i + 1);
+    ldeque_init(&w->deque);
+  }
+  for (int i = 0; i < p->size; ++i)
+    pthread_create(&p->workers[i].thread, NULL, lpool_worker, &p->workers[i]);
+
+  return p;
+}
+
+void lpool_del(lpool* p) {
+  pthread_mutex_lock(&p->lock);
+  p->quit = 1;
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+
+  for (int i = 0; i < p->size; ++i)
+    pthread_join(p->workers[i].thread, NULL);
+  for (int i = 0; i < p->size; ++i)
+    ldeque_free(&p->workers[i].deque);
+
+  pthread_mutex_destroy(&p->inject_lock);
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->wake);
+  free(p->workers);
+  free(p);
+}
+
+static lpool* global_pool;
+static pthread_once_t global_pool_once = PTHREAD_ONCE_INIT;
+
+static void lpool_global_init(void) {
+  // LISPY_THREADS overrides the worker count, 0 or 1 disables threading
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  char* env = getenv("LISPY_THREADS");
+  if (env)
+    n = strtol(env, NULL, 10);
+
+  // the calling thread takes part in every loop, so spawn one less
+  global_pool = lpool_new(MAX(n, 1) - 1);
+}
+
+lpool* lpool_global(void) {
+  pthread_once(&global_pool_once, lpool_global_init);
+  return global_pool;
+}
+
+int lpool_size(lpool* p) {
+  return p ? p->size + 1 : 1;
+}
+
+// single tasks
+
+typedef struct lsubmit {
+  lwork work;
+  ltask fn;
+  void* ctx;
+} lsubmit;
+
+static void lsubmit_run(lpool* p, lwork* w) {
+  UNUSED(p);
+  lsubmit* s = (lsubmit*)w;
+  ltask fn = s->fn;
+  void* ctx = s->ctx;
+  free(s);
+  fn(ctx, 0);
+}
+
+// runs fn(ctx, 0) on the pool, or right away when it has no workers
+void lpool_submit(lpool* p, ltask fn, void* ctx) {
+  if (!p || p->size == 0) {
+    fn(ctx, 0);
+    return;
+  }
+
+  lsubmit* s = malloc(sizeof(lsubmit));
+  s->work.run = lsubmit_run;
+  s->fn = fn;
+  s->ctx = ctx;
+  lpool_push(p, &s->work);
+}
+
+// runs one piece of pending work on the calling thread, returns whether
+// there was any
+int lpool_help(lpool* p) {
+  if (!p || p->size == 0)
+    return 0;
+  lworker* self = lpool_self && lpool_self->pool == p ? lpool_self : NULL;
+  lwork* w = lpool_find(p, self);
+  if (w)
+    w->run(p, w);
+  return w != NULL;
+}
+
+// whether work pushed by the calling thread now would soon be picked up:
+// a worker is asleep, or nothing pushed earlier is still waiting
+int lpool_hungry(lpool* p) {
+  if (!p || p->size == 0)
+    return 0;
+  if (atomic_load_explicit(&p->sleepers, memory_order_relaxed) > 0)
+    return 1;
+  lworker* self = lpool_self && lpool_self->pool == p ? lpool_self : NULL;
+  if (!self)
+    return atomic_load_explicit(&p->injected, memory_order_relaxed) == 0;
+  long b = atomic_load_explicit(&self->deque.bottom, memory_order_relaxed);
+  long t = atomic_load_explicit(&self->deque.top, memory_order_relaxed);
+  return b <= t;
+}
+
+// parallel loops
+
+typedef struct ljob {
+  ltask fn;
+  void* ctx;
+  int grain;
+  // iterations not yet run, the job lives on the caller's stack until 0
+  atomic_int left;
+} ljob;
+
+typedef struct lrange {
+  lwork work;
+  ljob* job;
+  int lo;
+  int hi;
+} lrange;
+
+static void lrange_run(lpool* p, lwork* w);
+
+static lrange* lrange_new(ljob* job, int lo, int hi) {
+  lrange* r = malloc(sizeof(lrange));
+  r->work.run = lrange_run;
+  r->job = job;
+  r->lo = lo;
+  r->hi = hi;
+  return r;
+}
+
+static void lrange_run(lpool* p, lwork* w) {
+  lrange* r = (lrange*)w;
+  ljob* job = r->job;
+
+  // leave the upper halves for others until the rest is one grain
+  while (r->hi - r->lo > job->grain) {
+    int mid = r->lo + (r->hi - r->lo) / 2;
+    lpool_push(p, &lrange_new(job, mid, r->hi)->work);
+    r->hi = mid;
+  }
+
+  for (int i = r->lo; i < r->hi; ++i)
+    job->fn(job->ctx, i);
+
+  int n = r->hi - r->lo;
+  free(r);
+  atomic_fetch_sub_explicit(&job->left, n, memory_order_release);
+}
+
+void lpool_run(lpool* p, ltask fn, void* ctx, int n) {
+  if (n <= 0)
+    return;
+
+  // run serially when there is nobody to help
+  if (!p || p->size == 0 || n == 1) {
+    for (int i = 0; i < n; ++i)
+      fn(ctx, i);
+    return;
+  }
+
+  ljob job;
+  job.fn = fn;
+  job.ctx = ctx;
+  // a few grains per thread so stealing can even out uneven iterations
+  job.grain = MAX(n / (lpool_size(p) * 4), 1);
+  atomic_init(&job.left, n);
+
+  // run the range here, then help with whatever is left until it is done
+  lworker* self = lpool_self && lpool_self->pool == p ? lpool_self : NULL;
+  lrange_run(p, &lrange_new(&job, 0, n)->work);
+  while (atomic_load_explicit(&job.left, memory_order_acquire) > 0) {
+    lwork* w = lpool_find(p, self);
+    if (w)
+      w->run(p, w);
+    else
+      sched_yield();
+  }
+}
@@ -0,0 +1,430 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#include "lispy.h"
+
+// Green processes: (spawn-proc {expr}) evaluates expr on a stack of its
+// own, in an environment of its own with self bound to the new process,
+// above a snapshot of the environments it was spawned from, as for spawn:
+// later global defs are not seen, definitions inside stay with the
+// process.
+// (send p x) puts a copy of x in p's mailbox and (receive self) takes the
+// oldest message out. A process with nothing to receive gives its thread
+// up until something is sent. Processes run as tasks on the global pool,
+// any number of them over its threads, and may resume on a different
+// thread than the one they stopped on.
+//
+// Mailboxes are intrusive MPSC queues: a sender links its message in with
+// one exchange, the owner takes messages out without atomic writes. A
+// process waits by parking until something unparks it, a send or a
+// channel. It is only marked as waiting once it is off its stack, so an
+// unpark racing with it either finds it waiting and schedules it, or is
+// noticed by the check that follows.
+//
+// The interpreter's thread is a process too, self at the top level, with
+// no stack of its own, receiving there blocks the thread. Deleting an
+// interpreter stops its processes: receive fails from then on, and the
+// error unwinds them.
+
+// stack of a process
+#define LPROC_STACK (256 * 1024)
+
+enum { LPROC_RUNNABLE, LPROC_WAITING, LPROC_DONE };
+
+typedef struct lmsg lmsg;
+
+struct lmsg {
+  _Atomic(lmsg*) next;
+  lval* v;
+};
+
+typedef struct lmbox {
+  // newest message, where senders link theirs
+  _Atomic(lmsg*) head;
+  // oldest message, only used by the owner
+  lmsg* tail;
+  lmsg stub;
+} lmbox;
+
+struct lproc {
+  atomic_int refs;
+  atomic_int state;
+  // set when the interpreter is being deleted
+  atomic_int stopping;
+  // set when it was unparked since it last parked
+  atomic_int permit;
+  lmbox mbox;
+
+  lispy_vm_t* vm;
+  // receive only works in code running below env
+  lenv* env;
+  lval* expr;
+
+  // what the process runs on, none for an interpreter's thread, which
+  // waits on wake instead
+  lcoro* co;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+
+  // links in the interpreter's list of live processes
+  lproc* prev;
+  lproc* next;
+};
+
+struct lproc_group {
+  pthread_mutex_t lock;
+  lproc* live;
+};
+
+// mailboxes
+
+static void lmbox_init(lmbox* q) {
+  atomic_init(&q->stub.next, NULL);
+  q->stub.v = NULL;
+  atomic_init(&q->head, &q->stub);
+  q->tail = &q->stub;
+}
+
+static void lmbox_push(lmbox* q, lmsg* m) {
+  atomic_store_explicit(&m->next, NULL, memory_order_relaxed);
+  lmsg* prev = atomic_exchange(&q->head, m);
+  atomic_store_explicit(&prev->next, m, memory_order_release);
+}
+
+// takes the oldest message out, NULL when there is none or the send of
+// the next one is half done
+static lmsg* lmbox_pop(lmbox* q) {
+  lmsg* tail = q->tail;
+  lmsg* next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (tail == &q->stub) {
+    if (!next)
+      return NULL;
+    q->tail = next;
+    tail = next;
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  }
+  if (next) {
+    q->tail = next;
+    return tail;
+  }
+  if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+    return NULL;
+
+  // the last message, the stub goes in behind it so it can be taken out
+  lmbox_push(q, &q->stub);
+  next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (next) {
+    q->tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+// processes
+
+static lproc* lproc_new(lenv* env, lval* expr) {
+  lproc* p = malloc(sizeof(lproc));
+  atomic_init(&p->refs, 1);
+  atomic_init(&p->state, LPROC_RUNNABLE);
+  atomic_init(&p->stopping, 0);
+  atomic_init(&p->permit, 0);
+  lmbox_init(&p->mbox);
+  p->vm = env->vm;
+  p->env = env;
+  p->expr = expr;
+  p->co = NULL;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->wake, NULL);
+  p->prev = NULL;
+  p->next = NULL;
+  return p;
+}
+
+lproc* lproc_retain(lproc* p) {
+  atomic_fetch_add_explicit(&p->refs, 1, memory_order_relaxed);
+  return p;
+}
+
+void lproc_release(lproc* p) {
+  if (atomic_fetch_sub_explicit(&p->refs, 1, memory_order_acq_rel) != 1)
+    return;
+  // messages nobody received
+  lmsg* m;
+  while ((m = lmbox_pop(&p->mbox))) {
+    lval_del(m->v);
+    free(m);
+  }
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->wake);
+  free(p);
+}
+
+lval* lval_proc(lproc* p) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_PROC;
+  v->proc = p;
+  return v;
+}
+
+static lproc_group* lproc_group_of(lenv* e) {
+  return e->vm ? lispy_vm_procs(e->vm) : NULL;
+}
+
+static void lproc_group_add(lproc_group* g, lproc* p) {
+  pthread_mutex_lock(&g->lock);
+  p->prev = NULL;
+  p->next = g->live;
+  if (g->live)
+    g->live->prev = p;
+  g->live = p;
+  pthread_mutex_unlock(&g->lock);
+}
+
+static void lproc_group_remove(lproc_group* g, lproc* p) {
+  pthread_mutex_lock(&g->lock);
+  if (p->prev)
+    p->prev->next = p->next;
+  else
+    g->live = p->next;
+  if (p->next)
+    p->next->prev = p->prev;
+  pthread_mutex_unlock(&g->lock);
+}
+
+// whether p has to look again at what it waits for
+static int lproc_ready(lproc* p) {
+  return atomic_load(&p->permit) || atomic_load(&p->stopping);
+}
+
+static void lproc_main(void* arg) {
+  lproc* p = arg;
+  lval_del(builtin_eval(p->env, lval_add(lval_sexpr(), p->expr)));
+  p->expr = NULL;
+  lenv_del_chain(p->env);
+  p->env = NULL;
+  atomic_store(&p->state, LPROC_DONE);
+}
+
+// resumes p on the calling thread until it parks or ends
+static void lproc_run(void* ctx, int i) {
+  UNUSED(i);
+  lproc* p = ctx;
+
+  do {
+    if (!lcoro_resume(p->co)) {
+      lispy_vm_t* vm = p->vm;
+      lcoro_del(p->co);
+      lproc_group_remove(lispy_vm_procs(vm), p);
+      lproc_release(p);
+      lispy_vm_unhold(vm);
+      return;
+    }
+
+    // off its stack now, it waits unless it was unparked meanwhile
+    atomic_store(&p->state, LPROC_WAITING);
+    int waiting = LPROC_WAITING;
+    if (!lproc_ready(p) ||
+        !atomic_compare_exchange_strong(&p->state, &waiting, LPROC_RUNNABLE))
+      return;
+  } while (1);
+}
+
+// schedules p if it is parked, or has its next park return right away
+void lproc_unpark(lproc* p) {
+  if (!p->co) {
+    pthread_mutex_lock(&p->lock);
+    atomic_store(&p->permit, 1);
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    return;
+  }
+  atomic_store(&p->permit, 1);
+  int waiting = LPROC_WAITING;
+  if (atomic_compare_exchange_strong(&p->state, &waiting, LPROC_RUNNABLE))
+    lpool_submit(lpool_global(), lproc_run, p);
+}
+
+// gives the thread up until p, running on its own stack, is unparked;
+// 0 when it is being stopped instead
+int lproc_park(lproc* p) {
+  while (!atomic_load(&p->stopping)) {
+    if (atomic_exchange(&p->permit, 0))
+      return 1;
+    lcoro_suspend(p->co);
+  }
+  return 0;
+}
+
+// whether code evaluating in e runs as p: on its stack, and not as a task
+// some parallel builtin handed out, which may be on any thread
+static int lproc_owns(lproc* p, lenv* e) {
+  for (; e; e = e->par) {
+    if (e == p->env)
+      return 1;
+    if (e->isolated)
+      return 0;
+  }
+  return 0;
+}
+
+// the process code evaluating in e runs as, NULL when it runs on a thread's
+// own stack: the interpreter's, or that of a task some parallel builtin
+// handed out
+lproc* lproc_of(lenv* e) {
+  while (e->par && !e->isolated)
+    e = e->par;
+  lbind* b = e->isolated ? lenv_find(e, "self") : NULL;
+  lval* v = b ? atomic_load(&b->val) : NULL;
+  if (!v || v->type != LVAL_PROC || v->proc->env != e)
+    return NULL;
+  return v->proc;
+}
+
+// takes the oldest message out for the interpreter's thread, blocking it
+// until there is one
+static lmsg* lproc_wait(lproc* p) {
+  lpool* pool = lpool_global();
+  lmsg* m;
+  while (!(m = lmbox_pop(&p->mbox))) {
+    if (atomic_load(&p->stopping) || lpool_size(pool) == 1)
+      return NULL;
+    if (lpool_help(pool))
+      continue;
+    pthread_mutex_lock(&p->lock);
+    while (!lproc_ready(p))
+      pthread_cond_wait(&p->wake, &p->lock);
+    atomic_store(&p->permit, 0);
+    pthread_mutex_unlock(&p->lock);
+  }
+  return m;
+}
+
+// interpreters
+
+lproc_group* lproc_group_new(void) {
+  lproc_group* g = malloc(sizeof(lproc_group));
+  pthread_mutex_init(&g->lock, NULL);
+  g->live = NULL;
+  return g;
+}
+
+void lproc_group_del(lproc_group* g) {
+  pthread_mutex_destroy(&g->lock);
+  free(g);
+}
+
+// stops every process of the group and waits for them to end
+void lproc_group_stop(lproc_group* g) {
+  while (1) {
+    pthread_mutex_lock(&g->lock);
+    int n = 0;
+    for (lproc* p = g->live; p; p = p->next)
+      n++;
+    lproc** live = malloc(sizeof(lproc*) * MAX(n, 1));
+    n = 0;
+    for (lproc* p = g->live; p; p = p->next)
+      live[n++] = lproc_retain(p);
+    pthread_mutex_unlock(&g->lock);
+    if (n == 0) {
+      free(live);
+      return;
+    }
+
+    // woken outside the lock, they may run right here and end
+    for (int i = 0; i < n; ++i) {
+      atomic_store(&live[i]->stopping, 1);
+      lproc_unpark(live[i]);
+      lproc_release(live[i]);
+    }
+    free(live);
+    if (!lpool_help(lpool_global()))
+      sched_yield();
+  }
+}
+
+// binds self in the global environment e to its thread's process
+void lproc_bind_root(lenv* e) {
+  lval* k = lval_sym("self");
+  lval* v = lval_proc(lproc_new(e, NULL));
+  lenv_put(e, k, v);
+  lval_del(k);
+  lval_del(v);
+}
+
+// builtins
+
+lval* builtin_spawn_proc(lenv* e, lval* a) {
+  LASSERT_NUM("spawn-proc", a, 1);
+  LASSERT_TYPE("spawn-proc", a, 0, LVAL_QEXPR);
+  lproc_group* g = lproc_group_of(e);
+  LASSERT(a, g, "Function 'spawn-proc': not running in an interpreter.");
+
+  lenv* env = lenv_new();
+  env->par = lenv_snapshot_chain(e);
+  env->vm = e->vm;
+  env->isolated = 1;
+  lproc* p = lproc_new(env, lval_take(a, 0));
+  p->co = lcoro_new(LPROC_STACK, lproc_main, p);
+  if (!p->co) {
+    lval_del(p->expr);
+    lenv_del_chain(env);
+    lproc_release(p);
+    return lval_err("Function 'spawn-proc': out of memory.");
+  }
+
+  lval* self = lval_sym("self");
+  lval* v = lval_proc(p);
+  lenv_put(env, self, v);
+  lval_del(self);
+
+  // the running process keeps a reference and the interpreter until it
+  // ends
+  lproc_retain(p);
+  lispy_vm_hold(e->vm);
+  lproc_group_add(g, p);
+  lpool_submit(lpool_global(), lproc_run, p);
+  return v;
+}
+
+lval* builtin_send(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("send", a, 2);
+  LASSERT_TYPE("send", a, 0, LVAL_PROC);
+
+  lproc* p = a->cell[0]->proc;
+  // messages to a process that has ended are dropped
+  if (atomic_load(&p->state) != LPROC_DONE) {
+    lmsg* m = malloc(sizeof(lmsg));
+    m->v = lval_pop(a, 1);
+    lmbox_push(&p->mbox, m);
+    lproc_unpark(p);
+  }
+  lval_del(a);
+  return lval_sexpr();
+}
+
+lval* builtin_receive(lenv* e, lval* a) {
+  LASSERT_NUM("receive", a, 1);
+  LASSERT_TYPE("receive", a, 0, LVAL_PROC);
+
+  lproc* p = a->cell[0]->proc;
+  LASSERT(a, lproc_owns(p, e),
+          "Function 'receive': not called by the receiving process.");
+
+  lmsg* m;
+  if (!p->co)
+    m = lproc_wait(p);
+  else
+    // give the thread up until something is sent
+    while (!(m = lmbox_pop(&p->mbox)) && lproc_park(p))
+      ;
+  lval_del(a);
+  if (!m)
+    return lval_err("Function 'receive': no message can arrive anymore.");
+
+  lval* v = m->v;
+  free(m);
+  return v;
+}
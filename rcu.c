@@ -0,0 +1,158 @@
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#include "lispy.h"
+
+// Epoch-based reclamation for data that threads read without taking a
+// lock, the global environment's bindings. A reader announces the epoch it
+// started in until it is done with the pointers it loaded. A writer
+// publishes the replacement first and then retires what it replaced,
+// stamped with the epoch it did so in; that is freed once every reader
+// announces a later epoch or none. Writers take one lock, they are rare
+// next to reads.
+
+typedef struct lrcu_reader {
+  // epoch the thread started reading in, 0 when it is not reading
+  atomic_ulong epoch;
+  atomic_int used;
+  // read sections nest, only the outermost one announces
+  int depth;
+  struct lrcu_reader* next;
+} lrcu_reader;
+
+typedef struct lrcu_retired {
+  void* p;
+  void (*del)(void*);
+  unsigned long epoch;
+  struct lrcu_retired* next;
+} lrcu_retired;
+
+static atomic_ulong lrcu_epoch = 1;
+// one record per thread that ever read, records of exited threads are
+// taken over by new ones
+static _Atomic(lrcu_reader*) lrcu_readers;
+static _Thread_local lrcu_reader* lrcu_self;
+static pthread_key_t lrcu_key;
+static pthread_once_t lrcu_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t lrcu_lock = PTHREAD_MUTEX_INITIALIZER;
+static lrcu_retired* lrcu_limbo;
+
+static void lrcu_exit(void* r) {
+  atomic_store_explicit(&((lrcu_reader*)r)->used, 0, memory_order_release);
+}
+
+static void lrcu_init(void) {
+  pthread_key_create(&lrcu_key, lrcu_exit);
+}
+
+static lrcu_reader* lrcu_register(void) {
+  pthread_once(&lrcu_once, lrcu_init);
+
+  lrcu_reader* r = atomic_load(&lrcu_readers);
+  for (; r; r = r->next) {
+    int unused = 0;
+    if (atomic_compare_exchange_strong(&r->used, &unused, 1))
+      break;
+  }
+  if (!r) {
+    r = malloc(sizeof(lrcu_reader));
+    atomic_init(&r->epoch, 0);
+    atomic_init(&r->used, 1);
+    r->next = atomic_load(&lrcu_readers);
+    while (!atomic_compare_exchange_weak(&lrcu_readers, &r->next, r))
+      ;
+  }
+  r->depth = 0;
+  pthread_setspecific(lrcu_key, r);
+  lrcu_self = r;
+  return r;
+}
+
+// readers
+
+void lrcu_read_lock(void) {
+  lrcu_reader* r = lrcu_self ? lrcu_self : lrcu_register();
+  if (r->depth++ == 0)
+    atomic_store(&r->epoch, atomic_load(&lrcu_epoch));
+}
+
+void lrcu_read_unlock(void) {
+  lrcu_reader* r = lrcu_self;
+  if (--r->depth == 0)
+    atomic_store_explicit(&r->epoch, 0, memory_order_release);
+}
+
+// writers
+
+void lrcu_write_lock(void) {
+  pthread_mutex_lock(&lrcu_lock);
+}
+
+// hands p to del once no reader can hold it anymore, called with the write
+// lock held after p was unpublished
+void lrcu_retire(void* p, void (*del)(void*)) {
+  lrcu_retired* x = malloc(sizeof(lrcu_retired));
+  x->p = p;
+  x->del = del;
+  x->epoch = atomic_fetch_add(&lrcu_epoch, 1);
+  x->next = lrcu_limbo;
+  lrcu_limbo = x;
+}
+
+// the earliest epoch a reader is in, ULONG_MAX when nobody reads
+static unsigned long lrcu_oldest(void) {
+  unsigned long oldest = ULONG_MAX;
+  for (lrcu_reader* r = atomic_load(&lrcu_readers); r; r = r->next) {
+    unsigned long e = atomic_load(&r->epoch);
+    if (e && e < oldest)
+      oldest = e;
+  }
+  return oldest;
+}
+
+// takes out of limbo what was retired before the epoch
+static lrcu_retired* lrcu_take(unsigned long before) {
+  lrcu_retired* done = NULL;
+  lrcu_retired** x = &lrcu_limbo;
+  while (*x)
+    if ((*x)->epoch < before) {
+      lrcu_retired* r = *x;
+      *x = r->next;
+      r->next = done;
+      done = r;
+    } else
+      x = &(*x)->next;
+  return done;
+}
+
+static void lrcu_free(lrcu_retired* x) {
+  while (x) {
+    lrcu_retired* next = x->next;
+    x->del(x->p);
+    free(x);
+    x = next;
+  }
+}
+
+// frees what no reader holds anymore, with nobody reading that is all of
+// it, so a value replaced outside of parallel work goes right away
+void lrcu_write_unlock(void) {
+  lrcu_retired* done = lrcu_limbo ? lrcu_take(lrcu_oldest()) : NULL;
+  pthread_mutex_unlock(&lrcu_lock);
+  lrcu_free(done);
+}
+
+// waits for the readers that may hold anything retired so far and frees it,
+// not to be called from inside a read section
+void lrcu_barrier(void) {
+  pthread_mutex_lock(&lrcu_lock);
+  unsigned long now = atomic_load(&lrcu_epoch);
+  while (lrcu_oldest() < now)
+    sched_yield();
+  lrcu_retired* done = lrcu_take(now);
+  pthread_mutex_unlock(&lrcu_lock);
+  lrcu_free(done);
+}
@@ -0,0 +1,547 @@
+#include <stdatomic.h>
+
+#include "lispy.h"
+
+// Lazy sequences describe a pipeline of stages instead of holding their
+// elements. The description is immutable and reference counted, so copies
+// share it. Consuming a sequence builds a chain of iterators that pulls one
+// element at a time through every stage, so no intermediate list is ever
+// built and memory stays constant however long the sequence is. Chained
+// maps are merged into one stage and nested takes into the smaller one.
+// A generator's elements come from running code, see gen.c.
+
+typedef enum lseq_t {
+  LSEQ_RANGE,
+  LSEQ_LIST,
+  LSEQ_REPEAT,
+  LSEQ_ITERATE,
+  LSEQ_MAP,
+  LSEQ_FILTER,
+  LSEQ_TAKE,
+  LSEQ_GEN
+} lseq_t;
+
+struct lseq {
+  atomic_int refs;
+  lseq_t kind;
+  // upstream stage of map, filter and take
+  lseq* src;
+  // functions applied in order by map, the predicate of filter or the
+  // step of iterate
+  lval** fns;
+  int nfns;
+  // the list, the repeated value, the first value of iterate or the body
+  // of a generator
+  lval* val;
+  // what a generator's body runs above, copied from where it was made
+  lenv* env;
+  // range bounds, exact while start and step are integers; the end is
+  // infinite for an open range
+  int ints;
+  int64_t istart;
+  int64_t istep;
+  int64_t iend;
+  double start;
+  double step;
+  double end;
+  // number of elements kept by take
+  int64_t n;
+};
+
+typedef struct lseq_iter lseq_iter;
+
+struct lseq_iter {
+  lseq* seq;
+  lseq_iter* src;
+  lenv* env;
+  // elements produced so far
+  int64_t pos;
+  // the value iterate yielded last
+  lval* cur;
+  // the running body of a generator
+  lgen* gen;
+};
+
+static lseq* lseq_new(lseq_t kind, lseq* src) {
+  lseq* s = calloc(1, sizeof(lseq));
+  atomic_init(&s->refs, 1);
+  s->kind = kind;
+  s->src = src;
+  return s;
+}
+
+lseq* lseq_retain(lseq* s) {
+  if (s)
+    atomic_fetch_add_explicit(&s->refs, 1, memory_order_relaxed);
+  return s;
+}
+
+void lseq_release(lseq* s) {
+  while (s && atomic_fetch_sub_explicit(&s->refs, 1, memory_order_acq_rel) == 1) {
+    lseq* src = s->src;
+    for (int i = 0; i < s->nfns; ++i)
+      lval_del(s->fns[i]);
+    free(s->fns);
+    if (s->val)
+      lval_del(s->val);
+    lenv_del_chain(s->env);
+    free(s);
+    // walk up the pipeline instead of recursing
+    s = src;
+  }
+}
+
+// whether consuming s ever ends
+static int lseq_finite(lseq* s) {
+  switch (s->kind) {
+    case LSEQ_RANGE:
+      return isfinite(s->end);
+    case LSEQ_LIST:
+    case LSEQ_TAKE:
+    // as far as anyone can tell, it ends when its body does
+    case LSEQ_GEN:
+      return 1;
+    case LSEQ_REPEAT:
+    case LSEQ_ITERATE:
+      return 0;
+    case LSEQ_MAP:
+    case LSEQ_FILTER:
+      return lseq_finite(s->src);
+  }
+  return 0;
+}
+
+lval* lval_seq(lseq* s) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_SEQ;
+  v->seq = s;
+  return v;
+}
+
+// iterators
+
+static lseq_iter* lseq_iter_new(lseq* s, lenv* e) {
+  lseq_iter* it = malloc(sizeof(lseq_iter));
+  it->seq = s;
+  it->src = s->src ? lseq_iter_new(s->src, e) : NULL;
+  it->env = e;
+  it->pos = 0;
+  it->cur = NULL;
+  it->gen = NULL;
+  return it;
+}
+
+static void lseq_iter_del(lseq_iter* it) {
+  while (it) {
+    lseq_iter* src = it->src;
+    if (it->cur)
+      lval_del(it->cur);
+    if (it->gen)
+      lgen_del(it->gen);
+    free(it);
+    it = src;
+  }
+}
+
+// calls f on x, which is consumed
+static lval* lseq_call(lenv* e, lval* f, lval* x) {
+  return lval_call(e, f, lval_add(lval_sexpr(), x));
+}
+
+static lval* lseq_range_next(lseq_iter* it) {
+  lseq* s = it->seq;
+  if (s->ints) {
+    int64_t x;
+    if (__builtin_mul_overflow(it->pos, s->istep, &x) ||
+        __builtin_add_overflow(s->istart, x, &x))
+      return NULL;
+    if (s->istep > 0 ? x >= s->iend : x <= s->iend)
+      return NULL;
+    it->pos++;
+    return lval_int(x);
+  }
+
+  // computed from the index so steps do not accumulate rounding
+  double x = s->start + it->pos * s->step;
+  if (s->step > 0 ? x >= s->end : x <= s->end)
+    return NULL;
+  it->pos++;
+  return lval_num(x);
+}
+
+// the next element, NULL at the end; an error ends the sequence too
+static lval* lseq_next(lseq_iter* it) {
+  lseq* s = it->seq;
+  lval* x = NULL;
+  lval tmp;
+
+  switch (s->kind) {
+    case LSEQ_RANGE:
+      return lseq_range_next(it);
+
+    case LSEQ_LIST:
+      if (it->pos >= s->val->count)
+        return NULL;
+      return lval_copy(lval_peek(s->val, it->pos++, &tmp));
+
+    case LSEQ_REPEAT:
+      return lval_copy(s->val);
+
+    case LSEQ_ITERATE:
+      if (!it->cur) {
+        it->cur = lval_copy(s->val);
+      } else if (it->cur->type != LVAL_ERR) {
+        it->cur = lseq_call(it->env, s->fns[0], it->cur);
+      }
+      return lval_copy(it->cur);
+
+    case LSEQ_MAP:
+      x = lseq_next(it->src);
+      for (int i = 0; i < s->nfns && x && x->type != LVAL_ERR; ++i)
+        x = lseq_call(it->env, s->fns[i], x);
+      return x;
+
+    case LSEQ_FILTER:
+      while ((x = lseq_next(it->src)) && x->type != LVAL_ERR) {
+        lval* r = lseq_call(it->env, s->fns[0], lval_copy(x));
+        if (r->type == LVAL_ERR) {
+          lval_del(x);
+          return r;
+        }
+        int keep = r->type == LVAL_NUM && r->num != 0;
+        lval_del(r);
+        if (keep)
+          return x;
+        lval_del(x);
+      }
+      return x;
+
+    case LSEQ_TAKE:
+      if (it->pos >= s->n)
+        return NULL;
+      it->pos++;
+      return lseq_next(it->src);
+
+    case LSEQ_GEN:
+      if (!it->gen && !(it->gen = lgen_new(s->env, lval_copy(s->val))))
+        return lval_err("Generator is out of memory.");
+      return lgen_next(it->gen);
+  }
+  return NULL;
+}
+
+// argument handling
+
+// the sequence of argument i, a sequence or a Q-expression to walk
+static lseq* lseq_arg(lval* a, int i) {
+  lval* v = a->cell[i];
+  if (v->type == LVAL_SEQ)
+    return lseq_retain(v->seq);
+
+  lseq* s = lseq_new(LSEQ_LIST, NULL);
+  s->val = lval_copy(v);
+  return s;
+}
+
+#define LASSERT_SEQ(func, args, index)                                  \
+  LASSERT(args,                                                         \
+          args->cell[index]->type == LVAL_SEQ ||                        \
+              args->cell[index]->type == LVAL_QEXPR,                    \
+          "Function '%s': invalid argument type on %i. "                \
+          "Got %s, Expected %s or %s.",                                 \
+          func, index, lval_t_name(args->cell[index]->type),            \
+          lval_t_name(LVAL_SEQ), lval_t_name(LVAL_QEXPR))
+
+#define LASSERT_FINITE(func, args, index)                           \
+  LASSERT(args,                                                     \
+          args->cell[index]->type != LVAL_SEQ ||                    \
+              lseq_finite(args->cell[index]->seq),                  \
+          "Function '%s': argument %i is an infinite sequence.", \
+          func, index)
+
+// the exclusive bound of an integer range counting towards 'end', which
+// is NULL for an open range
+static int64_t lseq_int_end(lval* end, int64_t step) {
+  if (end && end->numt == LNUM_INT)
+    return end->inum;
+
+  double d = end ? end->num : INFINITY;
+  if (step < 0)
+    d = isnan(d) ? -INFINITY : floor(d);
+  else
+    d = isnan(d) ? INFINITY : ceil(d);
+  if (d >= 9223372036854775808.0)
+    return INT64_MAX;
+  if (d < -9223372036854775808.0)
+    return INT64_MIN;
+  return (int64_t)d;
+}
+
+// builtins
+
+lval* builtin_range(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT(a, a->count >= 1 && a->count <= 3,
+          "Function 'range': incorrect number of arguments. "
+          "Got %i, Expected 1, 2 or 3.",
+          a->count);
+  for (int i = 0; i < a->count; ++i)
+    LASSERT_TYPE("range", a, i, LVAL_NUM);
+
+  // (range start), (range start end) or (range start end step)
+  lval* start = a->cell[0];
+  lval* step = a->count == 3 ? a->cell[2] : NULL;
+  LASSERT(a, !step || step->num != 0, "Function 'range': step is zero.");
+
+  lseq* s = lseq_new(LSEQ_RANGE, NULL);
+  s->start = start->num;
+  s->step = step ? step->num : 1;
+  s->end = a->count >= 2 ? a->cell[1]->num : INFINITY;
+  s->ints = start->numt == LNUM_INT && (!step || step->numt == LNUM_INT);
+  s->istart = start->inum;
+  s->istep = step ? step->inum : 1;
+  s->iend = lseq_int_end(a->count >= 2 ? a->cell[1] : NULL, s->istep);
+
+  lval_del(a);
+  return lval_seq(s);
+}
+
+lval* builtin_repeat(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("repeat", a, 1);
+
+  lseq* s = lseq_new(LSEQ_REPEAT, NULL);
+  s->val = lval_take(a, 0);
+  return lval_seq(s);
+}
+
+lval* builtin_iterate(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("iterate", a, 2);
+  LASSERT_TYPE("iterate", a, 0, LVAL_FUN);
+
+  // x, (f x), (f (f x)), ...
+  lseq* s = lseq_new(LSEQ_ITERATE, NULL);
+  s->fns = malloc(sizeof(lval*));
+  s->fns[0] = lval_pop(a, 0);
+  s->nfns = 1;
+  s->val = lval_take(a, 0);
+  return lval_seq(s);
+}
+
+lval* builtin_seq(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("seq", a, 1);
+  LASSERT_SEQ("seq", a, 0);
+
+  lseq* s = lseq_arg(a, 0);
+  lval_del(a);
+  return lval_seq(s);
+}
+
+lval* builtin_lazy_map(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("lazy-map", a, 2);
+  LASSERT_TYPE("lazy-map", a, 0, LVAL_FUN);
+  LASSERT_SEQ("lazy-map", a, 1);
+
+  lseq* src = lseq_arg(a, 1);
+  lseq* s = lseq_new(LSEQ_MAP, NULL);
+
+  // a map over a map applies both functions in one stage
+  if (src->kind == LSEQ_MAP) {
+    s->src = lseq_retain(src->src);
+    s->fns = malloc(sizeof(lval*) * (src->nfns + 1));
+    for (int i = 0; i < src->nfns; ++i)
+      s->fns[s->nfns++] = lval_copy(src->fns[i]);
+    lseq_release(src);
+  } else {
+    s->src = src;
+    s->fns = malloc(sizeof(lval*));
+  }
+  s->fns[s->nfns++] = lval_pop(a, 0);
+
+  lval_del(a);
+  return lval_seq(s);
+}
+
+lval* builtin_lazy_filter(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("lazy-filter", a, 2);
+  LASSERT_TYPE("lazy-filter", a, 0, LVAL_FUN);
+  LASSERT_SEQ("lazy-filter", a, 1);
+
+  lseq* s = lseq_new(LSEQ_FILTER, lseq_arg(a, 1));
+  s->fns = malloc(sizeof(lval*));
+  s->fns[0] = lval_pop(a, 0);
+  s->nfns = 1;
+
+  lval_del(a);
+  return lval_seq(s);
+}
+
+lval* builtin_take(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("take", a, 2);
+  LASSERT_TYPE("take", a, 0, LVAL_NUM);
+  LASSERT_SEQ("take", a, 1);
+
+  double n = a->cell[0]->num;
+  LASSERT(a, n >= 0, "Function 'take': negative count " LNUM_DBL_FMT ".", n);
+
+  lseq* src = lseq_arg(a, 1);
+  lseq* s = lseq_new(LSEQ_TAKE, NULL);
+  s->n = n < (double)INT64_MAX ? (int64_t)n : INT64_MAX;
+
+  // a take of a take keeps the smaller count
+  if (src->kind == LSEQ_TAKE) {
+    s->n = MIN(s->n, src->n);
+    s->src = lseq_retain(src->src);
+    lseq_release(src);
+  } else {
+    s->src = src;
+  }
+
+  lval_del(a);
+  return lval_seq(s);
+}
+
+// adds x to the collection 'into', returns an error or NULL
+static lval* lseq_into(lval** into, lval* x) {
+  lval* v = *into;
+  switch (v->type) {
+    case LVAL_VEC:
+      if (x->type != LVAL_NUM)
+        break;
+      // grow the aligned block by doubling
+      if ((v->count & (v->count - 1)) == 0) {
+        double* data = lvec_alloc(MAX(v->count * 2, 1));
+        memcpy(data, v->data, sizeof(double) * v->count);
+        free(v->data);
+        v->data = data;
+      }
+      v->data[v->count++] = x->num;
+      v->cols = v->count;
+      lval_del(x);
+      return NULL;
+
+    case LVAL_MAP:
+      if (x->type != LVAL_QEXPR || x->count != 2)
+        break;
+      lval_unpack(lval_thaw(x));
+      if (!lval_is_key(x->cell[0]))
+        break;
+      lval* k = lval_pop(x, 0);
+      *into = lval_map_put(v, k, lval_take(x, 0));
+      return NULL;
+
+    default:
+      *into = lval_add(v, x);
+      return NULL;
+  }
+
+  lval* err = lval_err("Function 'into': cannot add %s to %s.",
+                       lval_t_name(x->type), lval_t_name(v->type));
+  lval_del(x);
+  return err;
+}
+
+// pours the elements of s into 'into', which is consumed
+static lval* lseq_drain(lenv* e, lseq* s, lval* into) {
+  lseq_iter* it = lseq_iter_new(s, e);
+  lval* x;
+  while ((x = lseq_next(it))) {
+    lval* err = x->type == LVAL_ERR ? x : lseq_into(&into, x);
+    if (err) {
+      lval_del(into);
+      into = err;
+      break;
+    }
+  }
+  lseq_iter_del(it);
+  return into;
+}
+
+lval* builtin_into(lenv* e, lval* a) {
+  LASSERT_NUM("into", a, 2);
+  lval_t t = a->cell[0]->type;
+  LASSERT(a, t == LVAL_QEXPR || t == LVAL_VEC || t == LVAL_MAP,
+          "Function 'into': invalid argument type on 0. "
+          "Got %s, Expected %s, %s or %s.",
+          lval_t_name(t), lval_t_name(LVAL_QEXPR), lval_t_name(LVAL_VEC),
+          lval_t_name(LVAL_MAP));
+  LASSERT_SEQ("into", a, 1);
+  LASSERT_FINITE("into", a, 1);
+
+  lseq* s = lseq_arg(a, 1);
+  lval* into = lval_take(a, 0);
+  if (into->type == LVAL_VEC && into->count) {
+    // give the block room to double from
+    lval* v = lval_vec(0);
+    for (int i = 0; i < into->count; ++i)
+      lseq_into(&v, lval_num(into->data[i]));
+    lval_del(into);
+    into = v;
+  }
+
+  lval* r = lseq_drain(e, s, into);
+  lseq_release(s);
+  return r;
+}
+
+lval* builtin_realize(lenv* e, lval* a) {
+  LASSERT_NUM("realize", a, 1);
+  LASSERT_SEQ("realize", a, 0);
+  LASSERT_FINITE("realize", a, 0);
+
+  lseq* s = lseq_arg(a, 0);
+  lval_del(a);
+  lval* r = lseq_drain(e, s, lval_qexpr());
+  lseq_release(s);
+  return r;
+}
+
+lval* builtin_fold(lenv* e, lval* a) {
+  LASSERT_NUM("fold", a, 3);
+  LASSERT_TYPE("fold", a, 0, LVAL_FUN);
+  LASSERT_SEQ("fold", a, 2);
+  LASSERT_FINITE("fold", a, 2);
+
+  // (fold f init s) computes (f ... (f (f init x0) x1) ... xn)
+  lseq* s = lseq_arg(a, 2);
+  lval* f = lval_pop(a, 0);
+  lval* acc = lval_take(a, 0);
+
+  lseq_iter* it = lseq_iter_new(s, e);
+  lval* x;
+  while (acc->type != LVAL_ERR && (x = lseq_next(it))) {
+    if (x->type == LVAL_ERR) {
+      lval_del(acc);
+      acc = x;
+      break;
+    }
+    acc = lval_call(e, f, lval_add(lval_add(lval_sexpr(), acc), x));
+  }
+
+  lseq_iter_del(it);
+  lseq_release(s);
+  lval_del(f);
+  return acc;
+}
+
+lval* builtin_gen(lenv* e, lval* a) {
+  LASSERT_NUM("gen", a, 1);
+  LASSERT_TYPE("gen", a, 0, LVAL_QEXPR);
+
+  lseq* s = lseq_new(LSEQ_GEN, NULL);
+  s->val = lval_take(a, 0);
+  s->env = lenv_copy_chain(e);
+  return lval_seq(s);
+}
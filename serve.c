@@ -0,0 +1,442 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lispy.h"
+
+// Server mode: requests come one per line, an id, a space and an
+// expression, from the server's input or from the clients of a Unix domain
+// socket. Readers queue them for a pool of workers, each a thread with an
+// interpreter of its own that evaluated the prelude first, so requests run
+// in parallel. A request sees the prelude but not what other requests
+// defined or switched with hashcons, par-args or fuse-debug; its own
+// definitions and switches go with it. An answer is the line
+// "id result", written as soon as its evaluation is done, so a client can
+// send requests without waiting for answers and gets them back in the
+// order they finish. A request that nests lambda calls too deep or runs
+// too long, as set in the options, is answered with an error and the
+// worker moves on. Once a client's input ends and it has every answer,
+// the server reports the latencies it saw, from reading a request to
+// writing its answer, on stderr.
+
+// requests read but not yet taken by a worker, readers wait beyond it
+#define LSERVE_QUEUE 4096
+
+typedef struct lserve lserve;
+
+typedef struct lserve_conn {
+  lserve* server;
+  // the reader and every request in flight
+  atomic_int refs;
+  int in;
+  int out;
+  int owned;
+  // answers are written whole, one at a time
+  pthread_mutex_t lock;
+  double* lat;
+  size_t count;
+  size_t size;
+  double first;
+  double last;
+} lserve_conn;
+
+typedef struct lserve_req {
+  lserve_conn* conn;
+  char* line;
+  double start;
+  struct lserve_req* next;
+} lserve_req;
+
+typedef struct lserve_worker {
+  lserve* server;
+  lispy_vm_t* vm;
+  // the interpreter's switches after the prelude, put back after each
+  // request
+  lispy_vm_flags_t flags;
+  pthread_t thread;
+} lserve_worker;
+
+struct lserve {
+  char** prelude;
+  int nprelude;
+  double timeout;
+  int depth;
+  lserve_worker* workers;
+  int nworkers;
+
+  pthread_mutex_t lock;
+  pthread_cond_t nonempty;
+  pthread_cond_t nonfull;
+  lserve_req* first;
+  lserve_req* last;
+  int queued;
+  int stopping;
+};
+
+static double lserve_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// writes all of buf, gives up when the other end is gone
+static void lserve_write(int fd, const char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+    buf += n;
+    len -= n;
+  }
+}
+
+// connections
+
+static lserve_conn* lserve_conn_new(lserve* s, int in, int out, int owned) {
+  lserve_conn* c = calloc(1, sizeof(lserve_conn));
+  c->server = s;
+  atomic_init(&c->refs, 1);
+  c->in = in;
+  c->out = out;
+  c->owned = owned;
+  pthread_mutex_init(&c->lock, NULL);
+  return c;
+}
+
+static int lserve_cmp(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// the latency below which a fraction p of the requests were answered
+static double lserve_percentile(double* lat, size_t n, double p) {
+  size_t i = (size_t)ceil(p * n);
+  return lat[i > 0 ? i - 1 : 0];
+}
+
+static void lserve_report(lserve_conn* c) {
+  if (!c->count)
+    return;
+  qsort(c->lat, c->count, sizeof(double), lserve_cmp);
+  double span = c->last - c->first;
+  fprintf(stderr,
+          "served %zu requests in %.3f s, %.0f/s, latency p50 %.3f ms, "
+          "p99 %.3f ms, max %.3f ms\n",
+          c->count, span, span > 0 ? c->count / span : 0.0,
+          lserve_percentile(c->lat, c->count, 0.5) * 1e3,
+          lserve_percentile(c->lat, c->count, 0.99) * 1e3,
+          c->lat[c->count - 1] * 1e3);
+}
+
+static void lserve_conn_release(lserve_conn* c) {
+  if (atomic_fetch_sub_explicit(&c->refs, 1, memory_order_acq_rel) != 1)
+    return;
+  lserve_report(c);
+  if (c->owned)
+    close(c->in);
+  pthread_mutex_destroy(&c->lock);
+  free(c->lat);
+  free(c);
+}
+
+// sends an answer to the request that came at start
+static void lserve_answer(lserve_conn* c, char* buf, size_t len,
+                          double start) {
+  pthread_mutex_lock(&c->lock);
+  lserve_write(c->out, buf, len);
+  double now = lserve_now();
+  if (c->count == c->size) {
+    c->size = c->size ? c->size * 2 : 1024;
+    c->lat = realloc(c->lat, sizeof(double) * c->size);
+  }
+  c->lat[c->count++] = now - start;
+  c->last = now;
+  pthread_mutex_unlock(&c->lock);
+}
+
+// queue
+
+static void lserve_push(lserve* s, lserve_req* r) {
+  pthread_mutex_lock(&s->lock);
+  while (s->queued >= LSERVE_QUEUE)
+    pthread_cond_wait(&s->nonfull, &s->lock);
+  r->next = NULL;
+  if (s->last)
+    s->last->next = r;
+  else
+    s->first = r;
+  s->last = r;
+  s->queued++;
+  pthread_cond_signal(&s->nonempty);
+  pthread_mutex_unlock(&s->lock);
+}
+
+// the oldest request, NULL once the server stops and none is left
+static lserve_req* lserve_pop(lserve* s) {
+  pthread_mutex_lock(&s->lock);
+  while (!s->first && !s->stopping)
+    pthread_cond_wait(&s->nonempty, &s->lock);
+  lserve_req* r = s->first;
+  if (r) {
+    s->first = r->next;
+    if (!s->first)
+      s->last = NULL;
+    s->queued--;
+    pthread_cond_signal(&s->nonfull);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return r;
+}
+
+// workers
+
+static void lserve_eval(lserve_worker* w, lserve_req* r) {
+  lispy_vm_t* vm = w->vm;
+  // "id expr", a line without a space is an id alone
+  char* expr = strchr(r->line, ' ');
+  int idlen = expr ? (int)(expr - r->line) : (int)strlen(r->line);
+  // definitions stay with the request, the prelude is the same for all
+  lenv* e = lenv_new();
+  e->par = lispy_vm_env(vm);
+  e->vm = vm;
+  e->isolated = 1;
+  llimit lim;
+  llimit_begin(&lim, w->server->timeout, w->server->depth);
+  lval* v = lispy_vm_eval_in(vm, e, "<request>", expr ? expr + 1 : "");
+  llimit_end();
+  lenv_del(e);
+  // nor what it switched on or off
+  lispy_vm_restore(vm, &w->flags);
+
+  char* buf;
+  size_t len;
+  FILE* f = open_memstream(&buf, &len);
+  fprintf(f, "%.*s ", idlen, r->line);
+  lval_fprint(f, v);
+  fputc('\n', f);
+  fclose(f);
+  lval_del(v);
+
+  lserve_answer(r->conn, buf, len, r->start);
+  free(buf);
+}
+
+static void* lserve_work(void* arg) {
+  lserve_worker* w = arg;
+  lserve_req* r;
+  while ((r = lserve_pop(w->server))) {
+    lserve_eval(w, r);
+    lserve_conn_release(r->conn);
+    free(r->line);
+    free(r);
+  }
+  return NULL;
+}
+
+// queues the requests c sends until its input ends
+static void lserve_read(lserve_conn* c) {
+  FILE* in = fdopen(dup(c->in), "r");
+  if (!in)
+    return;
+
+  char* line = NULL;
+  size_t size = 0;
+  ssize_t n;
+  while ((n = getline(&line, &size, in)) >= 0) {
+    while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+      line[--n] = '\0';
+    if (n == 0)
+      continue;
+
+    lserve_req* r = malloc(sizeof(lserve_req));
+    r->start = lserve_now();
+    r->line = strdup(line);
+    r->conn = c;
+    atomic_fetch_add_explicit(&c->refs, 1, memory_order_relaxed);
+    pthread_mutex_lock(&c->lock);
+    if (!c->first)
+      c->first = r->start;
+    pthread_mutex_unlock(&c->lock);
+    lserve_push(c->server, r);
+  }
+  free(line);
+  fclose(in);
+}
+
+static void* lserve_client(void* arg) {
+  lserve_conn* c = arg;
+  lserve_read(c);
+  lserve_conn_release(c);
+  return NULL;
+}
+
+// the prelude
+
+// reads the lines of path into s, 0 when it cannot be read
+static int lserve_load(lserve* s, const char* path) {
+  FILE* f = fopen(path, "r");
+  if (!f)
+    return 0;
+  char* line = NULL;
+  size_t size = 0;
+  ssize_t n;
+  while ((n = getline(&line, &size, f)) >= 0) {
+    while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+      line[--n] = '\0';
+    if (n == 0)
+      continue;
+    s->prelude = realloc(s->prelude, sizeof(char*) * (s->nprelude + 1));
+    s->prelude[s->nprelude++] = strdup(line);
+  }
+  free(line);
+  fclose(f);
+  return 1;
+}
+
+// an interpreter that evaluated the prelude, NULL when part of it failed
+static lispy_vm_t* lserve_vm_new(lserve* s) {
+  lispy_vm_t* vm = lispy_vm_new();
+  for (int i = 0; i < s->nprelude; ++i) {
+    lval* v = lispy_vm_eval(vm, "<prelude>", s->prelude[i]);
+    int failed = v->type == LVAL_ERR;
+    if (failed) {
+      fprintf(stderr, "prelude line %i: ", i + 1);
+      lval_fprint(stderr, v);
+      fputc('\n', stderr);
+    }
+    lval_del(v);
+    if (failed) {
+      lispy_vm_del(vm);
+      return NULL;
+    }
+  }
+  return vm;
+}
+
+static void lserve_start(lserve* s) {
+  for (int i = 0; i < s->nworkers; ++i)
+    pthread_create(&s->workers[i].thread, NULL, lserve_work, &s->workers[i]);
+}
+
+// lets the workers finish what is queued and waits for them
+static void lserve_stop(lserve* s) {
+  pthread_mutex_lock(&s->lock);
+  s->stopping = 1;
+  pthread_cond_broadcast(&s->nonempty);
+  pthread_mutex_unlock(&s->lock);
+  for (int i = 0; i < s->nworkers; ++i)
+    pthread_join(s->workers[i].thread, NULL);
+}
+
+static void lserve_del(lserve* s) {
+  for (int i = 0; i < s->nworkers; ++i)
+    if (s->workers[i].vm)
+      lispy_vm_del(s->workers[i].vm);
+  for (int i = 0; i < s->nprelude; ++i)
+    free(s->prelude[i]);
+  free(s->prelude);
+  free(s->workers);
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->nonempty);
+  pthread_cond_destroy(&s->nonfull);
+  free(s);
+}
+
+// a socket listening at path, -1 when it cannot be made
+static int lserve_bind(const char* path) {
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: socket path too long\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 64) < 0) {
+    perror(path);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// serves the clients of the socket fd, each read on a thread of its own,
+// until accepting fails
+static void lserve_accept(lserve* s, int fd) {
+  // a client leaving early must not take the server down with it
+  signal(SIGPIPE, SIG_IGN);
+
+  while (1) {
+    int client = accept(fd, NULL, NULL);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror("accept");
+      return;
+    }
+    pthread_t t;
+    pthread_create(&t, NULL, lserve_client,
+                   lserve_conn_new(s, client, client, 1));
+    pthread_detach(t);
+  }
+}
+
+int lispy_serve(const lispy_serve_opts* o) {
+  lserve* s = calloc(1, sizeof(lserve));
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->nonempty, NULL);
+  pthread_cond_init(&s->nonfull, NULL);
+  int n = o->workers > 0 ? o->workers : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  s->nworkers = MAX(n, 1);
+  s->workers = calloc(s->nworkers, sizeof(lserve_worker));
+  s->timeout = o->timeout;
+  s->depth = o->depth;
+
+  if (o->prelude && !lserve_load(s, o->prelude)) {
+    perror(o->prelude);
+    lserve_del(s);
+    return 1;
+  }
+  for (int i = 0; i < s->nworkers; ++i) {
+    s->workers[i].server = s;
+    if (!(s->workers[i].vm = lserve_vm_new(s))) {
+      lserve_del(s);
+      return 1;
+    }
+    s->workers[i].flags = lispy_vm_save(s->workers[i].vm);
+  }
+
+  if (o->socket) {
+    int fd = lserve_bind(o->socket);
+    if (fd < 0) {
+      lserve_del(s);
+      return 1;
+    }
+    lserve_start(s);
+    lserve_accept(s, fd);
+    // clients may still be reading, the server goes when the process does
+    close(fd);
+    unlink(o->socket);
+    return 1;
+  }
+
+  lserve_conn* c = lserve_conn_new(s, o->in, o->out, 0);
+  lserve_start(s);
+  lserve_read(c);
+  lserve_stop(s);
+  lserve_conn_release(c);
+  lserve_del(s);
+  return 0;
+}
@@ -0,0 +1,406 @@
+#include <stdatomic.h>
+
+#include "lispy.h"
+
+// Strings up to LSTR_SMALL - 1 bytes live inline in the lval. Longer ones
+// are ropes: immutable, reference counted trees whose leaves hold the bytes
+// and whose inner nodes are kept height balanced like an AVL tree. Joining
+// two ropes copies at most one short leaf plus a path of inner nodes, so
+// building a string piece by piece in a loop stays linear overall.
+
+// short leaves are merged on concatenation up to this size
+#define LROPE_CHUNK 256
+
+struct lrope {
+  atomic_int refs;
+  int len;
+  int height;
+  // inner nodes have both children, leaves neither
+  lrope* left;
+  lrope* right;
+  char chars[];
+};
+
+static lrope* lrope_leaf(const char* s, int len) {
+  lrope* r = malloc(sizeof(lrope) + len);
+  atomic_init(&r->refs, 1);
+  r->len = len;
+  r->height = 0;
+  r->left = NULL;
+  r->right = NULL;
+  memcpy(r->chars, s, len);
+  return r;
+}
+
+static lrope* lrope_retain(lrope* r) {
+  if (r)
+    atomic_fetch_add_explicit(&r->refs, 1, memory_order_relaxed);
+  return r;
+}
+
+static void lrope_release(lrope* r) {
+  while (r && atomic_fetch_sub_explicit(&r->refs, 1, memory_order_acq_rel) == 1) {
+    lrope* right = r->right;
+    lrope_release(r->left);
+    free(r);
+    // iterate down the right spine instead of recursing
+    r = right;
+  }
+}
+
+static int lrope_height(lrope* r) {
+  return r ? r->height : -1;
+}
+
+// takes ownership of both children
+static lrope* lrope_node(lrope* l, lrope* r) {
+  lrope* n = malloc(sizeof(lrope));
+  atomic_init(&n->refs, 1);
+  n->len = l->len + r->len;
+  n->height = 1 + MAX(l->height, r->height);
+  n->left = l;
+  n->right = r;
+  return n;
+}
+
+// builds a node from subtrees whose heights differ by at most two,
+// rotating to restore balance; takes ownership of both
+static lrope* lrope_balance(lrope* l, lrope* r) {
+  if (l->height > r->height + 1) {
+    lrope* ll = lrope_retain(l->left);
+    lrope* lr = lrope_retain(l->right);
+    lrope_release(l);
+    if (lrope_height(ll) >= lrope_height(lr))
+      return lrope_node(ll, lrope_node(lr, r));
+
+    lrope* lrl = lrope_retain(lr->left);
+    lrope* lrr = lrope_retain(lr->right);
+    lrope_release(lr);
+    return lrope_node(lrope_node(ll, lrl), lrope_node(lrr, r));
+  }
+
+  if (r->height > l->height + 1) {
+    lrope* rl = lrope_retain(r->left);
+    lrope* rr = lrope_retain(r->right);
+    lrope_release(r);
+    if (lrope_height(rr) >= lrope_height(rl))
+      return lrope_node(lrope_node(l, rl), rr);
+
+    lrope* rll = lrope_retain(rl->left);
+    lrope* rlr = lrope_retain(rl->right);
+    lrope_release(rl);
+    return lrope_node(lrope_node(l, rll), lrope_node(rlr, rr));
+  }
+
+  return lrope_node(l, r);
+}
+
+// concatenates two ropes, takes ownership of both
+static lrope* lrope_join(lrope* a, lrope* b) {
+  if (!a)
+    return b;
+  if (!b)
+    return a;
+
+  // two short leaves become one
+  if (a->height == 0 && b->height == 0 && a->len + b->len <= LROPE_CHUNK) {
+    lrope* r = malloc(sizeof(lrope) + a->len + b->len);
+    atomic_init(&r->refs, 1);
+    r->len = a->len + b->len;
+    r->height = 0;
+    r->left = NULL;
+    r->right = NULL;
+    memcpy(r->chars, a->chars, a->len);
+    memcpy(r->chars + a->len, b->chars, b->len);
+    lrope_release(a);
+    lrope_release(b);
+    return r;
+  }
+
+  // descend the facing spine of the taller tree, all the way down when the
+  // other side is a leaf so it can merge into the edge leaf
+  if (a->height > b->height + 1 || (b->height == 0 && a->height > 0)) {
+    lrope* l = lrope_retain(a->left);
+    lrope* r = lrope_join(lrope_retain(a->right), b);
+    lrope_release(a);
+    return lrope_balance(l, r);
+  }
+
+  if (b->height > a->height + 1 || (a->height == 0 && b->height > 0)) {
+    lrope* l = lrope_join(a, lrope_retain(b->left));
+    lrope* r = lrope_retain(b->right);
+    lrope_release(b);
+    return lrope_balance(l, r);
+  }
+
+  return lrope_node(a, b);
+}
+
+// the bytes [start, start + len) of r as a new rope sharing whole subtrees
+static lrope* lrope_slice(lrope* r, int start, int len) {
+  if (len <= 0)
+    return NULL;
+  if (start == 0 && len == r->len)
+    return lrope_retain(r);
+  if (r->height == 0)
+    return lrope_leaf(r->chars + start, len);
+
+  int llen = r->left->len;
+  if (start + len <= llen)
+    return lrope_slice(r->left, start, len);
+  if (start >= llen)
+    return lrope_slice(r->right, start - llen, len);
+
+  lrope* a = lrope_slice(r->left, start, llen - start);
+  lrope* b = lrope_slice(r->right, 0, start + len - llen);
+  return lrope_join(a, b);
+}
+
+// copies the bytes of r into 'out' in order
+static char* lrope_flatten(lrope* r, char* out) {
+  while (r->height > 0) {
+    out = lrope_flatten(r->left, out);
+    r = r->right;
+  }
+  memcpy(out, r->chars, r->len);
+  return out + r->len;
+}
+
+static void lstr_print_chars(FILE* f, const char* s, int len) {
+  for (int i = 0; i < len; ++i) {
+    switch (s[i]) {
+      case '"':
+        fputs("\\\"", f);
+        break;
+      case '\\':
+        fputs("\\\\", f);
+        break;
+      case '\n':
+        fputs("\\n", f);
+        break;
+      case '\t':
+        fputs("\\t", f);
+        break;
+      default:
+        fputc(s[i], f);
+    }
+  }
+}
+
+static void lrope_print(FILE* f, lrope* r) {
+  while (r->height > 0) {
+    lrope_print(f, r->left);
+    r = r->right;
+  }
+  lstr_print_chars(f, r->chars, r->len);
+}
+
+// string values
+
+lval* lval_str_n(const char* s, int len) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_STR;
+  v->count = len;
+  if (len < LSTR_SMALL) {
+    memcpy(v->small, s, len);
+    v->small[len] = '\0';
+    v->rope = NULL;
+  } else {
+    v->rope = lrope_leaf(s, len);
+  }
+  return v;
+}
+
+lval* lval_str(const char* s) {
+  return lval_str_n(s, strlen(s));
+}
+
+// the rope holding v's bytes, a new reference
+static lrope* lval_str_rope(lval* v) {
+  if (v->rope)
+    return lrope_retain(v->rope);
+  return v->count ? lrope_leaf(v->small, v->count) : NULL;
+}
+
+// takes ownership of r
+static lval* lval_str_from_rope(lrope* r) {
+  if (!r)
+    return lval_str_n("", 0);
+
+  if (r->len < LSTR_SMALL) {
+    char buf[LSTR_SMALL];
+    lrope_flatten(r, buf);
+    lval* v = lval_str_n(buf, r->len);
+    lrope_release(r);
+    return v;
+  }
+
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_STR;
+  v->count = r->len;
+  v->rope = r;
+  return v;
+}
+
+void lval_str_del(lval* v) {
+  lrope_release(v->rope);
+}
+
+void lval_str_copy(lval* x, lval* v) {
+  x->count = v->count;
+  x->rope = lrope_retain(v->rope);
+  if (!v->rope)
+    memcpy(x->small, v->small, v->count + 1);
+}
+
+// writes the bytes of v into 'out', which must hold count bytes
+void lval_str_flatten(lval* v, char* out) {
+  if (v->rope)
+    lrope_flatten(v->rope, out);
+  else
+    memcpy(out, v->small, v->count);
+}
+
+void lval_str_print(FILE* f, lval* v) {
+  fputc('"', f);
+  if (v->rope)
+    lrope_print(f, v->rope);
+  else
+    lstr_print_chars(f, v->small, v->count);
+  fputc('"', f);
+}
+
+lval* lval_read_str(mpc_ast_t* t) {
+  // drop the closing quote, then unescape what follows the opening one
+  t->contents[strlen(t->contents) - 1] = '\0';
+  char* unescaped = malloc(strlen(t->contents + 1) + 1);
+  strcpy(unescaped, t->contents + 1);
+  unescaped = mpcf_unescape(unescaped);
+  lval* str = lval_str(unescaped);
+  free(unescaped);
+  return str;
+}
+
+// builtins
+
+lval* builtin_str_len(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("str-len", a, 1);
+  LASSERT_TYPE("str-len", a, 0, LVAL_STR);
+
+  lval* x = lval_int(a->cell[0]->count);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_str_cat(lenv* e, lval* a) {
+  UNUSED(e);
+
+  for (int i = 0; i < a->count; ++i)
+    LASSERT_TYPE("str-cat", a, i, LVAL_STR);
+
+  lrope* r = NULL;
+  for (int i = 0; i < a->count; ++i)
+    r = lrope_join(r, lval_str_rope(a->cell[i]));
+
+  lval_del(a);
+  return lval_str_from_rope(r);
+}
+
+lval* builtin_str_sub(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("str-sub", a, 3);
+  LASSERT_TYPE("str-sub", a, 0, LVAL_STR);
+  LASSERT_TYPE("str-sub", a, 1, LVAL_NUM);
+  LASSERT_TYPE("str-sub", a, 2, LVAL_NUM);
+
+  lval* s = a->cell[0];
+  double start = a->cell[1]->num;
+  double len = a->cell[2]->num;
+  LASSERT(a, start >= 0 && len >= 0 && start + len <= s->count,
+          "Function 'str-sub': range [" LNUM_DBL_FMT ", " LNUM_DBL_FMT
+          ") is outside a string of length %i.",
+          start, start + len, s->count);
+
+  lval* x = NULL;
+  if (s->rope)
+    x = lval_str_from_rope(lrope_slice(s->rope, start, len));
+  else
+    x = lval_str_n(s->small + (int)start, len);
+
+  lval_del(a);
+  return x;
+}
+
+// the text of a number or symbol piece for str-build, 'buf' holds small
+// numbers and bignums are written to a new string returned in 'owned'
+static const char* lstr_piece(lval* v,
+                              char* buf,
+                              size_t size,
+                              int* len,
+                              char** owned) {
+  *owned = NULL;
+  if (v->type == LVAL_NUM) {
+    if (v->numt == LNUM_BIG) {
+      *owned = lval_big_str(v);
+      *len = strlen(*owned);
+      return *owned;
+    }
+    if (v->numt == LNUM_INT)
+      *len = snprintf(buf, size, "%" PRId64, v->inum);
+    else
+      *len = lnum_dbl_str(buf, v->num, 1);
+    return buf;
+  }
+  *len = strlen(v->sym);
+  return v->sym;
+}
+
+lval* builtin_str_build(lenv* e, lval* a) {
+  UNUSED(e);
+
+  for (int i = 0; i < a->count; ++i) {
+    lval_t t = a->cell[i]->type;
+    LASSERT(a, t == LVAL_STR || t == LVAL_NUM || t == LVAL_SYM,
+            "Function 'str-build': invalid argument type on %i. "
+            "Got %s, Expected %s, %s or %s.",
+            i, lval_t_name(t), lval_t_name(LVAL_STR), lval_t_name(LVAL_NUM),
+            lval_t_name(LVAL_SYM));
+  }
+
+  // measure every piece first so the result is written in one allocation
+  char num[64];
+  char* owned;
+  int len = 0;
+  for (int i = 0; i < a->count; ++i) {
+    int n = a->cell[i]->count;
+    if (a->cell[i]->type != LVAL_STR) {
+      lstr_piece(a->cell[i], num, sizeof(num), &n, &owned);
+      free(owned);
+    }
+    len += n;
+  }
+
+  char* buf = malloc(MAX(len, 1));
+  char* out = buf;
+  for (int i = 0; i < a->count; ++i) {
+    lval* v = a->cell[i];
+    if (v->type == LVAL_STR) {
+      lval_str_flatten(v, out);
+      out += v->count;
+    } else {
+      int n;
+      const char* s = lstr_piece(v, num, sizeof(num), &n, &owned);
+      memcpy(out, s, n);
+      out += n;
+      free(owned);
+    }
+  }
+
+  lval* x = lval_str_n(buf, len);
+  free(buf);
+  lval_del(a);
+  return x;
+}
@@ -0,0 +1,98 @@
+// Checks bignum products on both sides of the Karatsuba threshold, and that
+// dividing by zero is the same error on every path.
+
+#include "../lispy.h"
+
+static int failed = 0;
+
+// evaluates s and checks that it prints as expect
+static void check(lispy_vm_t* vm, const char* s, const char* expect) {
+  char* out = NULL;
+  size_t size = 0;
+  FILE* f = open_memstream(&out, &size);
+  lval* r = lispy_vm_eval(vm, "<test>", s);
+  lval_fprint(f, r);
+  lval_del(r);
+  fclose(f);
+  if (strcmp(out, expect) != 0) {
+    printf("%s: got %s, expected %s\n", s, out, expect);
+    failed++;
+  }
+  free(out);
+}
+
+// the decimal product of two decimal strings, by schoolbook, as a reference
+static char* dec_mul(const char* a, const char* b) {
+  int an = strlen(a), bn = strlen(b);
+  int* d = calloc(an + bn, sizeof(int));
+  for (int i = an - 1; i >= 0; --i)
+    for (int j = bn - 1; j >= 0; --j)
+      d[i + j + 1] += (a[i] - '0') * (b[j] - '0');
+  for (int k = an + bn - 1; k > 0; --k) {
+    d[k - 1] += d[k] / 10;
+    d[k] %= 10;
+  }
+
+  char* r = malloc(an + bn + 1);
+  int k = 0;
+  while (k < an + bn - 1 && d[k] == 0)
+    ++k;
+  int n = 0;
+  for (; k < an + bn; ++k)
+    r[n++] = '0' + d[k];
+  r[n] = '\0';
+  free(d);
+  return r;
+}
+
+// n random digits without a leading zero, or n nines to carry everywhere
+static char* digits(int n, int nines, unsigned* seed) {
+  char* s = malloc(n + 1);
+  for (int i = 0; i < n; ++i)
+    s[i] = nines ? '9' : '0' + rand_r(seed) % 10;
+  if (s[0] == '0')
+    s[0] = '1';
+  s[n] = '\0';
+  return s;
+}
+
+// checks x * y against the reference, lengths in decimal digits
+static void check_mul(lispy_vm_t* vm, int xn, int yn, int nines) {
+  unsigned seed = xn * 7919 + yn;
+  char* x = digits(xn, nines, &seed);
+  char* y = digits(yn, nines, &seed);
+  char* expect = dec_mul(x, y);
+  char* s = malloc(xn + yn + 4);
+  sprintf(s, "* %s %s", x, y);
+  check(vm, s, expect);
+  free(x);
+  free(y);
+  free(expect);
+  free(s);
+}
+
+int main(void) {
+  lispy_vm_t* vm = lispy_vm_new();
+
+  // division by zero, by an int, a double, a bignum's divisor or a matrix
+  check(vm, "/ 5 0", "Error: Division by zero");
+  check(vm, "/ 5 0.0", "Error: Division by zero");
+  check(vm, "/ 18446744073709551617 0", "Error: Division by zero");
+  check(vm, "m/ (list->mat {{1 2} {3 4}}) 0", "Error: Division by zero");
+  check(vm, "m/ (list->mat {{1 2} {3 4}}) (list->mat {{1 0} {3 4}})",
+        "Error: Division by zero");
+  check(vm, "m/ (list->mat {{1 2} {3 4}}) 2", "[[0.5 1] [1.5 2]]");
+
+  // Karatsuba takes over at 32 limbs in the shorter operand: 597 digits
+  // make 31 limbs, 616 make 32 and 617 make 33
+  int sizes[] = {40, 597, 616, 617, 640, 1300};
+  int count = sizeof(sizes) / sizeof(sizes[0]);
+  for (int i = 0; i < count; ++i)
+    for (int j = 0; j <= i; ++j) {
+      check_mul(vm, sizes[i], sizes[j], 0);
+      check_mul(vm, sizes[i], sizes[j], 1);
+    }
+
+  lispy_vm_del(vm);
+  return failed != 0;
+}
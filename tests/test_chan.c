@@ -0,0 +1,54 @@
+// Checks what closing a channel does: puts fail from then on, takes get
+// what was put before and fail once it is gone.
+
+#include "../lispy.h"
+
+static int failed = 0;
+
+// evaluates s and checks that it prints as expect
+static void check(lispy_vm_t* vm, const char* s, const char* expect) {
+  char* out = NULL;
+  size_t size = 0;
+  FILE* f = open_memstream(&out, &size);
+  lval* r = lispy_vm_eval(vm, "<test>", s);
+  lval_fprint(f, r);
+  lval_del(r);
+  fclose(f);
+  if (strcmp(out, expect) != 0) {
+    printf("%s: got %s, expected %s\n", s, out, expect);
+    failed++;
+  }
+  free(out);
+}
+
+int main(void) {
+  lispy_vm_t* vm = lispy_vm_new();
+
+  // put after close fails, take drains in order and then fails
+  check(vm, "def {c} (chan 4)", "()");
+  check(vm, "put! c 1", "()");
+  check(vm, "put! c {two}", "()");
+  check(vm, "close! c", "()");
+  check(vm, "put! c 3", "Error: Function 'put!': the channel is closed.");
+  check(vm, "take! c", "1");
+  check(vm, "take! c", "{two}");
+  check(vm, "take! c", "Error: Function 'take!': the channel is closed.");
+  check(vm, "take! c", "Error: Function 'take!': the channel is closed.");
+
+  // closing twice is harmless, and an empty channel fails takes at once
+  check(vm, "close! c", "()");
+  check(vm, "def {d} (chan 1)", "()");
+  check(vm, "close! d", "()");
+  check(vm, "take! d", "Error: Function 'take!': the channel is closed.");
+
+  // a put waiting on a full channel when it closes never lands
+  check(vm, "def {e} (chan 1)", "()");
+  check(vm, "put! e 1", "()");
+  check(vm, "spawn-proc {put! e 2}", "<proc>");
+  check(vm, "close! e", "()");
+  check(vm, "take! e", "1");
+  check(vm, "take! e", "Error: Function 'take!': the channel is closed.");
+
+  lispy_vm_del(vm);
+  return failed != 0;
+}
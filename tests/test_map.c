@@ -0,0 +1,108 @@
+// Checks hash maps through collisions and deletes down to an empty map,
+// and that earlier versions of a map are left alone by later updates.
+
+#include "../lispy.h"
+
+static int failed = 0;
+
+// evaluates s and checks that it prints as expect
+static void check(lispy_vm_t* vm, const char* s, const char* expect) {
+  char* out = NULL;
+  size_t size = 0;
+  FILE* f = open_memstream(&out, &size);
+  lval* r = lispy_vm_eval(vm, "<test>", s);
+  lval_fprint(f, r);
+  lval_del(r);
+  fclose(f);
+  if (strcmp(out, expect) != 0) {
+    printf("%s: got %s, expected %s\n", s, out, expect);
+    failed++;
+  }
+  free(out);
+}
+
+static void expect(int ok, const char* what, int i) {
+  if (!ok) {
+    printf("%s at %i\n", what, i);
+    failed++;
+  }
+}
+
+// key i: a symbol, or an int near 2^60 where every 256 ints round to the
+// same double and so share the whole hash
+static lval* key(int i) {
+  if (i % 2)
+    return lval_int(((int64_t)1 << 60) + i % 256 - 128 + (i / 256) * 256);
+  char s[16];
+  snprintf(s, sizeof(s), "k%i", i);
+  return lval_sym(s);
+}
+
+static int has(lval* m, int i, int value) {
+  lval* k = key(i);
+  lval* v = lval_map_get(m, k);
+  lval_del(k);
+  return value < 0 ? v == NULL : v && v->inum == value;
+}
+
+int main(void) {
+  lispy_vm_t* vm = lispy_vm_new();
+
+  // 2^60 - 1, 2^60 and 2^60 + 1 collide in full and stay distinct
+  check(vm,
+        "def {m} (hash-map {{1152921504606846975 a} {1152921504606846976 b} "
+        "{1152921504606846977 c} {x d}})",
+        "()");
+  check(vm, "hash-len m", "4");
+  check(vm, "hash-get m 1152921504606846975", "a");
+  check(vm, "hash-get m 1152921504606846977", "c");
+  check(vm, "hash-len (hash-del m 1152921504606846976)", "3");
+  check(vm, "hash-get (hash-del m 1152921504606846976) 1152921504606846977",
+        "c");
+  check(vm,
+        "hash-del (hash-del (hash-del (hash-del m 1152921504606846976) {x}) "
+        "1152921504606846975) 1152921504606846977",
+        "#{}");
+  check(vm, "== (hash-del (hash-map {{1 a}}) 1) (hash-map {})", "1");
+  check(vm, "hash-len m", "4");
+
+  // enough keys for a few trie levels, with every odd key in a collision
+  int n = 4000;
+  lval* m = lval_map();
+  for (int i = 0; i < n; ++i)
+    m = lval_map_put(m, key(i), lval_int(i));
+  expect(m->count == n, "count after puts", n);
+  for (int i = 0; i < n; ++i)
+    expect(has(m, i, i), "missing after puts", i);
+
+  // deleting from a copy leaves the original whole
+  lval* all = lval_copy(m);
+  for (int i = 0; i < n; i += 3) {
+    lval* k = key(i);
+    m = lval_map_remove(m, k);
+    lval_del(k);
+  }
+  for (int i = 0; i < n; ++i)
+    expect(has(m, i, i % 3 ? i : -1), "wrong after deleting thirds", i);
+
+  // deleting an absent key changes nothing
+  lval* k = key(0);
+  m = lval_map_remove(m, k);
+  lval_del(k);
+  expect(m->count == n - (n + 2) / 3, "count after deleting thirds", n);
+
+  for (int i = n - 1; i >= 0; --i) {
+    k = key(i);
+    m = lval_map_remove(m, k);
+    lval_del(k);
+  }
+  expect(m->count == 0 && m->map == NULL, "not empty after deletes", 0);
+  for (int i = 0; i < n; ++i)
+    expect(has(all, i, i), "original changed", i);
+  expect(all->count == n, "original count changed", n);
+
+  lval_del(m);
+  lval_del(all);
+  lispy_vm_del(vm);
+  return failed != 0;
+}
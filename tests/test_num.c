@@ -0,0 +1,64 @@
+// Checks that comparisons between ints, bignums and doubles are exact, also
+// where doubles can no longer hold every integer.
+
+#include "../lispy.h"
+
+static int failed = 0;
+
+// evaluates s and checks that it prints as expect
+static void check(lispy_vm_t* vm, const char* s, const char* expect) {
+  char* out = NULL;
+  size_t size = 0;
+  FILE* f = open_memstream(&out, &size);
+  lval* r = lispy_vm_eval(vm, "<test>", s);
+  lval_fprint(f, r);
+  lval_del(r);
+  fclose(f);
+  if (strcmp(out, expect) != 0) {
+    printf("%s: got %s, expected %s\n", s, out, expect);
+    failed++;
+  }
+  free(out);
+}
+
+int main(void) {
+  lispy_vm_t* vm = lispy_vm_new();
+
+  // 2^53 + 1 is the first int that rounds to a different double
+  check(vm, "< 9007199254740992.0 9007199254740993", "1");
+  check(vm, "> 9007199254740993 9007199254740992.0", "1");
+  check(vm, "<= 9007199254740993 9007199254740992.0", "0");
+  check(vm, "== 9007199254740992.0 9007199254740993", "0");
+  check(vm, "== 9007199254740992.0 9007199254740992", "1");
+  check(vm, "== -9007199254740993 -9007199254740992.0", "0");
+  check(vm, "< -9007199254740993 -9007199254740992.0", "1");
+
+  // bignums against doubles beyond the range of ints
+  check(vm, "== 18446744073709551616 18446744073709551616.0", "1");
+  check(vm, "> 18446744073709551617 18446744073709551616.0", "1");
+  check(vm, ">= 18446744073709551616.0 18446744073709551617", "0");
+  check(vm, "< -18446744073709551617 -18446744073709551616.0", "1");
+
+  // doubles with a fraction fall between two ints
+  check(vm, "< 2 2.5", "1");
+  check(vm, "> 3 2.5", "1");
+  check(vm, "> -2 -2.5", "1");
+  check(vm, "< -3 -2.5", "1");
+  check(vm, "== 2 2.5", "0");
+  check(vm, "== 0 -0.0", "1");
+
+  // lists compare their numbers the same way, equal? also tells the types
+  // apart, and hash map keys are equal as ==
+  check(vm, "== {9007199254740993} {9007199254740992.0}", "0");
+  check(vm, "== {9007199254740992} {9007199254740992.0}", "1");
+  check(vm, "equal? {9007199254740992} {9007199254740992.0}", "0");
+  check(vm, "equal? {9007199254740993} {9007199254740993}", "1");
+  check(vm,
+        "hash-len (hash-map {{9007199254740993 a} {9007199254740992.0 b}})",
+        "2");
+  check(vm, "hash-get (hash-map {{9007199254740992.0 b}}) 9007199254740993 0",
+        "0");
+
+  lispy_vm_del(vm);
+  return failed != 0;
+}
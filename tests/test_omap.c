@@ -0,0 +1,106 @@
+// Checks that ordered map keys keep their exact value: ints come back as
+// ints, and ints or bignums that round to the same double stay apart. Then
+// checks scans and lookups over a tree of many nodes.
+
+#include "../lispy.h"
+
+static int failed = 0;
+
+// evaluates s and checks that it prints as expect
+static void check(lispy_vm_t* vm, const char* s, const char* expect) {
+  char* out = NULL;
+  size_t size = 0;
+  FILE* f = open_memstream(&out, &size);
+  lval* r = lispy_vm_eval(vm, "<test>", s);
+  lval_fprint(f, r);
+  lval_del(r);
+  fclose(f);
+  if (strcmp(out, expect) != 0) {
+    printf("%s: got %s, expected %s\n", s, out, expect);
+    failed++;
+  }
+  free(out);
+}
+
+int main(void) {
+  lispy_vm_t* vm = lispy_vm_new();
+
+  // keys come back as the numbers they were put with
+  check(vm, "def {o} (omap {{2.5 b} {1 a}})", "()");
+  check(vm, "omap-min o", "{1 a}");
+  check(vm, "omap-max o", "{2.5 b}");
+  check(vm, "o", "#<1 a 2.5 b>");
+  check(vm, "omap-get o 1.0", "a");
+
+  // 2^53 and 2^53 + 1 share a double but are different keys
+  check(vm, "def {o} (omap-put o 9007199254740992 {c})", "()");
+  check(vm, "def {o} (omap-put o 9007199254740993 {d})", "()");
+  check(vm, "omap-len o", "4");
+  check(vm, "omap-get o 9007199254740992", "{c}");
+  check(vm, "omap-get o 9007199254740993", "{d}");
+  check(vm, "omap-get o 9007199254740992.0", "{c}");
+  check(vm, "omap-floor o 9007199254740994", "{9007199254740993 {d}}");
+  check(vm, "omap-ceil o 9007199254740992.0", "{9007199254740992 {c}}");
+  check(vm, "omap-range o 9007199254740993 9007199254740993",
+        "{{9007199254740993 {d}}}");
+
+  // and so do bignums next to the double they round to
+  check(vm, "def {o} (omap-put o 18446744073709551617 {e})", "()");
+  check(vm, "def {o} (omap-put o 18446744073709551616.0 {f})", "()");
+  check(vm, "omap-max o", "{18446744073709551617 {e}}");
+  check(vm, "omap-floor o 18446744073709551616",
+        "{1.8446744073709552e+19 {f}}");
+
+  // NaN has no place in the order, a bignum beyond doubles gives one
+  char nan[512] = "def {inf} (* 1.0 1";
+  memset(nan + strlen(nan), '0', 400);
+  strcpy(nan + strlen(nan), ")");
+  check(vm, nan, "()");
+  check(vm, "omap-put o (- inf inf) 1",
+        "Error: Function 'omap-put': key is NaN.");
+
+  // enough keys, put in a scrambled order, to split leaves and inner nodes
+  int n = 5000;
+  lval* m = lval_omap();
+  for (int i = 0; i < n; ++i) {
+    int j = (i * 2503) % n;
+    lval* k = lval_int(j * 10);
+    m = lval_omap_put(m, k, lval_int(j));
+    lval_del(k);
+  }
+  lval* sym = lval_sym("big");
+  lenv_put(lispy_vm_env(vm), sym, m);
+  lval_del(sym);
+  lval_del(m);
+  check(vm, "omap-len big", "5000");
+  check(vm, "omap-min big", "{0 0}");
+  check(vm, "omap-max big", "{49990 4999}");
+
+  // scans and bounds that cross from leaf to leaf
+  char s[64];
+  char want[4096];
+  for (int lo = 0; lo < n * 10; lo += 997) {
+    int hi = lo + 1200;
+    int len = sprintf(want, "{");
+    for (int k = (lo + 9) / 10 * 10; k <= hi && k < n * 10; k += 10)
+      len += sprintf(want + len, "%s{%i %i}", len > 1 ? " " : "", k, k / 10);
+    sprintf(want + len, "}");
+    sprintf(s, "omap-range big %i %i", lo, hi);
+    check(vm, s, want);
+  }
+  for (int k = 1; k < n * 10; k += 37) {
+    sprintf(s, "omap-floor big %i", k);
+    sprintf(want, "{%i %i}", k / 10 * 10, k / 10);
+    check(vm, s, want);
+    sprintf(s, "omap-ceil big %i", k);
+    int c = (k + 9) / 10;
+    if (c < n)
+      sprintf(want, "{%i %i}", c * 10, c);
+    else
+      sprintf(want, "{}");
+    check(vm, s, want);
+  }
+
+  lispy_vm_del(vm);
+  return failed != 0;
+}
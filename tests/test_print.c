@@ -0,0 +1,47 @@
+// Checks that numbers print so they read back as the same value, and that a
+// double never prints as an integer.
+
+#include "../lispy.h"
+
+static int failed = 0;
+
+// evaluates s and checks that it prints as expect
+static void check(lispy_vm_t* vm, const char* s, const char* expect) {
+  char* out = NULL;
+  size_t size = 0;
+  FILE* f = open_memstream(&out, &size);
+  lval* r = lispy_vm_eval(vm, "<test>", s);
+  lval_fprint(f, r);
+  lval_del(r);
+  fclose(f);
+  if (strcmp(out, expect) != 0) {
+    printf("%s: got %s, expected %s\n", s, out, expect);
+    failed++;
+  }
+  free(out);
+}
+
+int main(void) {
+  lispy_vm_t* vm = lispy_vm_new();
+
+  // doubles that differ in the 16th or 17th digit
+  check(vm, "+ 0.1 0.2", "0.30000000000000004");
+  check(vm, "- 0.3 (+ 0.1 0.2)", "-5.551115123125783e-17");
+  check(vm, "/ 1.0 3", "0.3333333333333333");
+  check(vm, "0.1", "0.1");
+
+  // whole doubles keep their point, integers do not get one
+  check(vm, "/ 6 2.0", "3.0");
+  check(vm, "- 2.5 2.5", "0.0");
+  check(vm, "* -1.0 4", "-4.0");
+  check(vm, "+ 1 2", "3");
+  check(vm, "{1.0 2}", "{1.0 2}");
+  check(vm, "str-build 2.0 \" \" 2", "\"2.0 2\"");
+
+  // what prints reads back as the same value
+  check(vm, "== (+ 0.1 0.2) 0.30000000000000004", "1");
+  check(vm, "== (/ 6 2.0) 3.0", "1");
+
+  lispy_vm_del(vm);
+  return failed != 0;
+}
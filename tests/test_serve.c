@@ -0,0 +1,134 @@
+// Sends the server requests one at a time, each after the answer to the
+// last, and checks that what one request defines or switches on does not
+// reach the next one on the same worker, and that one running away is
+// answered with an error and leaves the worker serving. Then checks that
+// a definition is not seen by a request of another connection running at
+// the same time.
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../lispy.h"
+
+static int failed = 0;
+
+typedef struct server {
+  lispy_serve_opts opts;
+  pthread_t thread;
+} server;
+
+static void* serve(void* arg) {
+  server* s = arg;
+  lispy_serve(&s->opts);
+  if (!s->opts.socket)
+    close(s->opts.out);
+  return NULL;
+}
+
+// a connection to the socket at path, retried while the server starts
+static int dial(const char* path) {
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  for (int i = 0; i < 500; ++i) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0)
+      return fd;
+    close(fd);
+    usleep(10000);
+  }
+  exit(1);
+}
+
+static void send_req(int in, const char* req) {
+  if (write(in, req, strlen(req)) < 0 || write(in, "\n", 1) < 0)
+    exit(1);
+}
+
+// reads an answer and checks that it is "id expect"
+static void expect_answer(FILE* out, const char* req, const char* expect) {
+  char* line = NULL;
+  size_t size = 0;
+  ssize_t n = getline(&line, &size, out);
+  if (n > 0 && line[n - 1] == '\n')
+    line[n - 1] = '\0';
+  if (n <= 0 || strcmp(line, expect) != 0) {
+    printf("%s: got %s, expected %s\n", req, n > 0 ? line : "nothing",
+           expect);
+    failed++;
+  }
+  free(line);
+}
+
+// sends "id expr" and checks that the answer is "id expect"
+static void check(int in, FILE* out, const char* req, const char* expect) {
+  send_req(in, req);
+  expect_answer(out, req, expect);
+}
+
+int main(void) {
+  // a prelude with a function slow enough to overlap two requests
+  char prelude[] = "/tmp/test_serve_XXXXXX";
+  int fd = mkstemp(prelude);
+  const char* fib =
+      "def {fib} (\\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}})\n";
+  if (fd < 0 || write(fd, fib, strlen(fib)) < 0)
+    return 1;
+  close(fd);
+
+  int in[2], out[2];
+  if (pipe(in) < 0 || pipe(out) < 0)
+    return 1;
+  // one worker, so every request runs on the same interpreter
+  server s = {{NULL, in[0], out[1], 1, prelude, 0.5, 200}, 0};
+  pthread_create(&s.thread, NULL, serve, &s);
+  FILE* answers = fdopen(out[0], "r");
+
+  // with hash-consing on, the literals of a request are interned as it is
+  // read, so the second request would count misses if the first one had
+  // left it on
+  check(in[1], answers, "1 hashcons 1", "1 ()");
+  check(in[1], answers, "2 hash-get (hashcons-stats {}) {misses}", "2 0");
+
+  // a definition goes with its request, the prelude's stay
+  check(in[1], answers, "3 def {x} 1", "3 ()");
+  check(in[1], answers, "4 x", "4 Error: Unbound symbol 'x'");
+  check(in[1], answers, "5 fib 10", "5 55");
+
+  // recursion without end, and a loop that takes too long, are answered
+  // with the limits' errors and the worker carries on
+  check(in[1], answers, "6 (\\ {f} {f f}) (\\ {f} {f f})",
+        "6 Error: Evaluation nested deeper than 200 calls.");
+  check(in[1], answers, "7 fib 100",
+        "7 Error: Evaluation ran longer than 0.5 s.");
+  check(in[1], answers, "8 fib 10", "8 55");
+
+  close(in[1]);
+  pthread_join(s.thread, NULL);
+  close(in[0]);
+  fclose(answers);
+
+  // two workers behind a socket, the server goes with the process
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/test_serve_%i.sock", (int)getpid());
+  server t = {{path, 0, 0, 2, prelude, 0, 0}, 0};
+  pthread_create(&t.thread, NULL, serve, &t);
+  int a = dial(path);
+  int b = dial(path);
+  FILE* a_answers = fdopen(a, "r");
+  FILE* b_answers = fdopen(b, "r");
+
+  // a defines y and keeps computing while b looks for it
+  send_req(a, "a1 (\\ {z} {+ (* 0 (fib 22)) y}) (def {y} 5)");
+  check(b, b_answers, "b1 y", "b1 Error: Unbound symbol 'y'");
+  expect_answer(a_answers, "a1", "a1 5");
+  check(a, a_answers, "a2 y", "a2 Error: Unbound symbol 'y'");
+
+  fclose(a_answers);
+  fclose(b_answers);
+  unlink(path);
+  unlink(prelude);
+  return failed != 0;
+}
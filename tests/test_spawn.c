@@ -0,0 +1,78 @@
+// Checks that spawned futures and processes see the global bindings as they
+// were when spawned, whether the pool runs them right away on one thread
+// or later on another. Each thread count runs in a child process of its
+// own, since the pool is sized once.
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../lispy.h"
+
+static int failed = 0;
+
+// evaluates s and checks that it prints as expect
+static void check(lispy_vm_t* vm, const char* s, const char* expect) {
+  char* out = NULL;
+  size_t size = 0;
+  FILE* f = open_memstream(&out, &size);
+  lval* r = lispy_vm_eval(vm, "<test>", s);
+  lval_fprint(f, r);
+  lval_del(r);
+  fclose(f);
+  if (strcmp(out, expect) != 0) {
+    printf("%s: got %s, expected %s\n", s, out, expect);
+    failed++;
+  }
+  free(out);
+}
+
+static void run(void) {
+  lispy_vm_t* vm = lispy_vm_new();
+  check(vm,
+        "def {fib} (\\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}})",
+        "()");
+
+  // a def after the spawn is not seen, however long the task takes
+  check(vm, "def {v} 1", "()");
+  check(vm, "def {f} (spawn {+ (* 0 (fib 20)) v})", "()");
+  check(vm, "def {v} 1000", "()");
+  check(vm, "await f", "1");
+
+  // one before it is
+  check(vm, "def {g} (spawn {+ (* 0 (fib 15)) v})", "()");
+  check(vm, "await g", "1000");
+
+  // a task spawned by a task sees what its parent saw
+  check(vm, "def {w} 5", "()");
+  check(vm, "def {h} (spawn {spawn {+ (* 0 (fib 15)) w}})", "()");
+  check(vm, "def {w} 6", "()");
+  check(vm, "await (await h)", "5");
+
+  // processes the same
+  check(vm, "def {parent} self", "()");
+  check(vm, "def {v} 2", "()");
+  check(vm, "spawn-proc {send parent (+ (* 0 (fib 20)) v)}", "<proc>");
+  check(vm, "def {v} 3", "()");
+  check(vm, "receive self", "2");
+
+  lispy_vm_del(vm);
+}
+
+int main(void) {
+  const char* threads[] = {"1", "4"};
+  int status = 0;
+  for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); ++i) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      setenv("LISPY_THREADS", threads[i], 1);
+      run();
+      if (failed)
+        printf("with %s threads\n", threads[i]);
+      return failed != 0;
+    }
+    int s;
+    waitpid(pid, &s, 0);
+    status |= !WIFEXITED(s) || WEXITSTATUS(s) != 0;
+  }
+  return status;
+}
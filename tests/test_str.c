@@ -0,0 +1,76 @@
+// Checks strings on both sides of the inline size, and str-cat and str-sub
+// across the leaves and inner nodes of ropes against a flat copy.
+
+#include "../lispy.h"
+
+static int failed = 0;
+
+// evaluates s and checks that it prints as expect
+static void check(lispy_vm_t* vm, const char* s, const char* expect) {
+  char* out = NULL;
+  size_t size = 0;
+  FILE* f = open_memstream(&out, &size);
+  lval* r = lispy_vm_eval(vm, "<test>", s);
+  lval_fprint(f, r);
+  lval_del(r);
+  fclose(f);
+  if (strcmp(out, expect) != 0) {
+    printf("%s: got %s, expected %s\n", s, out, expect);
+    failed++;
+  }
+  free(out);
+}
+
+int main(void) {
+  lispy_vm_t* vm = lispy_vm_new();
+
+  // 15 bytes still fit inline, 16 make a rope, either way they are equal
+  check(vm, "str-cat \"abcdefg\" \"hijklmno\"", "\"abcdefghijklmno\"");
+  check(vm, "str-cat \"abcdefgh\" \"hijklmno\"", "\"abcdefghhijklmno\"");
+  check(vm, "== (str-cat \"abcdefgh\" \"ijklmnop\") \"abcdefghijklmnop\"", "1");
+  check(vm, "str-sub \"abcdefghijklmnop\" 1 15", "\"bcdefghijklmnop\"");
+  check(vm, "str-sub \"abcdefghijklmnop\" 0 16", "\"abcdefghijklmnop\"");
+  check(vm, "str-len (str-sub (str-cat \"abcdefghijklmnop\" \"q\") 2 15)",
+        "15");
+  check(vm, "str-cat \"\" \"\"", "\"\"");
+
+  // pieces of every length up to past the leaf size, so short leaves merge
+  // and long ones hang off inner nodes
+  int n = 0;
+  char* flat = malloc(64 * 1024);
+  char* s = malloc(1024);
+  char* want = malloc(64 * 1024 + 3);
+  check(vm, "def {s} \"\"", "()");
+  for (int i = 1; n + 300 < 60 * 1024; i = i * 7 % 311) {
+    int len = sprintf(s, "def {s} (str-cat s \"");
+    for (int j = 0; j < i; ++j, ++n)
+      s[len++] = flat[n] = 'a' + (n + i) % 26;
+    sprintf(s + len, "\")");
+    check(vm, s, "()");
+  }
+  sprintf(s, "str-len s");
+  sprintf(want, "%i", n);
+  check(vm, s, want);
+
+  // slices at every scale, including the ones that come out inline
+  int lens[] = {0, 1, 15, 16, 17, 255, 256, 257, 1000, 5000};
+  for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); ++l)
+    for (int start = 0; start + lens[l] <= n; start += 1733) {
+      sprintf(s, "str-sub s %i %i", start, lens[l]);
+      sprintf(want, "\"%.*s\"", lens[l], flat + start);
+      check(vm, s, want);
+    }
+
+  // a rope joined with slices of itself
+  check(vm, "def {t} (str-cat (str-sub s 100 3000) s (str-sub s 7 9))", "()");
+  int len = sprintf(want, "\"%.*s", 3000, flat + 100);
+  len += sprintf(want + len, "%.*s", n, flat);
+  sprintf(want + len, "%.*s\"", 9, flat + 7);
+  check(vm, "t", want);
+
+  free(flat);
+  free(s);
+  free(want);
+  lispy_vm_del(vm);
+  return failed != 0;
+}
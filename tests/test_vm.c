@@ -0,0 +1,78 @@
+// Checks that interpreters keep their hash-consing to themselves: turning
+// it on in one leaves another untouched, and values interned by one outlive
+// it. Then that the switches evaluation flips are put back by
+// lispy_vm_restore.
+
+#include "../lispy.h"
+
+static int failed = 0;
+
+// evaluates s and checks that it prints as expect
+static void check(lispy_vm_t* vm, const char* s, const char* expect) {
+  char* out = NULL;
+  size_t size = 0;
+  FILE* f = open_memstream(&out, &size);
+  lval* r = lispy_vm_eval(vm, "<test>", s);
+  lval_fprint(f, r);
+  lval_del(r);
+  fclose(f);
+  if (strcmp(out, expect) != 0) {
+    printf("%s: got %s, expected %s\n", s, out, expect);
+    failed++;
+  }
+  free(out);
+}
+
+int main(void) {
+  lispy_vm_t* a = lispy_vm_new();
+  lispy_vm_t* b = lispy_vm_new();
+
+  check(a, "hashcons 1", "()");
+  check(a, "def {x} {1 2 3}", "()");
+  check(a, "def {y} {1 2 3}", "()");
+  check(b, "def {x} {1 2 3}", "()");
+  check(b, "def {y} {1 2 3}", "()");
+
+  // a shares the second list with the first, b never interned anything
+  check(a, "hash-get (hashcons-stats {}) {hits}", "1");
+  check(b, "hash-get (hashcons-stats {}) {hits}", "0");
+  check(b, "hash-get (hashcons-stats {}) {entries}", "0");
+
+  // and turning it off in b leaves a on
+  check(b, "hashcons 0", "()");
+  check(a, "def {z} {1 2 3}", "()");
+  check(a, "hash-get (hashcons-stats {}) {hits}", "2");
+
+  // a value interned by a is still good once a is gone
+  lval* x = lispy_vm_eval(a, "<test>", "x");
+  lispy_vm_del(a);
+  lval* y = lval_copy(x);
+  lval_del(x);
+  if (y->type != LVAL_QEXPR || y->count != 3) {
+    printf("x did not outlive its interpreter\n");
+    failed++;
+  }
+  lval_del(y);
+
+  lispy_vm_flags_t saved = lispy_vm_save(b);
+  check(b, "hashcons 1", "()");
+  check(b, "par-args 1", "()");
+  check(b, "fuse-debug 1", "()");
+  // a formal named after a builtin shadows it
+  check(b, "(\\ {+} {+}) 1", "1");
+  lispy_vm_flags_t set = lispy_vm_save(b);
+  if (!set.hashcons || !set.par_args || !set.fuse_debug ||
+      !set.opt_shadowed || !set.par_shadowed) {
+    printf("switches were not set\n");
+    failed++;
+  }
+  lispy_vm_restore(b, &saved);
+  lispy_vm_flags_t back = lispy_vm_save(b);
+  if (memcmp(&back, &saved, sizeof(saved)) != 0) {
+    printf("switches were not put back\n");
+    failed++;
+  }
+
+  lispy_vm_del(b);
+  return failed != 0;
+}
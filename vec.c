@@ -0,0 +1,326 @@
+#include "lispy.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// vector elements are kept in one aligned block so that SIMD loads in the
+// kernels below never straddle a cache line; the kernels themselves also
+// accept unaligned pointers such as matrix rows
+#define LVEC_ALIGN 32
+
+double* lvec_alloc(int n) {
+  // aligned_alloc wants the size to be a multiple of the alignment
+  size_t size = sizeof(double) * MAX(n, 1);
+  size = (size + LVEC_ALIGN - 1) & ~(size_t)(LVEC_ALIGN - 1);
+  return aligned_alloc(LVEC_ALIGN, size);
+}
+
+lval* lval_vec(int n) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_VEC;
+  v->count = n;
+  v->rows = 1;
+  v->cols = n;
+  v->data = lvec_alloc(n);
+  return v;
+}
+
+// kernels
+
+double lvec_sum(const double* restrict x, int n) {
+  int i = 0;
+#ifdef __SSE2__
+  __m128d s0 = _mm_setzero_pd();
+  __m128d s1 = _mm_setzero_pd();
+  for (; i + 4 <= n; i += 4) {
+    s0 = _mm_add_pd(s0, _mm_loadu_pd(x + i));
+    s1 = _mm_add_pd(s1, _mm_loadu_pd(x + i + 2));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(s0, s1));
+  double s = lanes[0] + lanes[1];
+#else
+  // independent accumulators let the compiler vectorize the loop
+  double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  for (; i + 4 <= n; i += 4) {
+    s0 += x[i];
+    s1 += x[i + 1];
+    s2 += x[i + 2];
+    s3 += x[i + 3];
+  }
+  double s = (s0 + s1) + (s2 + s3);
+#endif
+  for (; i < n; ++i)
+    s += x[i];
+  return s;
+}
+
+static double lvec_dot(const double* restrict x,
+                       const double* restrict y,
+                       int n) {
+  int i = 0;
+#ifdef __SSE2__
+  __m128d s0 = _mm_setzero_pd();
+  __m128d s1 = _mm_setzero_pd();
+  for (; i + 4 <= n; i += 4) {
+    s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+    s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(x + i + 2),
+                                   _mm_loadu_pd(y + i + 2)));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(s0, s1));
+  double s = lanes[0] + lanes[1];
+#else
+  double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  for (; i + 4 <= n; i += 4) {
+    s0 += x[i] * y[i];
+    s1 += x[i + 1] * y[i + 1];
+    s2 += x[i + 2] * y[i + 2];
+    s3 += x[i + 3] * y[i + 3];
+  }
+  double s = (s0 + s1) + (s2 + s3);
+#endif
+  for (; i < n; ++i)
+    s += x[i] * y[i];
+  return s;
+}
+
+static void lvec_scale(double* restrict x, double k, int n) {
+  for (int i = 0; i < n; ++i)
+    x[i] *= k;
+}
+
+static void lvec_add(double* restrict x, const double* restrict y, int n) {
+  for (int i = 0; i < n; ++i)
+    x[i] += y[i];
+}
+
+// assumes n > 0
+double lvec_min(const double* restrict x, int n) {
+  int i = 0;
+  double m = x[0];
+#ifdef __SSE2__
+  if (n >= 2) {
+    __m128d m0 = _mm_loadu_pd(x);
+    for (i = 2; i + 2 <= n; i += 2)
+      m0 = _mm_min_pd(m0, _mm_loadu_pd(x + i));
+    double lanes[2];
+    _mm_storeu_pd(lanes, m0);
+    m = MIN(lanes[0], lanes[1]);
+  }
+#endif
+  for (; i < n; ++i)
+    m = MIN(m, x[i]);
+  return m;
+}
+
+// assumes n > 0
+double lvec_max(const double* restrict x, int n) {
+  int i = 0;
+  double m = x[0];
+#ifdef __SSE2__
+  if (n >= 2) {
+    __m128d m0 = _mm_loadu_pd(x);
+    for (i = 2; i + 2 <= n; i += 2)
+      m0 = _mm_max_pd(m0, _mm_loadu_pd(x + i));
+    double lanes[2];
+    _mm_storeu_pd(lanes, m0);
+    m = MAX(lanes[0], lanes[1]);
+  }
+#endif
+  for (; i < n; ++i)
+    m = MAX(m, x[i]);
+  return m;
+}
+
+// builtins
+
+lval* builtin_vec(lenv* e, lval* a) {
+  UNUSED(e);
+
+  for (int i = 0; i < a->count; ++i)
+    LASSERT_TYPE("vec", a, i, LVAL_NUM);
+
+  lval* v = lval_vec(a->count);
+  for (int i = 0; i < a->count; ++i)
+    v->data[i] = a->cell[i]->num;
+
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_list_to_vec(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("list->vec", a, 1);
+  LASSERT_TYPE("list->vec", a, 0, LVAL_QEXPR);
+
+  lval* q = a->cell[0];
+  if (!lval_packed(q))
+    for (int i = 0; i < q->count; ++i)
+      LASSERT(a, q->cell[i]->type == LVAL_NUM,
+              "Function 'list->vec': invalid element type on %i. "
+              "Got %s, Expected %s.",
+              i, lval_t_name(q->cell[i]->type), lval_t_name(LVAL_NUM));
+
+  lval* v = lval_vec(q->count);
+  if (q->dbls) {
+    memcpy(v->data, q->dbls, sizeof(double) * q->count);
+  } else if (q->ints) {
+    for (int i = 0; i < q->count; ++i)
+      v->data[i] = q->ints[i];
+  } else {
+    for (int i = 0; i < q->count; ++i)
+      v->data[i] = q->cell[i]->num;
+  }
+
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_vec_to_list(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("vec->list", a, 1);
+  LASSERT_TYPE("vec->list", a, 0, LVAL_VEC);
+
+  lval* v = lval_take(a, 0);
+  lval* q = lval_qexpr();
+  for (int i = 0; i < v->count; ++i)
+    q = lval_add(q, lval_num(v->data[i]));
+
+  lval_del(v);
+  return q;
+}
+
+lval* builtin_vlen(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("vlen", a, 1);
+  LASSERT_TYPE("vlen", a, 0, LVAL_VEC);
+
+  lval* x = lval_int(a->cell[0]->count);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_vsum(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("vsum", a, 1);
+  LASSERT_TYPE("vsum", a, 0, LVAL_VEC);
+
+  lval* v = a->cell[0];
+  lval* x = lval_num(lvec_sum(v->data, v->count));
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_vdot(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("vdot", a, 2);
+  LASSERT_TYPE("vdot", a, 0, LVAL_VEC);
+  LASSERT_TYPE("vdot", a, 1, LVAL_VEC);
+
+  lval* v = a->cell[0];
+  lval* w = a->cell[1];
+  LASSERT(a, v->count == w->count,
+          "Function 'vdot': length mismatch. Got %i and %i.", v->count,
+          w->count);
+
+  lval* x = lval_num(lvec_dot(v->data, w->data, v->count));
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_vscale(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("vscale", a, 2);
+  LASSERT_TYPE("vscale", a, 0, LVAL_VEC);
+  LASSERT_TYPE("vscale", a, 1, LVAL_NUM);
+
+  // scale the argument in place, it is ours to modify
+  lval* v = lval_pop(a, 0);
+  lvec_scale(v->data, a->cell[0]->num, v->count);
+
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_vadd(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("vadd", a, 2);
+  LASSERT_TYPE("vadd", a, 0, LVAL_VEC);
+  LASSERT_TYPE("vadd", a, 1, LVAL_VEC);
+  LASSERT(a, a->cell[0]->count == a->cell[1]->count,
+          "Function 'vadd': length mismatch. Got %i and %i.",
+          a->cell[0]->count, a->cell[1]->count);
+
+  lval* v = lval_pop(a, 0);
+  lvec_add(v->data, a->cell[0]->data, v->count);
+
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_vmap(lenv* e, lval* a) {
+  LASSERT_NUM("vmap", a, 2);
+  LASSERT_TYPE("vmap", a, 0, LVAL_FUN);
+  LASSERT_TYPE("vmap", a, 1, LVAL_VEC);
+
+  lval* f = lval_pop(a, 0);
+  lval* v = lval_take(a, 0);
+
+  for (int i = 0; i < v->count; ++i) {
+    lval* r = lval_call(e, f, lval_add(lval_sexpr(), lval_num(v->data[i])));
+
+    if (r->type != LVAL_NUM) {
+      if (r->type != LVAL_ERR) {
+        lval* err = lval_err(
+            "Function 'vmap': function returned %s, Expected %s.",
+            lval_t_name(r->type), lval_t_name(LVAL_NUM));
+        lval_del(r);
+        r = err;
+      }
+      lval_del(f);
+      lval_del(v);
+      return r;
+    }
+
+    v->data[i] = r->num;
+    lval_del(r);
+  }
+
+  lval_del(f);
+  return v;
+}
+
+lval* builtin_vmin(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("vmin", a, 1);
+  LASSERT_TYPE("vmin", a, 0, LVAL_VEC);
+  LASSERT_NOT_EMPTY("vmin", a, 0);
+
+  lval* v = a->cell[0];
+  lval* x = lval_num(lvec_min(v->data, v->count));
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_vmax(lenv* e, lval* a) {
+  UNUSED(e);
+
+  LASSERT_NUM("vmax", a, 1);
+  LASSERT_TYPE("vmax", a, 0, LVAL_VEC);
+  LASSERT_NOT_EMPTY("vmax", a, 0);
+
+  lval* v = a->cell[0];
+  lval* x = lval_num(lvec_max(v->data, v->count));
+  lval_del(a);
+  return x;
+}
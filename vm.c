@@ -0,0 +1,183 @@
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "lispy.h"
+
+// An interpreter instance: the grammar, the global environment with the
+// optimizer and parallel evaluation state that go with it, and counters.
+// Nothing here is shared between instances, so separate threads may each
+// run their own; within one, the global environment is read without locks
+// by the tasks, futures and processes it started. The thread pool and the
+// reclamation in rcu.c are shared by the process, both are safe to use from
+// several interpreters at once.
+
+static const char* lispy_grammar =
+    "\
+    number  : /-?[0-9]+(\\.[0-9]+)?/ ; \
+    symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&?]+/ ; \
+    string  : /\"(\\\\.|[^\"])*\"/ ; \
+    sexpr   : '(' <expr>* ')' ; \
+    qexpr   : '{' <expr>* '}' ; \
+    expr    : <number> | <symbol> | <string> | <sexpr> | <qexpr> ; \
+    lispy   : /^/ <expr>* /$/ ; ";
+
+struct lispy_vm {
+  mpc_parser_t* number;
+  mpc_parser_t* symbol;
+  mpc_parser_t* string;
+  mpc_parser_t* sexpr;
+  mpc_parser_t* qexpr;
+  mpc_parser_t* expr;
+  mpc_parser_t* lispy;
+
+  lenv* env;
+  lopt_state* opt;
+  lpar_state* par;
+  lproc_group* procs;
+  lcons_table* cons;
+  lispy_vm_stats_t stats;
+  // tasks still evaluating on the pool with environments of this instance
+  atomic_int tasks;
+};
+
+static double lispy_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+lispy_vm_t* lispy_vm_new(void) {
+  double start = lispy_now();
+  lispy_vm_t* vm = calloc(1, sizeof(lispy_vm_t));
+
+  vm->number = mpc_new("number");
+  vm->symbol = mpc_new("symbol");
+  vm->string = mpc_new("string");
+  vm->sexpr = mpc_new("sexpr");
+  vm->qexpr = mpc_new("qexpr");
+  vm->expr = mpc_new("expr");
+  vm->lispy = mpc_new("lispy");
+  mpca_lang(MPCA_LANG_DEFAULT, lispy_grammar, vm->number, vm->symbol,
+            vm->string, vm->sexpr, vm->qexpr, vm->expr, vm->lispy);
+
+  atomic_init(&vm->tasks, 0);
+  vm->opt = lopt_state_new();
+  vm->par = lpar_state_new();
+  vm->procs = lproc_group_new();
+  vm->cons = lcons_table_new();
+  vm->env = lenv_new();
+  vm->env->vm = vm;
+  vm->env->shared = 1;
+  lenv_add_builtins(vm->env);
+  lproc_bind_root(vm->env);
+
+  vm->stats.startup = lispy_now() - start;
+  return vm;
+}
+
+void lispy_vm_del(lispy_vm_t* vm) {
+  // processes still waiting for messages are stopped, and spawned
+  // evaluations nobody awaited still refer to the instance
+  lproc_group_stop(vm->procs);
+  while (atomic_load_explicit(&vm->tasks, memory_order_acquire) > 0)
+    if (!lpool_help(lpool_global()))
+      sched_yield();
+
+  lenv_del(vm->env);
+  lopt_state_del(vm->opt);
+  lpar_state_del(vm->par);
+  lproc_group_del(vm->procs);
+  lcons_table_del(vm->cons);
+  mpc_cleanup(7, vm->number, vm->symbol, vm->string, vm->sexpr, vm->qexpr,
+              vm->expr, vm->lispy);
+  free(vm);
+}
+
+lenv* lispy_vm_env(lispy_vm_t* vm) {
+  return vm->env;
+}
+
+lopt_state* lispy_vm_opt(lispy_vm_t* vm) {
+  return vm->opt;
+}
+
+lpar_state* lispy_vm_par(lispy_vm_t* vm) {
+  return vm->par;
+}
+
+lproc_group* lispy_vm_procs(lispy_vm_t* vm) {
+  return vm->procs;
+}
+
+lcons_table* lispy_vm_cons(lispy_vm_t* vm) {
+  return vm->cons;
+}
+
+// counts a task started with an environment of the instance
+void lispy_vm_hold(lispy_vm_t* vm) {
+  if (vm)
+    atomic_fetch_add_explicit(&vm->tasks, 1, memory_order_relaxed);
+}
+
+void lispy_vm_unhold(lispy_vm_t* vm) {
+  if (vm)
+    atomic_fetch_sub_explicit(&vm->tasks, 1, memory_order_release);
+}
+
+lispy_vm_stats_t lispy_vm_stats(lispy_vm_t* vm) {
+  return vm->stats;
+}
+
+// the switches of the instance, for lispy_vm_restore to put back
+lispy_vm_flags_t lispy_vm_save(lispy_vm_t* vm) {
+  lispy_vm_flags_t f;
+  lcons_table_save(vm->cons, &f);
+  lpar_state_save(vm->par, &f);
+  lopt_state_save(vm->opt, &f);
+  return f;
+}
+
+// puts back the switches saved by lispy_vm_save. A shadowing binding made
+// since then is only known to be gone when nothing started with the
+// instance's environments still runs, until then the flags stay set.
+void lispy_vm_restore(lispy_vm_t* vm, const lispy_vm_flags_t* f) {
+  lispy_vm_flags_t g = *f;
+  if (atomic_load_explicit(&vm->tasks, memory_order_acquire) > 0) {
+    lispy_vm_flags_t now = lispy_vm_save(vm);
+    g.opt_shadowed |= now.opt_shadowed;
+    g.par_shadowed |= now.par_shadowed;
+  }
+  lcons_table_restore(vm->cons, &g);
+  lpar_state_restore(vm->par, &g);
+  lopt_state_restore(vm->opt, &g);
+}
+
+// parses and evaluates input, a parse error is returned as an error value
+lval* lispy_vm_eval(lispy_vm_t* vm, const char* filename, const char* input) {
+  return lispy_vm_eval_in(vm, vm->env, filename, input);
+}
+
+// the same in e, an environment below the instance's global one
+lval* lispy_vm_eval_in(lispy_vm_t* vm, lenv* e, const char* filename,
+                       const char* input) {
+  mpc_result_t r;
+  if (!mpc_parse(filename, input, vm->lispy, &r)) {
+    char* msg = mpc_err_string(r.error);
+    msg[strcspn(msg, "\n")] = '\0';
+    lval* err = lval_err("%s", msg);
+    free(msg);
+    mpc_err_delete(r.error);
+    vm->stats.parse_errors++;
+    return err;
+  }
+
+  lval* v = lval_read(vm->cons, r.output);
+  mpc_ast_delete(r.output);
+
+  lval* result = lval_eval(e, lval_optimize(e, v));
+  vm->stats.evals++;
+  if (result->type == LVAL_ERR)
+    vm->stats.errors++;
+  return result;
+}